@@ -0,0 +1,414 @@
+#define _POSIX_C_SOURCE 200809L
+
+// Latency benchmark: runs allocation workloads against each strategy and
+// reports per-op latency percentiles.
+//
+//   tdmm_bench [--workload churn,lifo,fifo,powerlaw|all] [--strategy NAME,...|all]
+//              [--min-size N] [--max-size N] [--ops N] [--live N] [--seed N]
+//              [--pages default|thp|hugetlb] [--format csv|json] [--out FILE]
+//
+// Every call is timed on its own with the cycle counter (converted with a
+// calibrated rate, minus the cost of reading it), and each run's total
+// wall time is taken from CLOCK_MONOTONIC. The page backing the heap actually
+// got is sampled once per run, while the live set is still allocated.
+//
+// The tdmm_bench_<strategy> builds link a library compiled for that strategy
+// alone and run only it.
+#include "tdmm.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#else
+#define HAVE_TSC 0
+#endif
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t xorshift32(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// ---- Timer ----
+
+static double g_ns_per_tick = 1.0;
+static uint64_t g_tick_overhead = 0;
+
+static inline uint64_t ticks(void) {
+#if HAVE_TSC
+    uint64_t t = __rdtsc();
+    __asm__ __volatile__("" ::: "memory");
+    return t;
+#else
+    return now_ns();
+#endif
+}
+
+// Measures the tick rate against the monotonic clock and the cheapest
+// back-to-back read, which is subtracted from every sample
+static void timer_calibrate(void) {
+#if HAVE_TSC
+    uint64_t n0 = now_ns(), t0 = ticks();
+    while (now_ns() - n0 < 50000000ull) { }
+    uint64_t n1 = now_ns(), t1 = ticks();
+    g_ns_per_tick = (double)(n1 - n0) / (double)(t1 - t0);
+#endif
+    g_tick_overhead = UINT64_MAX;
+    for (int i = 0; i < 10000; i++) {
+        uint64_t a = ticks();
+        uint64_t b = ticks();
+        if (b - a < g_tick_overhead) g_tick_overhead = b - a;
+    }
+}
+
+// ---- HDR-style histogram ----
+//
+// Values below HIST_SUB are exact; above that each power of two is split into
+// HIST_SUB linear buckets, so any recorded value is known to within 1/HIST_SUB.
+
+#define HIST_SUB_BITS 7
+#define HIST_SUB (1u << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+} hist_t;
+
+static void hist_reset(hist_t *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+static unsigned hist_index(uint64_t v) {
+    if (v < HIST_SUB) return (unsigned)v;
+    unsigned shift = (unsigned)(63 - __builtin_clzll(v)) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (unsigned)((v >> shift) - HIST_SUB);
+}
+
+// Largest value that lands in bucket idx
+static uint64_t hist_upper(unsigned idx) {
+    if (idx < HIST_SUB) return idx;
+    unsigned shift = idx / HIST_SUB - 1;
+    uint64_t m = idx % HIST_SUB + HIST_SUB;
+    return ((m + 1) << shift) - 1;
+}
+
+static void hist_record(hist_t *h, uint64_t v) {
+    h->counts[hist_index(v)]++;
+    h->total++;
+    h->sum += (double)v;
+    if (v < h->min) h->min = v;
+    if (v > h->max) h->max = v;
+}
+
+static uint64_t hist_percentile(const hist_t *h, double p) {
+    if (!h->total) return 0;
+    uint64_t rank = (uint64_t)ceil(p / 100.0 * (double)h->total);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) return hist_upper(i) < h->max ? hist_upper(i) : h->max;
+    }
+    return h->max;
+}
+
+// ---- Workloads ----
+
+typedef struct {
+    size_t min_size;
+    size_t max_size;
+    size_t ops;
+    size_t live;
+    uint32_t seed;
+} bench_cfg_t;
+
+typedef struct {
+    hist_t malloc_ns;
+    hist_t free_ns;
+} bench_hists_t;
+
+static inline uint64_t ticks_to_ns(uint64_t t) {
+    t = t > g_tick_overhead ? t - g_tick_overhead : 0;
+    return (uint64_t)((double)t * g_ns_per_tick);
+}
+
+static inline void *timed_malloc(bench_hists_t *h, size_t size) {
+    uint64_t t0 = ticks();
+    void *p = t_malloc(size);
+    uint64_t t1 = ticks();
+    hist_record(&h->malloc_ns, ticks_to_ns(t1 - t0));
+    if (p) *(volatile char *)p = 1;
+    return p;
+}
+
+static inline void timed_free(bench_hists_t *h, void *p) {
+    uint64_t t0 = ticks();
+    t_free(p);
+    uint64_t t1 = ticks();
+    hist_record(&h->free_ns, ticks_to_ns(t1 - t0));
+}
+
+static size_t uniform_size(const bench_cfg_t *c, uint32_t *rng) {
+    return c->min_size + xorshift32(rng) % (c->max_size - c->min_size + 1);
+}
+
+// Bounded Pareto (alpha = 1.1): mostly small requests with a long tail of large ones
+static size_t powerlaw_size(const bench_cfg_t *c, uint32_t *rng) {
+    const double alpha = 1.1;
+    double u = ((double)xorshift32(rng) + 1.0) / 4294967297.0;
+    double lo = pow((double)c->min_size, -alpha);
+    double hi = pow((double)c->max_size, -alpha);
+    double x = pow(lo - u * (lo - hi), -1.0 / alpha);
+    size_t s = (size_t)x;
+    if (s < c->min_size) s = c->min_size;
+    if (s > c->max_size) s = c->max_size;
+    return s;
+}
+
+// Random slot in a window of live objects: free it if taken, else fill it
+static void run_churn(const bench_cfg_t *c, bench_hists_t *h, void **slots, int powerlaw) {
+    uint32_t rng = c->seed;
+    for (size_t op = 0; op < c->ops; op++) {
+        size_t idx = xorshift32(&rng) % c->live;
+        if (slots[idx]) {
+            timed_free(h, slots[idx]);
+            slots[idx] = NULL;
+        } else {
+            size_t sz = powerlaw ? powerlaw_size(c, &rng) : uniform_size(c, &rng);
+            slots[idx] = timed_malloc(h, sz);
+        }
+    }
+}
+
+// Fill the window, then free it newest first
+static void run_lifo(const bench_cfg_t *c, bench_hists_t *h, void **slots) {
+    uint32_t rng = c->seed;
+    for (size_t done = 0; done < c->ops; ) {
+        size_t n = c->live < (c->ops - done + 1) / 2 ? c->live : (c->ops - done + 1) / 2;
+        for (size_t i = 0; i < n; i++) slots[i] = timed_malloc(h, uniform_size(c, &rng));
+        for (size_t i = n; i-- > 0; ) {
+            if (slots[i]) timed_free(h, slots[i]);
+            slots[i] = NULL;
+        }
+        done += 2 * n;
+    }
+}
+
+// Fill the window, then repeatedly replace the oldest object
+static void run_fifo(const bench_cfg_t *c, bench_hists_t *h, void **slots) {
+    uint32_t rng = c->seed;
+    size_t n = c->live;
+    for (size_t i = 0; i < n; i++) slots[i] = timed_malloc(h, uniform_size(c, &rng));
+    size_t head = 0;
+    for (size_t op = n; op + 1 < c->ops; op += 2) {
+        if (slots[head]) timed_free(h, slots[head]);
+        slots[head] = timed_malloc(h, uniform_size(c, &rng));
+        head = (head + 1) % n;
+    }
+}
+
+static const char *const g_workloads[] = { "churn", "lifo", "fifo", "powerlaw" };
+#define NWORKLOADS (sizeof(g_workloads) / sizeof(g_workloads[0]))
+
+static const struct {
+    const char *name;
+    alloc_strat_e strat;
+} g_policies[] = {
+    { "FIRST_FIT", FIRST_FIT },
+    { "BEST_FIT", BEST_FIT },
+    { "WORST_FIT", WORST_FIT },
+    { "TLSF", TLSF },
+    { "NEXT_FIT", NEXT_FIT },
+    { "ADDRESS_ORDERED_FIRST_FIT", ADDRESS_ORDERED_FIRST_FIT },
+};
+#define NPOLICIES (sizeof(g_policies) / sizeof(g_policies[0]))
+
+// Returns the wall time of the run; the histograms get every call
+static uint64_t run_workload(const char *workload, alloc_strat_e strat, const bench_cfg_t *c,
+                             bench_hists_t *h, void **slots, tdmm_backing_t *backing) {
+    hist_reset(&h->malloc_ns);
+    hist_reset(&h->free_ns);
+    memset(slots, 0, c->live * sizeof(void *));
+    t_init(strat);
+
+    uint64_t start = now_ns();
+    if (strcmp(workload, "churn") == 0) run_churn(c, h, slots, 0);
+    else if (strcmp(workload, "powerlaw") == 0) run_churn(c, h, slots, 1);
+    else if (strcmp(workload, "lifo") == 0) run_lifo(c, h, slots);
+    else run_fifo(c, h, slots);
+    uint64_t total = now_ns() - start;
+    if (t_page_backing(backing) != 0) *backing = (tdmm_backing_t){0};
+
+    for (size_t i = 0; i < c->live; i++) {
+        if (slots[i]) t_free(slots[i]);
+    }
+    return total;
+}
+
+// ---- Output ----
+
+static void print_row(FILE *out, int json, int *first, const char *workload, const char *policy,
+                      const char *op, const hist_t *h, uint64_t total_ns,
+                      const tdmm_backing_t *b) {
+    double mean = h->total ? h->sum / (double)h->total : 0.0;
+    uint64_t min = h->total ? h->min : 0;
+    if (json) {
+        fprintf(out, "%s\n    {\"workload\": \"%s\", \"policy\": \"%s\", \"op\": \"%s\", \"count\": %llu, "
+                "\"min_ns\": %llu, \"mean_ns\": %.2f, \"p50_ns\": %llu, \"p99_ns\": %llu, "
+                "\"p999_ns\": %llu, \"max_ns\": %llu, \"total_ns\": %llu, \"heap_bytes\": %zu, "
+                "\"thp_bytes\": %zu, \"hugetlb_bytes\": %zu}",
+                *first ? "" : ",", workload, policy, op, (unsigned long long)h->total,
+                (unsigned long long)min, mean,
+                (unsigned long long)hist_percentile(h, 50.0),
+                (unsigned long long)hist_percentile(h, 99.0),
+                (unsigned long long)hist_percentile(h, 99.9),
+                (unsigned long long)h->max, (unsigned long long)total_ns,
+                b->heap_bytes, b->thp_bytes, b->hugetlb_bytes);
+    } else {
+        fprintf(out, "%s,%s,%s,%llu,%llu,%.2f,%llu,%llu,%llu,%llu,%llu,%zu,%zu,%zu\n",
+                workload, policy, op, (unsigned long long)h->total,
+                (unsigned long long)min, mean,
+                (unsigned long long)hist_percentile(h, 50.0),
+                (unsigned long long)hist_percentile(h, 99.0),
+                (unsigned long long)hist_percentile(h, 99.9),
+                (unsigned long long)h->max, (unsigned long long)total_ns,
+                b->heap_bytes, b->thp_bytes, b->hugetlb_bytes);
+    }
+    *first = 0;
+}
+
+// ---- Command line ----
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --workload LIST   churn,lifo,fifo,powerlaw or all (default all)\n"
+            "  --strategy LIST   strategy names or all (default all)\n"
+            "  --min-size N      smallest request in bytes (default 16)\n"
+            "  --max-size N      largest request in bytes (default 4096)\n"
+            "  --ops N           allocator calls per run (default 1000000)\n"
+            "  --live N          objects kept live at once (default 10000)\n"
+            "  --seed N          random seed (default 12345)\n"
+            "  --pages MODE      default, thp or hugetlb backing for the heap (default default)\n"
+            "  --format csv|json (default csv)\n"
+            "  --out FILE        write results to FILE instead of stdout\n",
+            prog);
+    exit(2);
+}
+
+// Whether name appears in a comma-separated list, or the list is "all"
+static int in_list(const char *list, const char *name) {
+    if (strcmp(list, "all") == 0) return 1;
+    size_t n = strlen(name);
+    for (const char *p = list; *p; ) {
+        const char *end = strchr(p, ',');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        if (len == n && strncmp(p, name, n) == 0) return 1;
+        if (!end) break;
+        p = end + 1;
+    }
+    return 0;
+}
+
+static size_t parse_size(const char *prog, const char *s) {
+    char *end;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (*s == '\0' || *end != '\0') usage(prog);
+    return (size_t)v;
+}
+
+int main(int argc, char **argv) {
+    bench_cfg_t cfg = { 16, 4096, 1000000, 10000, 12345u };
+    const char *workloads = "all";
+    const char *strategies = "all";
+    const char *format = "csv";
+    const char *out_path = NULL;
+    tdmm_pages_e pages = TDMM_PAGES_DEFAULT;
+
+    for (int i = 1; i < argc; i++) {
+        const char *opt = argv[i];
+        if (i + 1 >= argc) usage(argv[0]);
+        const char *val = argv[++i];
+        if (strcmp(opt, "--workload") == 0) workloads = val;
+        else if (strcmp(opt, "--strategy") == 0) strategies = val;
+        else if (strcmp(opt, "--min-size") == 0) cfg.min_size = parse_size(argv[0], val);
+        else if (strcmp(opt, "--max-size") == 0) cfg.max_size = parse_size(argv[0], val);
+        else if (strcmp(opt, "--ops") == 0) cfg.ops = parse_size(argv[0], val);
+        else if (strcmp(opt, "--live") == 0) cfg.live = parse_size(argv[0], val);
+        else if (strcmp(opt, "--seed") == 0) cfg.seed = (uint32_t)parse_size(argv[0], val);
+        else if (strcmp(opt, "--pages") == 0) {
+            if (strcmp(val, "default") == 0) pages = TDMM_PAGES_DEFAULT;
+            else if (strcmp(val, "thp") == 0) pages = TDMM_PAGES_THP;
+            else if (strcmp(val, "hugetlb") == 0) pages = TDMM_PAGES_HUGETLB;
+            else usage(argv[0]);
+        }
+        else if (strcmp(opt, "--format") == 0) format = val;
+        else if (strcmp(opt, "--out") == 0) out_path = val;
+        else usage(argv[0]);
+    }
+    int json = strcmp(format, "json") == 0;
+    if (!json && strcmp(format, "csv") != 0) usage(argv[0]);
+    if (cfg.min_size == 0 || cfg.max_size < cfg.min_size || cfg.live == 0) usage(argv[0]);
+    if (cfg.seed == 0) cfg.seed = 1;  // xorshift's fixed point
+
+    FILE *out = stdout;
+    if (out_path && !(out = fopen(out_path, "w"))) {
+        perror(out_path);
+        return 1;
+    }
+    bench_hists_t *h = (bench_hists_t *)malloc(sizeof(bench_hists_t));
+    void **slots = (void **)malloc(cfg.live * sizeof(void *));
+    if (!h || !slots) {
+        fprintf(stderr, "malloc failed\n");
+        return 1;
+    }
+    timer_calibrate();
+    t_set_param(TDMM_PARAM_PAGES, pages);
+
+    int first = 1;
+    if (json) fprintf(out, "{\n  \"results\": [");
+    else fprintf(out, "workload,policy,op,count,min_ns,mean_ns,p50_ns,p99_ns,p999_ns,max_ns,total_ns,heap_bytes,thp_bytes,hugetlb_bytes\n");
+    for (size_t w = 0; w < NWORKLOADS; w++) {
+        if (!in_list(workloads, g_workloads[w])) continue;
+        for (size_t p = 0; p < NPOLICIES; p++) {
+            if (!in_list(strategies, g_policies[p].name)) continue;
+#ifdef TDMM_FIXED_STRATEGY
+            if (g_policies[p].strat != TDMM_FIXED_STRATEGY) continue;
+#endif
+            tdmm_backing_t backing;
+            uint64_t total = run_workload(g_workloads[w], g_policies[p].strat, &cfg, h, slots, &backing);
+            print_row(out, json, &first, g_workloads[w], g_policies[p].name, "malloc", &h->malloc_ns,
+                      total, &backing);
+            print_row(out, json, &first, g_workloads[w], g_policies[p].name, "free", &h->free_ns,
+                      total, &backing);
+            fflush(out);
+        }
+    }
+    if (json) fprintf(out, "\n  ]\n}\n");
+
+    if (out != stdout) fclose(out);
+    free(slots);
+    free(h);
+    return 0;
+}
@@ -0,0 +1,153 @@
+#define _GNU_SOURCE
+#include "tdmm_counters.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+static const char *const g_names[CTR_COUNT] = {
+    "cycles", "instructions", "branch_misses", "l1d_misses",
+    "llc_misses", "dtlb_misses", "page_faults", "context_switches",
+};
+
+enum { GROUP_CORE, GROUP_MEMORY, GROUP_SOFTWARE, GROUPS };
+
+#ifdef __linux__
+static uint64_t cache_miss(uint64_t cache) {
+    return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+
+static const struct { uint32_t type; uint64_t config; int group; } g_events[CTR_COUNT] = {
+    [CTR_CYCLES]           = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, GROUP_CORE },
+    [CTR_INSTRUCTIONS]     = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, GROUP_CORE },
+    [CTR_BRANCH_MISSES]    = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, GROUP_CORE },
+    [CTR_L1D_MISSES]       = { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D, GROUP_MEMORY },
+    [CTR_LLC_MISSES]       = { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL, GROUP_MEMORY },
+    [CTR_DTLB_MISSES]      = { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB, GROUP_MEMORY },
+    [CTR_PAGE_FAULTS]      = { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, GROUP_SOFTWARE },
+    [CTR_CONTEXT_SWITCHES] = { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, GROUP_SOFTWARE },
+};
+
+// Hardware events count user space only, which unprivileged processes may
+// measure under the default perf_event_paranoid. Context switches happen in
+// the kernel, so software events try to include it first.
+static int open_event(tdmm_counter_e e, int leader) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = g_events[e].type;
+    attr.config = g_events[e].type == PERF_TYPE_HW_CACHE ? cache_miss(g_events[e].config) : g_events[e].config;
+    attr.disabled = leader < 0;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.exclude_kernel = g_events[e].type != PERF_TYPE_SOFTWARE;
+    int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+    if (fd < 0 && !attr.exclude_kernel) {
+        attr.exclude_kernel = 1;
+        fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+    }
+    return fd;
+}
+
+// Scales a multiplexed count to the whole phase; a group that never got
+// on the PMU has no count
+static uint64_t read_event(int fd) {
+    uint64_t v[3];
+    if (read(fd, v, sizeof(v)) != (ssize_t)sizeof(v) || v[2] == 0) return TDMM_COUNTER_MISSING;
+    if (v[2] < v[1]) return (uint64_t)((double)v[0] * (double)v[1] / (double)v[2]);
+    return v[0];
+}
+#endif
+
+static void rusage_now(uint64_t out[CTR_COUNT]) {
+    struct rusage ru;
+#ifdef RUSAGE_THREAD
+    if (getrusage(RUSAGE_THREAD, &ru) != 0) memset(&ru, 0, sizeof(ru));
+#else
+    if (getrusage(RUSAGE_SELF, &ru) != 0) memset(&ru, 0, sizeof(ru));
+#endif
+    out[CTR_PAGE_FAULTS] = (uint64_t)ru.ru_minflt + (uint64_t)ru.ru_majflt;
+    out[CTR_CONTEXT_SWITCHES] = (uint64_t)ru.ru_nvcsw + (uint64_t)ru.ru_nivcsw;
+}
+
+void tdmm_counters_open(tdmm_counters_t *c) {
+    for (int g = 0; g < GROUPS; g++) c->leader[g] = -1;
+    for (int e = 0; e < CTR_COUNT; e++) {
+        c->fd[e] = -1;
+        c->value[e] = TDMM_COUNTER_MISSING;
+#ifdef __linux__
+        int *leader = &c->leader[g_events[e].group];
+        c->fd[e] = open_event((tdmm_counter_e)e, *leader);
+        if (*leader < 0) *leader = c->fd[e];
+#endif
+    }
+    c->source = tdmm_counters_source(c);
+}
+
+void tdmm_counters_close(tdmm_counters_t *c) {
+    for (int e = 0; e < CTR_COUNT; e++) {
+        if (c->fd[e] >= 0) close(c->fd[e]);
+        c->fd[e] = -1;
+    }
+    for (int g = 0; g < GROUPS; g++) c->leader[g] = -1;
+}
+
+void tdmm_counters_start(tdmm_counters_t *c) {
+    rusage_now(c->rusage_start);
+#ifdef __linux__
+    for (int g = 0; g < GROUPS; g++) {
+        if (c->leader[g] < 0) continue;
+        ioctl(c->leader[g], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(c->leader[g], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+}
+
+void tdmm_counters_stop(tdmm_counters_t *c) {
+#ifdef __linux__
+    for (int g = 0; g < GROUPS; g++) {
+        if (c->leader[g] >= 0) ioctl(c->leader[g], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+    uint64_t ru[CTR_COUNT];
+    rusage_now(ru);
+    c->source = tdmm_counters_source(c);
+    for (int e = 0; e < CTR_COUNT; e++) {
+        c->value[e] = TDMM_COUNTER_MISSING;
+#ifdef __linux__
+        if (c->fd[e] >= 0) {
+            c->value[e] = read_event(c->fd[e]);
+            continue;
+        }
+#endif
+        if (e == CTR_PAGE_FAULTS || e == CTR_CONTEXT_SWITCHES) c->value[e] = ru[e] - c->rusage_start[e];
+    }
+}
+
+const char *tdmm_counters_source(const tdmm_counters_t *c) {
+    if (c->leader[GROUP_CORE] >= 0 || c->leader[GROUP_MEMORY] >= 0) return "hw";
+    if (c->leader[GROUP_SOFTWARE] >= 0) return "sw";
+    return "rusage";
+}
+
+void tdmm_counters_csv_header(FILE *out) {
+    fprintf(out, ",counters");
+    for (int e = 0; e < CTR_COUNT; e++) fprintf(out, ",%s", g_names[e]);
+}
+
+void tdmm_counters_csv_row(FILE *out, const tdmm_counters_t *c) {
+    fprintf(out, ",%s", c->source);
+    for (int e = 0; e < CTR_COUNT; e++) {
+        if (c->value[e] == TDMM_COUNTER_MISSING) fprintf(out, ",");
+        else fprintf(out, ",%llu", (unsigned long long)c->value[e]);
+    }
+}
+
+void tdmm_counters_csv_blank(FILE *out) {
+    for (int e = 0; e <= CTR_COUNT; e++) fprintf(out, ",");
+}
@@ -0,0 +1,53 @@
+#ifndef TDMM_COUNTERS_H
+#define TDMM_COUNTERS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Event counts around a benchmark phase, for the calling thread only. The
+// hardware events form two perf_event_open groups, core and memory, each small
+// enough for the PMU to count all of its events over the same stretch of
+// user-space code. Groups that must share the PMU are multiplexed by the
+// kernel and their counts scaled up to the whole phase. The software
+// events come from perf too, or from getrusage where perf_event_open is not
+// allowed. Events that cannot be counted at all are reported as missing.
+typedef enum {
+    CTR_CYCLES,
+    CTR_INSTRUCTIONS,
+    CTR_BRANCH_MISSES,
+    CTR_L1D_MISSES,
+    CTR_LLC_MISSES,
+    CTR_DTLB_MISSES,
+    CTR_PAGE_FAULTS,
+    CTR_CONTEXT_SWITCHES,
+    CTR_COUNT
+} tdmm_counter_e;
+
+#define TDMM_COUNTER_MISSING UINT64_MAX
+
+typedef struct {
+    int fd[CTR_COUNT];           // -1 where perf cannot count the event
+    int leader[3];               // core, memory and software group leaders; -1 if empty
+    uint64_t rusage_start[CTR_COUNT];
+    uint64_t value[CTR_COUNT];   // counts of the last start/stop, or TDMM_COUNTER_MISSING
+    const char *source;          // where those counts came from; see tdmm_counters_source
+} tdmm_counters_t;
+
+// Opens every event the kernel and CPU provide
+void tdmm_counters_open(tdmm_counters_t *c);
+void tdmm_counters_close(tdmm_counters_t *c);
+void tdmm_counters_start(tdmm_counters_t *c);
+void tdmm_counters_stop(tdmm_counters_t *c);
+
+// "hw" when hardware events count, "sw" for perf software events alone,
+// "rusage" when perf_event_open is unavailable
+const char *tdmm_counters_source(const tdmm_counters_t *c);
+
+// Extra CSV columns for the last start/stop, each written with a leading
+// comma; still valid after close. Missing counts are left empty.
+void tdmm_counters_csv_header(FILE *out);
+void tdmm_counters_csv_row(FILE *out, const tdmm_counters_t *c);
+// The same columns left empty, for rows that no start/stop covers
+void tdmm_counters_csv_blank(FILE *out);
+
+#endif // TDMM_COUNTERS_H
@@ -0,0 +1,504 @@
+#define _GNU_SOURCE
+
+// Multithreaded stress benchmark: runs the classic concurrent allocator
+// workloads from one thread up to --threads against tdmm and glibc malloc,
+// and reports throughput and the peak memory taken from the OS.
+//
+//   tdmm_stress [--workload threadtest,larson,prodcons,falseshare|all]
+//               [--allocator glibc,tdmm|all] [--strategy NAME] [--threads N]
+//               [--ops N] [--live N] [--min-size N] [--max-size N] [--seed N]
+//               [--out FILE]
+//
+// threadtest  each thread fills a private batch of --live objects and frees it
+// larson      each thread replaces random slots in a window of --live objects;
+//             after every round the windows rotate one thread over, so most
+//             frees are of objects another thread allocated
+// prodcons    the threads form a ring, each allocating into a queue that
+//             its neighbour drains and frees
+// falseshare  one thread hands each worker a small object allocated back to
+//             back; each frees it and then keeps allocating, writing and
+//             freeing small objects of its own. shared_lines counts workers
+//             whose first object shares a cache line with another's.
+//
+// ops counts allocator calls, except in falseshare, where it counts writes
+// to the objects. Thread counts run in powers of two, then --threads itself,
+// which defaults to the online CPUs.
+//
+// Each run happens in a child process of its own, so every allocator starts
+// from an empty heap. While the workers run, the parent thread samples the
+// bytes the allocator has from the OS: t_stats' bytes_from_os for tdmm, and
+// mallinfo2's arena and mmapped bytes for glibc. The benchmark's own
+// bookkeeping is mapped directly, so neither allocator counts it.
+#include "tdmm.h"
+
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define MAX_THREADS 256
+#define CACHE_LINE 64
+#define SAMPLE_NS 1000000ull
+#define LARSON_ROUNDS 10
+#define RING_SLOTS 256
+#define FALSESHARE_WRITES 1000
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t xorshift32(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// Bookkeeping memory that neither allocator under test sees
+static void *bench_map(size_t bytes) {
+    void *p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        _exit(1);
+    }
+    return p;
+}
+
+// ---- Allocators ----
+
+typedef struct {
+    const char *name;
+    void (*init)(alloc_strat_e strat);
+    void *(*alloc)(size_t size);
+    void (*release)(void *ptr);
+    size_t (*os_bytes)(void);
+} allocator_t;
+
+static void glibc_init(alloc_strat_e strat) {
+    (void)strat;
+}
+
+static size_t glibc_os_bytes(void) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 mi = mallinfo2();
+    return mi.arena + mi.hblkhd;
+#elif defined(__GLIBC__)
+    struct mallinfo mi = mallinfo();
+    return (size_t)(unsigned)mi.arena + (size_t)(unsigned)mi.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+static size_t tdmm_os_bytes(void) {
+    tdmm_stats_t st;
+    t_stats(&st);
+    return st.bytes_from_os;
+}
+
+static const allocator_t g_allocators[] = {
+    { "glibc", glibc_init, malloc, free, glibc_os_bytes },
+    { "tdmm", t_init, t_malloc, t_free, tdmm_os_bytes },
+};
+#define NALLOCATORS (sizeof(g_allocators) / sizeof(g_allocators[0]))
+
+static const struct {
+    const char *name;
+    alloc_strat_e strat;
+} g_policies[] = {
+    { "FIRST_FIT", FIRST_FIT },
+    { "BEST_FIT", BEST_FIT },
+    { "WORST_FIT", WORST_FIT },
+    { "TLSF", TLSF },
+    { "NEXT_FIT", NEXT_FIT },
+    { "ADDRESS_ORDERED_FIRST_FIT", ADDRESS_ORDERED_FIRST_FIT },
+};
+#define NPOLICIES (sizeof(g_policies) / sizeof(g_policies[0]))
+
+// ---- Workloads ----
+
+typedef struct {
+    size_t min_size;
+    size_t max_size;
+    size_t ops;       // per thread
+    size_t live;      // per thread
+    uint32_t seed;
+} stress_cfg_t;
+
+// Producer/consumer queue between two neighbouring threads
+typedef struct {
+    size_t head __attribute__((aligned(CACHE_LINE)));   // written by the consumer
+    size_t tail __attribute__((aligned(CACHE_LINE)));   // written by the producer
+    void *slots[RING_SLOTS];
+} ring_t;
+
+typedef struct run_s run_t;
+
+typedef struct {
+    run_t *run __attribute__((aligned(CACHE_LINE)));
+    size_t id;
+    uint32_t rng;
+    void **window;      // threadtest and larson
+    void *handed;       // falseshare
+    uintptr_t first;    // falseshare: address of the thread's first own object
+    uint64_t ops;
+    uint64_t end_ns;
+} worker_t;
+
+struct run_s {
+    const allocator_t *alloc;
+    const stress_cfg_t *cfg;
+    int workload;
+    size_t nthreads;
+    pthread_barrier_t ready;    // workers and the parent; the clock starts between the two
+    pthread_barrier_t start;
+    pthread_barrier_t round;    // workers only
+    size_t done;                // workers past the timed part
+    void **windows;             // larson: nthreads windows of cfg->live slots
+    ring_t *rings;              // prodcons: ring i is fed by thread i
+    worker_t workers[MAX_THREADS];
+};
+
+enum { W_THREADTEST, W_LARSON, W_PRODCONS, W_FALSESHARE, NWORKLOADS };
+static const char *const g_workloads[NWORKLOADS] = { "threadtest", "larson", "prodcons", "falseshare" };
+
+static size_t uniform_size(const stress_cfg_t *c, uint32_t *rng) {
+    return c->min_size + xorshift32(rng) % (c->max_size - c->min_size + 1);
+}
+
+static inline void *touch(void *p) {
+    if (p) *(volatile char *)p = 1;
+    return p;
+}
+
+static void run_threadtest(worker_t *w) {
+    const stress_cfg_t *c = w->run->cfg;
+    const allocator_t *a = w->run->alloc;
+    while (w->ops < c->ops) {
+        size_t n = c->live < (c->ops - w->ops + 1) / 2 ? c->live : (c->ops - w->ops + 1) / 2;
+        for (size_t i = 0; i < n; i++) w->window[i] = touch(a->alloc(uniform_size(c, &w->rng)));
+        for (size_t i = 0; i < n; i++) a->release(w->window[i]);
+        w->ops += 2 * n;
+    }
+}
+
+// Windows are filled before the clock starts and emptied after it stops;
+// in between every free is of whatever the window's last owner put there
+static void run_larson(worker_t *w) {
+    run_t *r = w->run;
+    const stress_cfg_t *c = r->cfg;
+    size_t per_round = c->ops / 2 / LARSON_ROUNDS;
+    for (size_t round = 0; round < LARSON_ROUNDS; round++) {
+        void **win = r->windows + ((w->id + round) % r->nthreads) * c->live;
+        for (size_t op = 0; op < per_round; op++) {
+            size_t idx = xorshift32(&w->rng) % c->live;
+            r->alloc->release(win[idx]);
+            win[idx] = touch(r->alloc->alloc(uniform_size(c, &w->rng)));
+        }
+        w->ops += 2 * per_round;
+        pthread_barrier_wait(&r->round);
+    }
+}
+
+static void run_prodcons(worker_t *w) {
+    run_t *r = w->run;
+    const stress_cfg_t *c = r->cfg;
+    ring_t *out = &r->rings[w->id];
+    ring_t *in = &r->rings[(w->id + r->nthreads - 1) % r->nthreads];
+    size_t quota = c->ops / 2, made = 0, eaten = 0;
+    while (made < quota || eaten < quota) {
+        int progress = 0;
+        size_t tail = out->tail;
+        if (made < quota && tail - __atomic_load_n(&out->head, __ATOMIC_ACQUIRE) < RING_SLOTS) {
+            out->slots[tail % RING_SLOTS] = touch(r->alloc->alloc(uniform_size(c, &w->rng)));
+            __atomic_store_n(&out->tail, tail + 1, __ATOMIC_RELEASE);
+            made++;
+            progress = 1;
+        }
+        size_t head = in->head;
+        if (eaten < quota && head != __atomic_load_n(&in->tail, __ATOMIC_ACQUIRE)) {
+            void *p = in->slots[head % RING_SLOTS];
+            __atomic_store_n(&in->head, head + 1, __ATOMIC_RELEASE);
+            r->alloc->release(p);
+            eaten++;
+            progress = 1;
+        }
+        if (!progress) sched_yield();
+    }
+    w->ops = made + eaten;
+}
+
+static void run_falseshare(worker_t *w) {
+    run_t *r = w->run;
+    const stress_cfg_t *c = r->cfg;
+    r->alloc->release(w->handed);
+    for (size_t done = 0; done < c->ops; done += FALSESHARE_WRITES) {
+        volatile char *p = (volatile char *)r->alloc->alloc(c->min_size);
+        if (!p) continue;
+        if (!w->first) w->first = (uintptr_t)p;
+        for (size_t i = 0; i < FALSESHARE_WRITES; i++) p[i % c->min_size]++;
+        r->alloc->release((void *)p);
+        w->ops += FALSESHARE_WRITES;
+    }
+}
+
+static void *worker_main(void *arg) {
+    worker_t *w = (worker_t *)arg;
+    run_t *r = w->run;
+    const stress_cfg_t *c = r->cfg;
+    if (r->workload == W_LARSON) {
+        void **win = r->windows + w->id * c->live;
+        for (size_t i = 0; i < c->live; i++) win[i] = touch(r->alloc->alloc(uniform_size(c, &w->rng)));
+    }
+
+    pthread_barrier_wait(&r->ready);
+    pthread_barrier_wait(&r->start);
+    switch (r->workload) {
+    case W_THREADTEST: run_threadtest(w); break;
+    case W_LARSON: run_larson(w); break;
+    case W_PRODCONS: run_prodcons(w); break;
+    default: run_falseshare(w); break;
+    }
+    w->end_ns = now_ns();
+    __atomic_add_fetch(&r->done, 1, __ATOMIC_RELEASE);
+
+    if (r->workload == W_LARSON) {
+        void **win = r->windows + w->id * c->live;
+        for (size_t i = 0; i < c->live; i++) r->alloc->release(win[i]);
+    }
+    return NULL;
+}
+
+typedef struct {
+    uint64_t ops;
+    uint64_t ns;
+    size_t peak_os_bytes;
+    long shared_lines;      // -1 outside falseshare
+} result_t;
+
+static void sample_peak(const allocator_t *a, size_t *peak) {
+    size_t b = a->os_bytes();
+    if (b > *peak) *peak = b;
+}
+
+// Runs in the child; the parent thread samples the heap until every worker
+// has finished its timed part. The run lasts until the last worker finishes.
+static result_t run_once(const allocator_t *a, alloc_strat_e strat, const stress_cfg_t *c,
+                         int workload, size_t nthreads) {
+    result_t res = { 0, 0, 0, -1 };
+    run_t *r = (run_t *)bench_map(sizeof(run_t));
+    r->alloc = a;
+    r->cfg = c;
+    r->workload = workload;
+    r->nthreads = nthreads;
+    if (workload == W_LARSON) r->windows = (void **)bench_map(nthreads * c->live * sizeof(void *));
+    if (workload == W_PRODCONS) r->rings = (ring_t *)bench_map(nthreads * sizeof(ring_t));
+    for (size_t t = 0; t < nthreads; t++) {
+        worker_t *w = &r->workers[t];
+        w->run = r;
+        w->id = t;
+        uint32_t s = c->seed * (uint32_t)(t + 1);
+        w->rng = s ? s : 1;
+        if (workload == W_THREADTEST) w->window = (void **)bench_map(c->live * sizeof(void *));
+    }
+
+    a->init(strat);
+    // Adjacent small objects from one thread, before any worker allocates
+    if (workload == W_FALSESHARE) {
+        for (size_t t = 0; t < nthreads; t++) r->workers[t].handed = a->alloc(c->min_size);
+    }
+    pthread_barrier_init(&r->ready, NULL, (unsigned)nthreads + 1);
+    pthread_barrier_init(&r->start, NULL, (unsigned)nthreads + 1);
+    pthread_barrier_init(&r->round, NULL, (unsigned)nthreads);
+    pthread_t tids[MAX_THREADS];
+    for (size_t t = 0; t < nthreads; t++) {
+        if (pthread_create(&tids[t], NULL, worker_main, &r->workers[t]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            _exit(1);
+        }
+    }
+
+    pthread_barrier_wait(&r->ready);
+    sample_peak(a, &res.peak_os_bytes);
+    uint64_t t0 = now_ns();
+    pthread_barrier_wait(&r->start);
+    struct timespec nap = { 0, SAMPLE_NS };
+    while (__atomic_load_n(&r->done, __ATOMIC_ACQUIRE) < nthreads) {
+        sample_peak(a, &res.peak_os_bytes);
+        nanosleep(&nap, NULL);
+    }
+    sample_peak(a, &res.peak_os_bytes);
+    for (size_t t = 0; t < nthreads; t++) pthread_join(tids[t], NULL);
+
+    for (size_t t = 0; t < nthreads; t++) {
+        res.ops += r->workers[t].ops;
+        if (r->workers[t].end_ns - t0 > res.ns) res.ns = r->workers[t].end_ns - t0;
+    }
+    if (workload == W_FALSESHARE) {
+        res.shared_lines = 0;
+        for (size_t i = 0; i < nthreads; i++) {
+            for (size_t j = 0; j < nthreads; j++) {
+                uintptr_t ai = r->workers[i].first, bj = r->workers[j].first;
+                if (i != j && ai && ai / CACHE_LINE == bj / CACHE_LINE) {
+                    res.shared_lines++;
+                    break;
+                }
+            }
+        }
+    }
+    return res;
+}
+
+// Forks a fresh process for the run; returns 0 if the child failed
+static int run_isolated(const allocator_t *a, alloc_strat_e strat, const stress_cfg_t *c,
+                        int workload, size_t nthreads, result_t *out) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return 0;
+    }
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return 0;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        result_t res = run_once(a, strat, c, workload, nthreads);
+        _exit(write(fds[1], &res, sizeof(res)) == (ssize_t)sizeof(res) ? 0 : 1);
+    }
+    close(fds[1]);
+    ssize_t got = read(fds[0], out, sizeof(*out));
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    return got == (ssize_t)sizeof(*out) && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// ---- Command line ----
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --workload LIST   threadtest,larson,prodcons,falseshare or all (default all)\n"
+            "  --allocator LIST  glibc,tdmm or all (default all)\n"
+            "  --strategy NAME   tdmm strategy (default TLSF)\n"
+            "  --threads N       most threads to run (default online CPUs)\n"
+            "  --ops N           operations per thread (default 1000000)\n"
+            "  --live N          objects per thread window (default 1000)\n"
+            "  --min-size N      smallest request in bytes (default 8)\n"
+            "  --max-size N      largest request in bytes (default 256)\n"
+            "  --seed N          random seed (default 12345)\n"
+            "  --out FILE        write results to FILE instead of stdout\n",
+            prog);
+    exit(2);
+}
+
+// Whether name appears in a comma-separated list, or the list is "all"
+static int in_list(const char *list, const char *name) {
+    if (strcmp(list, "all") == 0) return 1;
+    size_t n = strlen(name);
+    for (const char *p = list; *p; ) {
+        const char *end = strchr(p, ',');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        if (len == n && strncmp(p, name, n) == 0) return 1;
+        if (!end) break;
+        p = end + 1;
+    }
+    return 0;
+}
+
+static size_t parse_size(const char *prog, const char *s) {
+    char *end;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (*s == '\0' || *end != '\0') usage(prog);
+    return (size_t)v;
+}
+
+int main(int argc, char **argv) {
+    stress_cfg_t cfg = { 8, 256, 1000000, 1000, 12345u };
+    const char *workloads = "all";
+    const char *allocators = "all";
+    const char *strategy = "TLSF";
+    const char *out_path = NULL;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t max_threads = cpus > 0 ? (size_t)cpus : 1;
+
+    for (int i = 1; i < argc; i++) {
+        const char *opt = argv[i];
+        if (i + 1 >= argc) usage(argv[0]);
+        const char *val = argv[++i];
+        if (strcmp(opt, "--workload") == 0) workloads = val;
+        else if (strcmp(opt, "--allocator") == 0) allocators = val;
+        else if (strcmp(opt, "--strategy") == 0) strategy = val;
+        else if (strcmp(opt, "--threads") == 0) max_threads = parse_size(argv[0], val);
+        else if (strcmp(opt, "--ops") == 0) cfg.ops = parse_size(argv[0], val);
+        else if (strcmp(opt, "--live") == 0) cfg.live = parse_size(argv[0], val);
+        else if (strcmp(opt, "--min-size") == 0) cfg.min_size = parse_size(argv[0], val);
+        else if (strcmp(opt, "--max-size") == 0) cfg.max_size = parse_size(argv[0], val);
+        else if (strcmp(opt, "--seed") == 0) cfg.seed = (uint32_t)parse_size(argv[0], val);
+        else if (strcmp(opt, "--out") == 0) out_path = val;
+        else usage(argv[0]);
+    }
+    if (cfg.min_size == 0 || cfg.max_size < cfg.min_size || cfg.live == 0) usage(argv[0]);
+    if (max_threads == 0 || max_threads > MAX_THREADS) usage(argv[0]);
+    if (cfg.seed == 0) cfg.seed = 1;  // xorshift's fixed point
+
+    size_t p = 0;
+    while (p < NPOLICIES && strcmp(g_policies[p].name, strategy) != 0) p++;
+    if (p == NPOLICIES) usage(argv[0]);
+    alloc_strat_e strat = g_policies[p].strat;
+#ifdef TDMM_FIXED_STRATEGY
+    strat = TDMM_FIXED_STRATEGY;
+    for (p = 0; g_policies[p].strat != strat; p++) { }
+#endif
+
+    FILE *out = stdout;
+    if (out_path && !(out = fopen(out_path, "w"))) {
+        perror(out_path);
+        return 1;
+    }
+
+    int failed = 0;
+    fprintf(out, "allocator,policy,workload,threads,ops,total_ns,ops_per_sec,peak_bytes_from_os,shared_lines\n");
+    for (int w = 0; w < NWORKLOADS; w++) {
+        if (!in_list(workloads, g_workloads[w])) continue;
+        for (size_t a = 0; a < NALLOCATORS; a++) {
+            if (!in_list(allocators, g_allocators[a].name)) continue;
+            const char *policy = a == 0 ? "malloc" : g_policies[p].name;
+            for (size_t n = 1; ; n = n * 2 < max_threads ? n * 2 : max_threads) {
+                result_t res;
+                if (!run_isolated(&g_allocators[a], strat, &cfg, w, n, &res)) {
+                    fprintf(stderr, "%s %s with %zu threads failed\n", g_allocators[a].name, g_workloads[w], n);
+                    failed = 1;
+                    if (n == max_threads) break;
+                    continue;
+                }
+                double rate = res.ns ? (double)res.ops * 1e9 / (double)res.ns : 0.0;
+                fprintf(out, "%s,%s,%s,%zu,%llu,%llu,%.0f,%zu,", g_allocators[a].name, policy,
+                        g_workloads[w], n, (unsigned long long)res.ops, (unsigned long long)res.ns,
+                        rate, res.peak_os_bytes);
+                if (res.shared_lines >= 0) fprintf(out, "%ld", res.shared_lines);
+                fprintf(out, "\n");
+                if (n == max_threads) break;
+            }
+        }
+    }
+
+    if (out != stdout) fclose(out);
+    return failed;
+}
@@ -1,214 +1,905 @@
 #include "tdmm.h"
+#include "tdmm_internal.h"
 
 #include <stdint.h>
 #include <stddef.h>
-#include <unistd.h>
-#include <sys/mman.h>
 #include <stdio.h>
-
-#define TDMM_HEAP_BYTES (64u * 1024u * 1024u)
-#define max(a, b) ((a) > (b) ? (a) : (b))
-
-typedef struct block_hdr {
-    size_t size;
-    uint8_t free;
-    uint8_t _pad[3];  // ensures 4-byte alignment
-    struct block_hdr *prev;
-    struct block_hdr *next;
-} block_hdr_t;
-
-typedef struct {
-    // OS memory
-    size_t bytes_from_os;
-    // Memory usage
-    size_t cur_inuse_bytes;
-    size_t peak_inuse_bytes;
-    // Utilization
-    double util_sum;
-    size_t num_util;
-} tdmm_metrics_t;
-
-static void *g_heap_base = NULL;
-static size_t g_heap_size = 0;
-static block_hdr_t *g_head = NULL;
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+// Per-thread caches bin freed small blocks by payload size in 16-byte classes
+#define TCACHE_CLASS_BYTES 16u
+#define TCACHE_CLASSES 65                 // class k holds payloads in [16k, 16k + 15]
+#define TCACHE_BIN_MAX 32                 // flush half a bin back once it grows past this
+#define TCACHE_REFILL 8                   // blocks carved per refill from the arena
+
+// Arenas are created on demand, in slot order, and published with a release
+// store so t_free can find a pointer's arena without a lock. Slots are only
+// cleared by t_init.
+static arena_t *g_arenas[TDMM_MAX_ARENAS];
+static size_t g_narenas = 0;
+static size_t g_arena_limit = 0;    // 0 until first use, then TDMM_PARAM_ARENAS
+static size_t g_next_arena = 0;     // round-robin cursor for new threads
 static alloc_strat_e g_strat = FIRST_FIT;
-static tdmm_metrics_t g_metrics = {0};
-
-const tdmm_metrics_t *t_metrics_ptr(void) {
-    return &g_metrics;
+static size_t g_mmap_threshold = TDMM_DEFAULT_MMAP_THRESHOLD;
+static size_t g_slab_max_bytes = TDMM_DEFAULT_SLAB_MAX_BYTES;
+static tdmm_pages_e g_pages = TDMM_PAGES_DEFAULT;   // copied to g_page_mode by t_init
+static int g_soa = 0;                                // copied to g_soa_index by t_init
+
+// Guards arena creation and the cache and heap registries. Each arena has its
+// own lock for its blocks; thread caches are touched only by their owner.
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static arena_t *g_heaps = NULL;     // t_heap_create heaps, for the fork handlers
+static pthread_once_t g_fork_once = PTHREAD_ONCE_INIT;
+
+static size_t default_arena_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    return n > TDMM_MAX_ARENAS ? TDMM_MAX_ARENAS : (size_t)n;
 }
 
-static size_t ALIGN4(size_t x) {
-    return (x + 3) / 4 * 4;
+// Caller holds g_lock
+static arena_t *arena_new_locked(void) {
+    if (g_narenas == TDMM_MAX_ARENAS) return NULL;
+    arena_t *a = tdmm_arena_create(g_strat);
+    if (!a) return NULL;
+    __atomic_store_n(&g_arenas[g_narenas], a, __ATOMIC_RELEASE);
+    __atomic_store_n(&g_narenas, g_narenas + 1, __ATOMIC_RELEASE);
+    return a;
 }
-static size_t page_round_up(size_t n) {
-    long ps = sysconf(_SC_PAGESIZE);
-    if (ps <= 0) ps = 4096;
-    size_t p = (size_t)ps;
-    return (n + p - 1) / p * p;
+
+// Round-robin over arena slots, creating the slot's arena on first use
+static arena_t *arena_assign(void) {
+    pthread_mutex_lock(&g_lock);
+    if (!g_arena_limit) g_arena_limit = default_arena_count();
+    size_t idx = g_next_arena++ % g_arena_limit;
+    arena_t *a = idx < g_narenas ? g_arenas[idx] : arena_new_locked();
+    // Fall back to an existing arena if a new reservation is refused
+    if (!a && g_narenas) a = g_arenas[idx % g_narenas];
+    pthread_mutex_unlock(&g_lock);
+    return a;
 }
-static size_t hdr_size(void) {
-    return ALIGN4(sizeof(block_hdr_t));
+
+static arena_t *arena_of(const void *ptr) {
+    size_t n = __atomic_load_n(&g_narenas, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; i < n; i++) {
+        arena_t *a = __atomic_load_n(&g_arenas[i], __ATOMIC_ACQUIRE);
+        if (arena_contains(a, ptr)) return a;
+    }
+    return NULL;
 }
 
-static void *payload_from_hdr(block_hdr_t *h) {
-    return (void *)((uint8_t *)h + hdr_size());
+// Usable bytes behind a live pointer that is known to be in an arena or a
+// slab page; safe without the arena lock
+static size_t usable_size_unlocked(void *ptr) {
+    if (slab_contains(ptr)) return tdmm_slab_obj_size(ptr);
+    return blk_size_unlocked(hdr_from_payload(ptr));
 }
 
-static block_hdr_t *hdr_from_payload(void *p) {
-    return (block_hdr_t *)((uint8_t *)p - hdr_size());
+// Whether class-k requests (k * TCACHE_CLASS_BYTES bytes) come from slab pages
+static int slab_serves(size_t k) {
+    size_t limit = __atomic_load_n(&g_slab_max_bytes, __ATOMIC_RELAXED);
+    return k >= 1 && k * SLAB_CLASS_BYTES <= limit;
 }
 
-static int ptr_in_heap(const void *p) {
-    if (!g_heap_base || g_heap_size == 0) return 0;
-    uintptr_t x = (uintptr_t)p;
-    uintptr_t b = (uintptr_t)g_heap_base;
-    return (x >= b) && (x < b + g_heap_size);
+// Thread caches. Cached blocks stay "used" as far as their arena is concerned,
+// so arena metrics count them as in use; each cache reports the bytes it
+// holds so snapshots can subtract them.
+// Packed because payloads are only guaranteed 4-byte alignment
+typedef struct __attribute__((packed)) tcache_entry {
+    struct tcache_entry *next;
+    uintptr_t key;  // g_tcache_key while cached; catches most double frees
+} tcache_entry_t;
+
+typedef struct tcache {
+    tcache_entry_t *bins[TCACHE_CLASSES];
+    uint32_t counts[TCACHE_CLASSES];
+    size_t cached_bytes;   // written by the owner, read by metric snapshots
+    uint64_t gen;          // heap generation the cached blocks belong to
+    size_t max_bytes;      // g_tcache_max_bytes when the bins were filled
+    arena_t *arena;        // arena this thread allocates from; NULL until first use
+    ptrdiff_t prof_left;   // bytes until the next heap profile sample
+    uint64_t prof_rng;     // 0 until the countdown is armed
+    int registered;
+    struct tcache *next_cache;
+} tcache_t;
+
+// Initial-exec so that reaching the cache never allocates, even when the
+// library is preloaded in place of malloc
+static __thread tcache_t t_tcache __attribute__((tls_model("initial-exec")));
+static tcache_t *g_caches = NULL;
+static uint64_t g_heap_gen = 1;
+static size_t g_tcache_max_bytes = TDMM_DEFAULT_TCACHE_MAX_BYTES;
+static const uintptr_t g_tcache_key = (uintptr_t)0x7dcc0a4e5f1b93d1ull;
+static pthread_key_t g_tcache_exit_key;
+static pthread_once_t g_tcache_once = PTHREAD_ONCE_INIT;
+
+static void tcache_set_cached(tcache_t *tc, size_t bytes) {
+    __atomic_store_n(&tc->cached_bytes, bytes, __ATOMIC_RELAXED);
 }
 
-static void merge(block_hdr_t *b) {
-    if (!b) return;
-    while (b->prev && b->prev->free) b = b->prev;
-    while (b->next && b->next->free) {
-        block_hdr_t *n = b->next;
-        b->size += hdr_size() + n->size;
-        b->next = n->next;
-        if (b->next) b->next->prev = b;
+static void tcache_drop(tcache_t *tc) {
+    for (size_t k = 0; k < TCACHE_CLASSES; k++) {
+        tc->bins[k] = NULL;
+        tc->counts[k] = 0;
     }
+    tcache_set_cached(tc, 0);
 }
 
-static block_hdr_t *find_block(size_t need) {
-    block_hdr_t *choice = NULL;
-    if (g_strat == FIRST_FIT) {
-        for (block_hdr_t *cur = g_head; cur; cur = cur->next) {
-            if (cur->free && cur->size >= need) return cur;
+// Returns up to n blocks of bin k. Blocks from this thread's arena are merged
+// under one lock acquisition; the rest go onto their owners' remote lists.
+static void tcache_flush(tcache_t *tc, size_t k, uint32_t n) {
+    if (tc->gen != __atomic_load_n(&g_heap_gen, __ATOMIC_ACQUIRE)) return;
+
+    arena_t *own = tc->arena;
+    size_t own_bytes = 0;
+    size_t bytes = 0;
+    if (own) tdmm_arena_lock(own);
+    while (n-- && tc->bins[k]) {
+        tcache_entry_t *e = tc->bins[k];
+        tc->bins[k] = e->next;
+        tc->counts[k]--;
+        size_t sz = usable_size_unlocked(e);
+        bytes += sz;
+
+        if (slab_contains(e)) {
+            tdmm_slab_release(e);
+            arena_t *a = slab_of(e)->arena;
+            if (a == own) {
+                own_bytes += sz;
+                tdmm_slab_free(own, e);
+            } else {
+                tdmm_slab_remote_free(a, e);
+            }
+            continue;
         }
-        return NULL;
-    }
-    if (g_strat == BEST_FIT) {
-        for (block_hdr_t *cur = g_head; cur; cur = cur->next) {
-            if (!cur->free || cur->size < need) continue;
-            if (!choice || cur->size < choice->size) choice = cur;
+        arena_t *a = arena_of(e);
+        block_hdr_t *b = hdr_from_payload(e);
+        if (a == own) {
+            own_bytes += sz;
+            tdmm_arena_release_block(own, b);
+        } else {
+            tdmm_arena_remote_free(a, b);
         }
-        return choice;
     }
-    if (g_strat == WORST_FIT) {
-        for (block_hdr_t *cur = g_head; cur; cur = cur->next) {
-            if (!cur->free || cur->size < need) continue;
-            if (!choice || cur->size > choice->size) choice = cur;
-        }
-        return choice;
+    if (own) {
+        tdmm_arena_update_metrics(own, METRIC_FREE, 0, own_bytes);
+        tdmm_arena_unlock(own);
     }
-    return NULL;
+    tcache_set_cached(tc, tc->cached_bytes - bytes);
 }
 
-static void split_block(block_hdr_t *b, size_t need) {
-    if (!b || b->size < need) return;
+static void tcache_flush_all(tcache_t *tc) {
+    for (size_t k = 0; k < TCACHE_CLASSES; k++) {
+        if (tc->counts[k]) tcache_flush(tc, k, tc->counts[k]);
+    }
+    tcache_drop(tc);
+}
 
-    size_t hsz = hdr_size();
-    size_t remaining = b->size - need;
+static void tcache_thread_exit(void *arg) {
+    tcache_t *tc = (tcache_t *)arg;
+    tcache_flush_all(tc);
 
-    // Only split if leftover can hold a header + at least 4 bytes payload
-    if (remaining < hsz + 4) return;
+    pthread_mutex_lock(&g_lock);
+    for (tcache_t **pp = &g_caches; *pp; pp = &(*pp)->next_cache) {
+        if (*pp == tc) {
+            *pp = tc->next_cache;
+            break;
+        }
+    }
+    tc->registered = 0;
+    pthread_mutex_unlock(&g_lock);
+}
 
-    uint8_t *new_addr = (uint8_t *)payload_from_hdr(b) + need;
-    block_hdr_t *n = (block_hdr_t *)new_addr;
+static void tcache_make_key(void) {
+    pthread_key_create(&g_tcache_exit_key, tcache_thread_exit);
+}
 
-    n->size = remaining - hsz;
-    n->free = 1;
-    n->prev = b;
-    n->next = b->next;
+static tcache_t *tcache_get(void) {
+    tcache_t *tc = &t_tcache;
+    if (!tc->registered) {
+        pthread_once(&g_tcache_once, tcache_make_key);
+        pthread_setspecific(g_tcache_exit_key, tc);
+        pthread_mutex_lock(&g_lock);
+        tc->next_cache = g_caches;
+        g_caches = tc;
+        tc->registered = 1;
+        tc->gen = g_heap_gen;
+        tc->max_bytes = g_tcache_max_bytes;
+        pthread_mutex_unlock(&g_lock);
+    }
+    // A re-initialized heap invalidates every cached block and arena
+    if (tc->gen != __atomic_load_n(&g_heap_gen, __ATOMIC_ACQUIRE)) {
+        tcache_drop(tc);
+        tc->arena = NULL;
+        tc->gen = g_heap_gen;
+        tc->prof_left = 0;
+        tc->prof_rng = 0;
+    }
+    size_t limit = __atomic_load_n(&g_tcache_max_bytes, __ATOMIC_RELAXED);
+    if (tc->max_bytes != limit) {
+        tcache_flush_all(tc);
+        tc->max_bytes = limit;
+    }
+    return tc;
+}
 
-    if (b->next) b->next->prev = n;
-    b->next = n;
-    b->size = need;
+static arena_t *tcache_arena(tcache_t *tc) {
+    if (!tc->arena) tc->arena = arena_assign();
+    return tc->arena;
 }
 
-typedef enum {
-    METRIC_INIT = 0,
-    METRIC_MALLOC,
-    METRIC_FREE,
-} metric_event_t;
+static void *tcache_pop(tcache_t *tc, size_t k) {
+    tcache_entry_t *e = tc->bins[k];
+    tc->bins[k] = e->next;
+    tc->counts[k]--;
+    e->key = 0;
+    tcache_set_cached(tc, tc->cached_bytes - usable_size_unlocked(e));
+    return e;
+}
 
-size_t t_overhead_bytes(void) {
-    size_t blocks = 0;
-    for (block_hdr_t *cur = g_head; cur; cur = cur->next) {
-        blocks++;
-    }
-    return blocks * hdr_size();
+static void tcache_push(tcache_t *tc, size_t k, void *ptr, size_t bytes) {
+    tcache_entry_t *e = (tcache_entry_t *)ptr;
+    e->next = tc->bins[k];
+    e->key = g_tcache_key;
+    tc->bins[k] = e;
+    tc->counts[k]++;
+    tcache_set_cached(tc, tc->cached_bytes + bytes);
 }
 
-static void update_metrics(metric_event_t ev, size_t req_bytes, size_t actual_bytes) {
-    g_metrics.bytes_from_os = g_heap_size;
-    if (ev == METRIC_MALLOC) {
-        g_metrics.cur_inuse_bytes += actual_bytes;
-        g_metrics.peak_inuse_bytes = max(g_metrics.peak_inuse_bytes, g_metrics.cur_inuse_bytes);
-    } else if (ev == METRIC_FREE) {
-        g_metrics.cur_inuse_bytes = max(0, (ssize_t)g_metrics.cur_inuse_bytes - (ssize_t)actual_bytes);
+// Miss path: carves a batch of class-k blocks under one lock acquisition,
+// returns one and caches the rest
+static void *tcache_refill(tcache_t *tc, size_t k, size_t size) {
+    arena_t *a = tcache_arena(tc);
+    if (!a) return NULL;
+
+    size_t need = align_payload(k * TCACHE_CLASS_BYTES);
+    void *first = NULL;
+    size_t bytes = 0;
+
+    int slab = slab_serves(k);
+    tdmm_arena_lock(a);
+    for (int i = 0; i < TCACHE_REFILL; i++) {
+        void *p;
+        size_t sz;
+        if (slab) {
+            p = tdmm_slab_alloc(a, k - 1);
+            sz = k * SLAB_CLASS_BYTES;
+        } else {
+            block_hdr_t *b = tdmm_arena_alloc_block(a, need);
+            p = b ? payload_from_hdr(b) : NULL;
+            sz = b ? blk_size(b) : 0;
+        }
+        if (!p) break;
+        bytes += sz;
+        if (!first) first = p;
+        else tcache_push(tc, k, p, sz);
     }
+    tdmm_arena_update_metrics(a, METRIC_MALLOC, size, bytes);
+    tdmm_arena_unlock(a);
+    return first;
+}
 
-    if (g_metrics.bytes_from_os > 0) {
-        double u = (double)g_metrics.cur_inuse_bytes / (double)g_metrics.bytes_from_os;
-        g_metrics.util_sum += u;
-        g_metrics.num_util += 1;
+static int tcache_owns(tcache_t *tc, size_t k, const void *ptr) {
+    for (tcache_entry_t *e = tc->bins[k]; e; e = e->next) {
+        if (e == ptr) return 1;
     }
+    return 0;
+}
+
+// A forked child keeps only the thread that called fork, so a lock any other
+// thread held would stay locked for good. Every lock is taken before fork, in
+// the order they nest: g_lock, the arenas, the t_heap_create heaps, then the
+// slab, mapping and profiler locks. File-backed heaps are left out, since
+// parent and child share their memory and flock.
+static void fork_prepare(void) {
+    pthread_mutex_lock(&g_lock);
+    for (size_t i = 0; i < g_narenas; i++) tdmm_arena_lock(g_arenas[i]);
+    for (arena_t *h = g_heaps; h; h = h->next_heap) tdmm_arena_lock(h);
+    tdmm_slab_fork_lock();
+    tdmm_large_fork_lock();
+    tdmm_prof_fork_lock();
+}
+
+static void fork_release(int child) {
+    tdmm_prof_fork_unlock(child);
+    tdmm_large_fork_unlock(child);
+    tdmm_slab_fork_unlock(child);
+    for (arena_t *h = g_heaps; h; h = h->next_heap) tdmm_arena_fork_unlock(h, child);
+    for (size_t i = 0; i < g_narenas; i++) tdmm_arena_fork_unlock(g_arenas[i], child);
+    if (child) pthread_mutex_init(&g_lock, NULL);
+    else pthread_mutex_unlock(&g_lock);
+}
+
+static void fork_parent(void) {
+    fork_release(0);
+}
+
+static void fork_child(void) {
+    fork_release(1);
+}
+
+static void fork_register(void) {
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
 }
 
 void t_init(alloc_strat_e strat) {
+    pthread_once(&g_fork_once, fork_register);
+    pthread_mutex_lock(&g_lock);
+    for (size_t i = 0; i < g_narenas; i++) {
+        tdmm_arena_destroy(g_arenas[i]);
+        g_arenas[i] = NULL;
+    }
+    g_narenas = 0;
+    g_next_arena = 0;
+    tdmm_slab_reset();
+    tdmm_large_release_all();
+    tdmm_prof_reset();
+#ifdef TDMM_FIXED_STRATEGY
+    strat = TDMM_FIXED_STRATEGY;
+#endif
     g_strat = strat;
+    g_page_mode = g_pages;
+    g_soa_index = g_soa;
+    __atomic_add_fetch(&g_heap_gen, 1, __ATOMIC_RELEASE);
+    // The first arena exists up front so metrics describe a live heap
+    arena_new_locked();
+    pthread_mutex_unlock(&g_lock);
+}
 
-    size_t req = page_round_up((size_t)TDMM_HEAP_BYTES);
-    void *mem = mmap(NULL, req, PROT_READ | PROT_WRITE,
-                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (mem == MAP_FAILED) {
-        g_heap_base = NULL;
-        g_heap_size = 0;
-        g_head = NULL;
-        return;
+void t_reset(void) {
+    t_init(g_strat);
+}
+
+static int is_large_request(size_t size) {
+    size_t threshold = __atomic_load_n(&g_mmap_threshold, __ATOMIC_RELAXED);
+    return threshold && size >= threshold;
+}
+
+// Requests past the thread cache. Large mappings are always fresh pages, so
+// zero only costs a memset for slab objects and the dirty part of a block.
+static void *heap_malloc(tcache_t *tc, size_t size, int zero) {
+    if (is_large_request(size)) return tdmm_large_alloc(size, 16);
+
+    arena_t *a = tcache_arena(tc);
+    if (!a) return NULL;
+    size_t k = (size + SLAB_CLASS_BYTES - 1) / SLAB_CLASS_BYTES;
+    void *p;
+    tdmm_arena_lock(a);
+    if (slab_serves(k)) {
+        p = tdmm_slab_alloc(a, k - 1);
+        tdmm_arena_update_metrics(a, METRIC_MALLOC, size, p ? k * SLAB_CLASS_BYTES : 0);
+        if (p && zero) memset(p, 0, size);
+    } else {
+        p = zero ? tdmm_arena_calloc(a, size) : tdmm_arena_malloc(a, size);
     }
+    tdmm_arena_unlock(a);
+    return p;
+}
 
-    g_heap_base = mem;
-    g_heap_size = req;
+// Heap profile sampling: every allocation counts down tc->prof_left and only
+// one that takes it below zero leaves the fast path
+static __attribute__((noinline)) void *prof_sample(tcache_t *tc, void *p, size_t size) {
+    size_t weight = tdmm_prof_rearm(&tc->prof_left, &tc->prof_rng);
+    if (p && weight) tdmm_prof_record(p, size, weight);
+    return p;
+}
 
-    g_head = (block_hdr_t *)g_heap_base;
-    g_head->size = g_heap_size - hdr_size();
-    g_head->free = 1;
-    g_head->prev = NULL;
-    g_head->next = NULL;
+static inline void *prof_count(tcache_t *tc, void *p, size_t size) {
+    if (__builtin_expect((tc->prof_left -= (ptrdiff_t)size) < 0, 0)) return prof_sample(tc, p, size);
+    return p;
+}
 
-    g_metrics = (tdmm_metrics_t){0};
-    update_metrics(METRIC_INIT, 0, 0);
+static inline void *malloc_unsampled(tcache_t *tc, size_t size) {
+    size_t limit = __atomic_load_n(&g_tcache_max_bytes, __ATOMIC_RELAXED);
+    if (size <= limit) {
+        // Class k blocks carry at least 16k bytes, which covers every index's links
+        size_t k = (size + TCACHE_CLASS_BYTES - 1) / TCACHE_CLASS_BYTES;
+        if (tc->bins[k]) return tcache_pop(tc, k);
+        return tcache_refill(tc, k, size);
+    }
+    return heap_malloc(tc, size, 0);
 }
 
 void *t_malloc(size_t size) {
-    if (size == 0) { update_metrics(METRIC_MALLOC, 0, 0); return NULL; }
-    if (!g_heap_base) t_init(g_strat);
-    if (!g_heap_base) { update_metrics(METRIC_MALLOC, size, 0); return NULL; }
+    if (size == 0) return NULL;
+    tcache_t *tc = tcache_get();
+    return prof_count(tc, malloc_unsampled(tc, size), size);
+}
 
-    size_t need = ALIGN4(size);
-    block_hdr_t *b = find_block(need);
-    if (!b) { update_metrics(METRIC_MALLOC, size, 0); return NULL; }
+#ifdef TDMM_FIXED_STRATEGY
+void *TDMM_FIXED_ENTRY(t_malloc)(size_t size) __attribute__((alias("t_malloc")));
+#endif
 
-    split_block(b, need);
-    b->free = 0;
+static size_t malloc_batch(size_t size, size_t count, void **out) {
+    if (size == 0 || !out) return 0;
+    size_t got = 0;
+    if (is_large_request(size)) {
+        while (got < count && (out[got] = tdmm_large_alloc(size, 16))) got++;
+        return got;
+    }
 
-    void *p = payload_from_hdr(b);
-    if ((uintptr_t)p % 4 != 0) { update_metrics(METRIC_MALLOC, size, 0); return NULL; }
+    // Cached blocks first, then one pass over the arena for the rest
+    size_t limit = __atomic_load_n(&g_tcache_max_bytes, __ATOMIC_RELAXED);
+    tcache_t *tc = tcache_get();
+    size_t k = (size + TCACHE_CLASS_BYTES - 1) / TCACHE_CLASS_BYTES;
+    if (size <= limit) {
+        while (got < count && tc->bins[k]) out[got++] = tcache_pop(tc, k);
+    }
+    if (got == count) return got;
+
+    arena_t *a = tcache_arena(tc);
+    if (!a) return got;
+    size_t first = got;
+    size_t bytes = 0;
+    tdmm_arena_lock(a);
+    if (slab_serves(k)) {
+        while (got < count && (out[got] = tdmm_slab_alloc(a, k - 1))) got++;
+        bytes = (got - first) * k * SLAB_CLASS_BYTES;
+    } else {
+        // Blocks the thread cache would take back are sized for its class
+        size_t need = size <= limit ? align_payload(k * TCACHE_CLASS_BYTES) : request_payload(g_strat, size);
+        got += tdmm_arena_alloc_batch(a, need, count - got, out + got);
+        for (size_t i = first; i < got; i++) bytes += blk_size(hdr_from_payload(out[i]));
+    }
+    tdmm_arena_update_metrics(a, METRIC_MALLOC, size * (got - first), bytes);
+    tdmm_arena_unlock(a);
+    return got;
+}
 
-    update_metrics(METRIC_MALLOC, size, need);
+// The whole batch counts towards the next sample, which takes its last object
+size_t t_malloc_batch(size_t size, size_t count, void **out) {
+    size_t got = malloc_batch(size, count, out);
+    if (!got) return 0;
+    tcache_t *tc = tcache_get();
+    tc->prof_left -= (ptrdiff_t)(size * (got - 1));
+    prof_count(tc, out[got - 1], size);
+    return got;
+}
+
+void *t_aligned_alloc(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) return NULL;
+    if (size == 0) return NULL;
+    if (alignment <= TDMM_MIN_ALIGNMENT) return t_malloc(size);
+    tcache_t *tc = tcache_get();
+    // Cached blocks and slab objects are only guaranteed the default alignment
+    if (is_large_request(size)) return prof_count(tc, tdmm_large_alloc(size, alignment), size);
+
+    arena_t *a = tcache_arena(tc);
+    if (!a) return NULL;
+    tdmm_arena_lock(a);
+    void *p = tdmm_arena_aligned_malloc(a, alignment, size);
+    tdmm_arena_unlock(a);
+    return prof_count(tc, p, size);
+}
+
+void *t_calloc(size_t nmemb, size_t size) {
+    if (size && nmemb > SIZE_MAX / size) return NULL;
+    size_t total = nmemb * size;
+    if (total == 0) return NULL;
+
+    size_t limit = __atomic_load_n(&g_tcache_max_bytes, __ATOMIC_RELAXED);
+    tcache_t *tc = tcache_get();
+    if (total <= limit) {
+        // Cached blocks are always dirty; small enough that the memset is cheap
+        void *p = t_malloc(total);
+        if (p) memset(p, 0, total);
+        return p;
+    }
+    return prof_count(tc, heap_malloc(tc, total, 1), total);
+}
+
+void *t_realloc(void *ptr, size_t size) {
+    if (!ptr) return t_malloc(size);
+    if (size == 0) {
+        t_free(ptr);
+        return NULL;
+    }
+
+    size_t old;
+    if (slab_contains(ptr)) {
+        old = tdmm_slab_obj_size(ptr);
+        if (!old) return NULL;
+        if (size <= old) return ptr;
+    } else {
+        arena_t *a = arena_of(ptr);
+        if (!a) {
+            void *p = tdmm_large_realloc(ptr, size);
+            if (p && p != ptr) tdmm_prof_move(ptr, p);
+            return p;
+        }
+
+        block_hdr_t *b = hdr_from_payload(ptr);
+        uint32_t word = __atomic_load_n(&b->size, __ATOMIC_RELAXED);
+        old = word & ~BLOCK_FLAGS;
+        if (old == 0 || (word & BLOCK_FREE)) return NULL;
+        // Requests that t_malloc would map separately move out of the arena
+        if (!is_large_request(size)) {
+            tdmm_arena_lock(a);
+            int resized = tdmm_arena_resize(a, b, request_payload(g_strat, size));
+            tdmm_arena_unlock(a);
+            if (resized) return ptr;
+        }
+    }
+
+    void *p = t_malloc(size);
+    if (!p) return NULL;
+    memcpy(p, ptr, old < size ? old : size);
+    t_free(ptr);
     return p;
 }
 
+// Slab objects skip the tcache only when it is disabled or smaller than them.
+// Cached objects keep their live bit until flushed, so the bit rejects frees
+// of objects already back in their page and the tcache key the rest.
+static void slab_free(void *ptr, size_t sz) {
+    tcache_t *tc = tcache_get();
+    size_t limit = __atomic_load_n(&g_tcache_max_bytes, __ATOMIC_RELAXED);
+    size_t k = sz / TCACHE_CLASS_BYTES;
+    if (sz <= limit) {
+        if (!tdmm_slab_obj_size(ptr)) return;
+        if (((tcache_entry_t *)ptr)->key == g_tcache_key && tcache_owns(tc, k, ptr)) return;
+        tcache_push(tc, k, ptr, sz);
+        if (tc->counts[k] > TCACHE_BIN_MAX) tcache_flush(tc, k, TCACHE_BIN_MAX / 2);
+        return;
+    }
+
+    if (!tdmm_slab_release(ptr)) return;
+    arena_t *a = slab_of(ptr)->arena;
+    if (a != tc->arena) {
+        tdmm_slab_remote_free(a, ptr);
+        return;
+    }
+    tdmm_arena_lock(a);
+    tdmm_slab_free(a, ptr);
+    tdmm_arena_update_metrics(a, METRIC_FREE, 0, sz);
+    tdmm_arena_unlock(a);
+}
+
 void t_free(void *ptr) {
-    if (!ptr) { update_metrics(METRIC_FREE, 0, 0); return; }
-    if (!ptr_in_heap(ptr)) { update_metrics(METRIC_FREE, 0, 0); return; }
+    if (!ptr) return;
+    prof_forget(ptr);
+
+    // A slab object's page is found by masking, before any arena lookup
+    if (slab_contains(ptr)) {
+        size_t sz = tdmm_slab_obj_size(ptr);
+        if (sz) slab_free(ptr, sz);
+        return;
+    }
+
+    arena_t *a = arena_of(ptr);
+    if (!a) {
+        tdmm_large_free(ptr);
+        return;
+    }
 
     block_hdr_t *b = hdr_from_payload(ptr);
-    if (!ptr_in_heap(b)) { update_metrics(METRIC_FREE, 0, 0); return; }
-    if (b->free) { update_metrics(METRIC_FREE, 0, 0); return; }
-
-    size_t freed = b->size;
-    b->free = 1;
-    merge(b);
-    update_metrics(METRIC_FREE, 0, freed);
-}
\ No newline at end of file
+    uint32_t word = __atomic_load_n(&b->size, __ATOMIC_RELAXED);
+    size_t sz = word & ~BLOCK_FLAGS;
+    if (sz == 0 || (word & BLOCK_FREE)) return;
+
+    tcache_t *tc = tcache_get();
+    size_t limit = __atomic_load_n(&g_tcache_max_bytes, __ATOMIC_RELAXED);
+    size_t k = sz / TCACHE_CLASS_BYTES;
+    if (limit && k >= 1 && k * TCACHE_CLASS_BYTES <= limit) {
+        if (((tcache_entry_t *)ptr)->key == g_tcache_key && tcache_owns(tc, k, ptr)) return;
+        tcache_push(tc, k, ptr, sz);
+        if (tc->counts[k] > TCACHE_BIN_MAX) tcache_flush(tc, k, TCACHE_BIN_MAX / 2);
+        return;
+    }
+
+    // Blocks of other threads' arenas are handed back without their lock
+    if (a != tc->arena) {
+        tdmm_arena_remote_free(a, b);
+        return;
+    }
+    tdmm_arena_lock(a);
+    tdmm_arena_free(a, ptr);
+    tdmm_arena_unlock(a);
+}
+
+#ifdef TDMM_FIXED_STRATEGY
+void TDMM_FIXED_ENTRY(t_free)(void *ptr) __attribute__((alias("t_free")));
+#endif
+
+// In-place heapsort by address; the batch free runs inside malloc
+// replacements, so it must not allocate. Batches freed in the order they were
+// allocated are usually sorted already.
+static void sort_ptrs(void **v, size_t n) {
+    size_t i = 1;
+    while (i < n && (uintptr_t)v[i - 1] <= (uintptr_t)v[i]) i++;
+    if (i >= n) return;
+    for (size_t end = n, start = n / 2; end > 1; ) {
+        size_t root;
+        if (start > 0) {
+            root = --start;
+        } else {
+            void *t = v[--end];
+            v[end] = v[0];
+            v[0] = t;
+            root = 0;
+        }
+        for (size_t child; (child = 2 * root + 1) < end; root = child) {
+            if (child + 1 < end && (uintptr_t)v[child] < (uintptr_t)v[child + 1]) child++;
+            if ((uintptr_t)v[root] >= (uintptr_t)v[child]) break;
+            void *t = v[root];
+            v[root] = v[child];
+            v[child] = t;
+        }
+    }
+}
+
+void t_free_batch(void **ptrs, size_t count) {
+    if (!ptrs) return;
+    tcache_t *tc = tcache_get();
+    arena_t *own = tc->arena;
+
+    // Blocks of this thread's arena are gathered at the front of ptrs; the
+    // rest take the usual path
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        void *p = ptrs[i];
+        if (!p) continue;
+        if (own && !slab_contains(p) && arena_contains(own, p)) {
+            size_t k = blk_size_unlocked(hdr_from_payload(p)) / TCACHE_CLASS_BYTES;
+            int cached = k < TCACHE_CLASSES && ((tcache_entry_t *)p)->key == g_tcache_key && tcache_owns(tc, k, p);
+            if (!cached) {
+                prof_forget(p);
+                ptrs[n++] = p;
+            }
+            continue;
+        }
+        t_free(p);
+    }
+    if (!n) return;
+
+    sort_ptrs(ptrs, n);
+    tdmm_arena_lock(own);
+    tdmm_arena_free_batch(own, ptrs, n);
+    tdmm_arena_unlock(own);
+}
+
+void t_free_sized(void *ptr, size_t size) {
+    if (!ptr) return;
+    // The size picks the object's class directly; only the region check remains
+    if (slab_contains(ptr)) {
+        prof_forget(ptr);
+        slab_free(ptr, (size + SLAB_CLASS_BYTES - 1) / SLAB_CLASS_BYTES * SLAB_CLASS_BYTES);
+        return;
+    }
+    t_free(ptr);
+}
+
+size_t t_usable_size(void *ptr) {
+    if (!ptr) return 0;
+    if (slab_contains(ptr)) return tdmm_slab_obj_size(ptr);
+    if (!arena_of(ptr)) return tdmm_large_usable_size(ptr);
+    uint32_t word = __atomic_load_n(&hdr_from_payload(ptr)->size, __ATOMIC_RELAXED);
+    return (word & BLOCK_FREE) ? 0 : word & ~BLOCK_FLAGS;
+}
+
+int t_set_param(tdmm_param_e param, size_t value) {
+    switch (param) {
+        case TDMM_PARAM_MMAP_THRESHOLD:
+            __atomic_store_n(&g_mmap_threshold, value, __ATOMIC_RELAXED);
+            return 0;
+        case TDMM_PARAM_TCACHE_MAX_BYTES:
+            if (value > (TCACHE_CLASSES - 1) * TCACHE_CLASS_BYTES) return -1;
+            __atomic_store_n(&g_tcache_max_bytes, value, __ATOMIC_RELAXED);
+            return 0;
+        case TDMM_PARAM_SLAB_MAX_BYTES:
+            if (value > SLAB_CLASSES * SLAB_CLASS_BYTES) return -1;
+            __atomic_store_n(&g_slab_max_bytes, value, __ATOMIC_RELAXED);
+            return 0;
+        case TDMM_PARAM_FASTBIN_MAX_BYTES:
+            if (value > (FASTBIN_CLASSES - 1) * FASTBIN_CLASS_BYTES) return -1;
+            __atomic_store_n(&g_fastbin_max_bytes, value, __ATOMIC_RELAXED);
+            return 0;
+        case TDMM_PARAM_PAGES:
+            if (value > TDMM_PAGES_HUGETLB) return -1;
+            pthread_mutex_lock(&g_lock);
+            g_pages = (tdmm_pages_e)value;
+            pthread_mutex_unlock(&g_lock);
+            return 0;
+        case TDMM_PARAM_SOA_INDEX:
+            if (value > 1) return -1;
+            pthread_mutex_lock(&g_lock);
+            g_soa = (int)value;
+            pthread_mutex_unlock(&g_lock);
+            return 0;
+        case TDMM_PARAM_PROF_SAMPLE_BYTES:
+            tdmm_prof_set_sample_bytes(value);
+            return 0;
+        case TDMM_PARAM_ARENAS:
+            if (value > TDMM_MAX_ARENAS) return -1;
+            pthread_mutex_lock(&g_lock);
+            g_arena_limit = value ? value : default_arena_count();
+            pthread_mutex_unlock(&g_lock);
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+void t_stats(tdmm_stats_t *out) {
+    large_stats_t large = tdmm_large_stats();
+    *out = (tdmm_stats_t){0};
+    out->bytes_from_os = large.mapped_bytes + tdmm_slab_pool_bytes();
+    out->overhead_bytes = large.count * tdmm_large_hdr_size();
+    out->cur_inuse_bytes = large.inuse_bytes;
+    out->peak_inuse_bound_bytes = large.peak_inuse_bytes;
+    out->large_count = large.count;
+
+    pthread_mutex_lock(&g_lock);
+    for (size_t i = 0; i < g_narenas; i++) {
+        tdmm_arena_lock(g_arenas[i]);
+        tdmm_arena_stats(g_arenas[i], out);
+        tdmm_arena_unlock(g_arenas[i]);
+    }
+    // Bytes parked in thread caches count as free
+    size_t cached = 0;
+    for (tcache_t *tc = g_caches; tc; tc = tc->next_cache) {
+        if (tc->gen == g_heap_gen) cached += __atomic_load_n(&tc->cached_bytes, __ATOMIC_RELAXED);
+    }
+    out->cur_inuse_bytes -= cached < out->cur_inuse_bytes ? cached : out->cur_inuse_bytes;
+    pthread_mutex_unlock(&g_lock);
+}
+
+// A heap handle is its arena, which lives outside g_arenas, so nothing but the
+// t_heap_ functions ever reaches it
+static arena_t *heap_arena(t_heap_t *heap) {
+    return (arena_t *)heap;
+}
+
+t_heap_t *t_heap_create(alloc_strat_e strat) {
+#ifdef TDMM_FIXED_STRATEGY
+    strat = TDMM_FIXED_STRATEGY;
+#endif
+    arena_t *a = tdmm_arena_create(strat);
+    if (!a) return NULL;
+    pthread_once(&g_fork_once, fork_register);
+    pthread_mutex_lock(&g_lock);
+    a->next_heap = g_heaps;
+    g_heaps = a;
+    pthread_mutex_unlock(&g_lock);
+    return (t_heap_t *)a;
+}
+
+t_heap_t *t_heap_open(const char *path, size_t size, alloc_strat_e strat) {
+#ifdef TDMM_FIXED_STRATEGY
+    strat = TDMM_FIXED_STRATEGY;
+#endif
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0) return NULL;
+    arena_t *a = tdmm_arena_open(fd, size, strat);
+    if (!a) close(fd);
+    return (t_heap_t *)a;
+}
+
+int t_heap_sync(t_heap_t *heap) {
+    if (!heap) return -1;
+    arena_t *a = heap_arena(heap);
+    tdmm_arena_lock(a);
+    int r = tdmm_arena_sync(a);
+    tdmm_arena_unlock(a);
+    return r;
+}
+
+void t_heap_set_root(t_heap_t *heap, void *ptr) {
+    if (!heap) return;
+    arena_t *a = heap_arena(heap);
+    if (ptr && !arena_contains(a, ptr)) return;
+    tdmm_arena_lock(a);
+    a->root = ptr ? (uint32_t)((uint8_t *)ptr - (uint8_t *)a) : 0;
+    tdmm_arena_unlock(a);
+}
+
+void *t_heap_root(t_heap_t *heap) {
+    if (!heap) return NULL;
+    arena_t *a = heap_arena(heap);
+    tdmm_arena_lock(a);
+    void *p = a->root ? (uint8_t *)a + a->root : NULL;
+    tdmm_arena_unlock(a);
+    return p;
+}
+
+void *t_heap_malloc(t_heap_t *heap, size_t size) {
+    if (!heap) return t_malloc(size);
+    if (size == 0) return NULL;
+    arena_t *a = heap_arena(heap);
+    tdmm_arena_lock(a);
+    void *p = tdmm_arena_malloc(a, size);
+    tdmm_arena_unlock(a);
+    return p;
+}
+
+void t_heap_free(t_heap_t *heap, void *ptr) {
+    if (!heap) {
+        t_free(ptr);
+        return;
+    }
+    arena_t *a = heap_arena(heap);
+    if (!ptr || !arena_contains(a, ptr)) return;
+    tdmm_arena_lock(a);
+    tdmm_arena_free(a, ptr);
+    tdmm_arena_unlock(a);
+}
+
+void t_heap_reset(t_heap_t *heap) {
+    if (!heap) {
+        t_reset();
+        return;
+    }
+    arena_t *a = heap_arena(heap);
+    tdmm_arena_lock(a);
+    tdmm_arena_reset(a);
+    tdmm_arena_unlock(a);
+}
+
+void t_heap_destroy(t_heap_t *heap) {
+    if (!heap) return;
+    arena_t *a = heap_arena(heap);
+    pthread_mutex_lock(&g_lock);
+    for (arena_t **pp = &g_heaps; *pp; pp = &(*pp)->next_heap) {
+        if (*pp == a) {
+            *pp = a->next_heap;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_lock);
+    tdmm_arena_destroy(a);
+}
+
+// Ranges are gathered under the locks; smaps is read after they are dropped,
+// since stdio allocates
+int t_page_backing(tdmm_backing_t *out) {
+    struct { uintptr_t lo, hi; } ranges[TDMM_MAX_ARENAS + 1];
+    size_t n = 0;
+    *out = (tdmm_backing_t){0};
+
+    pthread_mutex_lock(&g_lock);
+    for (size_t i = 0; i < g_narenas; i++) {
+        arena_t *a = g_arenas[i];
+        tdmm_arena_lock(a);
+        ranges[n].lo = (uintptr_t)a;
+        ranges[n].hi = (uintptr_t)a + a->committed;
+        out->heap_bytes += a->committed;
+        out->hugetlb_bytes += a->hugetlb_bytes;
+        tdmm_arena_unlock(a);
+        n++;
+    }
+    size_t slab_hugetlb;
+    tdmm_slab_backing(&ranges[n].lo, &ranges[n].hi, &slab_hugetlb);
+    out->heap_bytes += ranges[n].hi - ranges[n].lo;
+    out->hugetlb_bytes += slab_hugetlb;
+    n++;
+    pthread_mutex_unlock(&g_lock);
+
+    FILE *f = fopen("/proc/self/smaps", "r");
+    if (!f) return -1;
+    char line[256];
+    size_t overlap = 0;   // bytes of the current mapping that belong to the heap
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long lo, hi, kb;
+        if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {
+            overlap = 0;
+            for (size_t i = 0; i < n; i++) {
+                uintptr_t a = max(ranges[i].lo, (uintptr_t)lo);
+                uintptr_t b = ranges[i].hi < hi ? ranges[i].hi : (uintptr_t)hi;
+                if (a < b) overlap += b - a;
+            }
+        } else if (overlap && sscanf(line, "AnonHugePages: %lu kB", &kb) == 1) {
+            // A mapping merged with a neighbor outside the heap is counted up to its heap part
+            size_t bytes = (size_t)kb * 1024u;
+            out->thp_bytes += bytes < overlap ? bytes : overlap;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+int t_prof_dump(int fd) {
+    return tdmm_prof_dump(fd);
+}
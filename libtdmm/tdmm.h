@@ -3,19 +3,119 @@
 
 #include <stddef.h>
 
+// Alignment of every payload t_malloc returns. Building with TDMM_ALIGN16
+// raises it to 16 bytes, the alignment of max_align_t.
+#ifdef TDMM_ALIGN16
+#define TDMM_MIN_ALIGNMENT 16
+#else
+#define TDMM_MIN_ALIGNMENT 4
+#endif
+
 typedef enum {
   FIRST_FIT,
   BEST_FIT,
   WORST_FIT,
+  TLSF,  // two-level segregated fit: O(1) lookup over size-class bitmaps
+  NEXT_FIT,                   // first fit resuming where the previous search stopped
+  ADDRESS_ORDERED_FIRST_FIT,  // first fit over an address-ordered index of free blocks only
 } alloc_strat_e;
 
+// A build with TDMM_FIXED_STRATEGY set to one of the above (the TDMM_STRATEGY
+// CMake option) compiles the free-block search for that strategy alone
+// instead of dispatching on every call, and t_init runs it whatever it is
+// passed. It also exports t_malloc and t_free under the strategy's name, e.g.
+// t_malloc_first_fit, so code built for the specialization fails to link
+// against any other build.
+#ifdef TDMM_FIXED_STRATEGY
+#define TDMM_NAME_FIRST_FIT first_fit
+#define TDMM_NAME_BEST_FIT best_fit
+#define TDMM_NAME_WORST_FIT worst_fit
+#define TDMM_NAME_TLSF tlsf
+#define TDMM_NAME_NEXT_FIT next_fit
+#define TDMM_NAME_ADDRESS_ORDERED_FIRST_FIT address_ordered_first_fit
+#define TDMM_CAT_(a, b) a##b
+#define TDMM_CAT(a, b) TDMM_CAT_(a, b)
+#define TDMM_FIXED_ENTRY(fn) TDMM_CAT(fn##_, TDMM_CAT(TDMM_NAME_, TDMM_FIXED_STRATEGY))
+#endif
+
+typedef enum {
+  TDMM_PARAM_MMAP_THRESHOLD,    // requests of at least this many bytes get their own mapping; 0 disables
+  TDMM_PARAM_TCACHE_MAX_BYTES,  // largest request served from per-thread caches (at most 1024); 0 disables
+  TDMM_PARAM_ARENAS,            // number of arenas threads are spread over (at most 64); 0 picks one per CPU
+  TDMM_PARAM_SLAB_MAX_BYTES,    // largest request served from slab pages (at most 512); 0 disables
+  TDMM_PARAM_FASTBIN_MAX_BYTES, // largest freed block kept unmerged for reuse (at most 1024); 0 disables
+  TDMM_PARAM_PAGES,             // tdmm_pages_e for the heap; takes effect at the next t_init
+  TDMM_PARAM_PROF_SAMPLE_BYTES, // mean bytes allocated between heap profile samples; 0 (the default) disables
+  TDMM_PARAM_SOA_INDEX,         // 1 keeps FIRST_FIT, BEST_FIT and WORST_FIT free blocks in flat arrays scanned
+                                // with SIMD instead of the heap walk or tree; takes effect at the next t_init
+} tdmm_param_e;
+
+// Defaults of the size parameters above
+#define TDMM_DEFAULT_MMAP_THRESHOLD (128u * 1024u)
+#define TDMM_DEFAULT_TCACHE_MAX_BYTES 512u
+#define TDMM_DEFAULT_SLAB_MAX_BYTES 256u
+#define TDMM_DEFAULT_FASTBIN_MAX_BYTES 1024u
+
+// How heap memory is requested from the OS. The huge page modes align each
+// heap reservation to 2 MiB and commit it in whole huge pages.
+typedef enum {
+  TDMM_PAGES_DEFAULT,   // base pages
+  TDMM_PAGES_THP,       // madvise(MADV_HUGEPAGE): transparent huge pages where the kernel allows
+  TDMM_PAGES_HUGETLB,   // MAP_HUGETLB from the reserved pool, falling back to TDMM_PAGES_THP
+} tdmm_pages_e;
+
+// An independent heap with its own reservation and strategy; see t_heap_create.
+// Passing NULL to the t_heap_ functions means the default heap that t_malloc
+// and the other global functions serve.
+typedef struct t_heap t_heap_t;
+
+#define TDMM_STATS_BINS 32  // free_histogram[i] counts free blocks with 2^i <= payload < 2^(i+1)
+
+typedef struct {
+  // OS memory
+  size_t bytes_from_os;
+  size_t overhead_bytes;        // arena control blocks, block headers and mapping headers
+  // Memory usage
+  size_t cur_inuse_bytes;       // bytes parked in thread caches count as free
+  // Sum of each arena's peak and the separate mappings' peak. The parts can
+  // peak at different times, so this bounds the process peak from above; it
+  // is exact while one arena serves everything and no large requests are live.
+  size_t peak_inuse_bound_bytes;
+  // Utilization: util_sum / num_util is the mean of cur_inuse / bytes_from_os per operation
+  double util_sum;
+  size_t num_util;
+  // Heap shape
+  size_t block_count;
+  size_t free_block_count;      // includes blocks waiting unmerged in fast bins
+  size_t free_bytes;
+  size_t largest_free_block;
+  size_t free_histogram[TDMM_STATS_BINS];
+  size_t slab_pages;            // slab pages owned by arenas; pooled empty pages count only as OS memory
+  size_t large_count;           // live requests served by their own mapping
+} tdmm_stats_t;
+
+// Which pages actually back the heap; see t_page_backing
+typedef struct {
+  size_t heap_bytes;            // arena and slab memory committed from the OS
+  size_t hugetlb_bytes;         // of which mapped from the hugetlb pool
+  size_t thp_bytes;             // of which currently backed by transparent huge pages
+} tdmm_backing_t;
+
 /**
- * Initializes the memory allocator with the given strategy.
+ * Initializes the memory allocator with the given strategy, discarding any
+ * previous heap. t_malloc and t_free are thread-safe, but t_init must not run
+ * concurrently with other allocator calls.
  *
  * @param strat The strategy to use for memory allocation.
  */
 void t_init(alloc_strat_e strat);
 
+/**
+ * Drops every allocation of the default heap and starts it over with the
+ * strategy of the last t_init. Same restrictions as t_init.
+ */
+void t_reset(void);
+
 /**
  * Allocates a block of memory of the given size.
  *
@@ -24,6 +124,49 @@ void t_init(alloc_strat_e strat);
  */
 void *t_malloc(size_t size);
 
+/**
+ * Allocates count blocks of the same size in one call. Blocks from the heap
+ * are carved from as few free regions as possible under a single lock, and
+ * the metrics are updated once for the batch.
+ *
+ * @param size The size of each memory block.
+ * @param count The number of blocks to allocate.
+ * @param out Receives the pointers; must have room for count of them.
+ * @return The number of blocks allocated, which is less than count only if memory runs out.
+ */
+size_t t_malloc_batch(size_t size, size_t count, void **out);
+
+/**
+ * Allocates a block of memory whose address is a multiple of alignment. The
+ * padding in front of the block stays in the heap as free memory.
+ *
+ * @param alignment The required alignment; must be a power of two.
+ * @param size The size of the memory block to allocate.
+ * @return A pointer to the allocated memory block, or NULL if the allocation fails or alignment is invalid.
+ */
+void *t_aligned_alloc(size_t alignment, size_t size);
+
+/**
+ * Allocates zeroed memory for an array of nmemb elements of size bytes each.
+ * Memory the heap has never handed out is already zero and is not cleared again.
+ *
+ * @param nmemb The number of elements.
+ * @param size The size of each element.
+ * @return A pointer to the zeroed memory, or NULL if the allocation fails or the total size overflows.
+ */
+void *t_calloc(size_t nmemb, size_t size);
+
+/**
+ * Changes the size of the memory block at ptr, keeping its contents up to the
+ * smaller of the old and new sizes. The block is resized in place when its
+ * neighbors allow, and moved otherwise.
+ *
+ * @param ptr The memory block to resize, as returned by t_malloc; NULL allocates a new block.
+ * @param size The new size; 0 frees ptr and returns NULL.
+ * @return A pointer to the resized block, or NULL if it fails, in which case ptr is left untouched.
+ */
+void *t_realloc(void *ptr, size_t size);
+
 /**
  * Frees the given memory block.
  *
@@ -31,4 +174,171 @@ void *t_malloc(size_t size);
  */
 void t_free(void *ptr);
 
+#ifdef TDMM_FIXED_STRATEGY
+void *TDMM_FIXED_ENTRY(t_malloc)(size_t size);
+void TDMM_FIXED_ENTRY(t_free)(void *ptr);
+#endif
+
+/**
+ * Frees count memory blocks in one call. The blocks are sorted by address so
+ * neighbors among them are coalesced together, and the metrics are updated
+ * once for the batch.
+ *
+ * @param ptrs The pointers to free; NULL entries are skipped. The array is
+ *             used as scratch space, so its contents are unspecified afterwards.
+ * @param count The number of entries in ptrs.
+ */
+void t_free_batch(void **ptrs, size_t count);
+
+/**
+ * Frees a memory block whose requested size is known, skipping the lookup of
+ * the block's size.
+ *
+ * @param ptr The pointer to free, as returned by t_malloc.
+ * @param size The size passed to t_malloc for ptr.
+ */
+void t_free_sized(void *ptr, size_t size);
+
+/**
+ * Returns how many bytes the block at ptr can hold, which may exceed the size
+ * it was requested with.
+ *
+ * @param ptr A pointer returned by t_malloc, or NULL.
+ * @return The usable size of the block, or 0 if ptr is NULL or not a live block.
+ */
+size_t t_usable_size(void *ptr);
+
+/**
+ * Sets a tunable allocator parameter. Applies to allocations made after the call;
+ * TDMM_PARAM_ARENAS applies to threads that pick an arena after the call, and
+ * every thread picks again after t_init.
+ *
+ * @param param The parameter to set.
+ * @param value The new value.
+ * @return 0 on success, -1 if the parameter is unknown or the value is out of range.
+ */
+int t_set_param(tdmm_param_e param, size_t value);
+
+/**
+ * Fills out with the allocator's counters. They are maintained incrementally,
+ * so the cost does not depend on the number of blocks, except that
+ * largest_free_block is looked up in the free-block index again after the
+ * largest block is handed out while others of a similar size remain.
+ *
+ * @param out Where to write the statistics.
+ */
+void t_stats(tdmm_stats_t *out);
+
+/**
+ * Creates a heap separate from the default one, with its own address space
+ * reservation and strategy. It serves every request from its own blocks,
+ * without thread caches, slab pages or separate mappings, which is what lets
+ * t_heap_reset drop everything at once. Heap calls are thread-safe.
+ *
+ * @param strat The strategy the heap allocates with.
+ * @return The new heap, or NULL if its address space could not be reserved.
+ */
+t_heap_t *t_heap_create(alloc_strat_e strat);
+
+/**
+ * Opens a heap stored in a file, which is mapped shared, so its blocks are
+ * the file's pages: reopening it after a restart costs one mapping plus the
+ * page faults of what is touched. An empty or new file is formatted as a
+ * heap. Otherwise the file must have been written by a build with the same
+ * alignment, and its strategy is kept. Block links are offsets, so the heap
+ * still works when the old address range is taken and it maps elsewhere,
+ * but pointers the application stored in it are then stale; store offsets
+ * from t_heap_root instead where that matters. Only one process may have the
+ * file open, so a forked child must not use a heap its parent opened. The
+ * heap behaves like one from t_heap_create, and t_heap_destroy unmaps it,
+ * leaving the file.
+ *
+ * @param path The heap file, created if missing.
+ * @param size Address space to reserve for a new file, at least 1 MiB; 0 picks the default. Ignored for an existing heap.
+ * @param strat The strategy of a new heap.
+ * @return The heap, or NULL if the file holds something else, is in use, or cannot be mapped.
+ */
+t_heap_t *t_heap_open(const char *path, size_t size, alloc_strat_e strat);
+
+/**
+ * Writes a file-backed heap to its file with msync. The file holds a
+ * consistent heap as of the last call; changes made after it reach the file
+ * too, but may be caught half done if the system goes down.
+ *
+ * @param heap A heap from t_heap_open.
+ * @return 0 on success, -1 if the heap is not file-backed or msync fails.
+ */
+int t_heap_sync(t_heap_t *heap);
+
+/**
+ * Records the block an application finds its data through after reopening a
+ * heap. The root is kept as an offset and cleared by t_heap_reset.
+ *
+ * @param heap The heap; NULL (the default heap) is ignored.
+ * @param ptr A block of the heap, or NULL to clear the root.
+ */
+void t_heap_set_root(t_heap_t *heap, void *ptr);
+
+/**
+ * @param heap The heap; NULL gives NULL.
+ * @return The block last passed to t_heap_set_root, at its current address, or NULL if none.
+ */
+void *t_heap_root(t_heap_t *heap);
+
+/**
+ * Allocates from a heap.
+ *
+ * @param heap The heap, or NULL for the default heap (same as t_malloc).
+ * @param size The size of the block to allocate.
+ * @return A pointer to the block, or NULL if the heap cannot fit it.
+ */
+void *t_heap_malloc(t_heap_t *heap, size_t size);
+
+/**
+ * Frees a block back to the heap it came from. Pointers that are not live
+ * blocks of the heap are ignored.
+ *
+ * @param heap The heap ptr was allocated from, or NULL for the default heap.
+ * @param ptr The block to free; NULL is ignored.
+ */
+void t_heap_free(t_heap_t *heap, void *ptr);
+
+/**
+ * Frees every block of a heap at once, in constant time: the heap becomes a
+ * single free block again and keeps its committed memory for reuse. Must not
+ * run concurrently with other calls on the same heap.
+ *
+ * @param heap The heap to reset, or NULL to reset the default heap (same as t_reset).
+ */
+void t_heap_reset(t_heap_t *heap);
+
+/**
+ * Releases a heap and all of its memory. NULL and the default heap are ignored.
+ *
+ * @param heap The heap to destroy.
+ */
+void t_heap_destroy(t_heap_t *heap);
+
+/**
+ * Reports which pages back the heap, to tell whether a TDMM_PARAM_PAGES
+ * request was honored. The transparent huge page count is read from
+ * /proc/self/smaps, so this is meant for benchmarks, not hot paths.
+ *
+ * @param out Where to write the counts.
+ * @return 0 on success, -1 if /proc/self/smaps could not be read, leaving thp_bytes 0.
+ */
+int t_page_backing(tdmm_backing_t *out);
+
+/**
+ * Writes the heap profile: for each call site with live sampled allocations,
+ * the bytes they are estimated to stand for and the backtrace that made them.
+ * Sampling is enabled with TDMM_PARAM_PROF_SAMPLE_BYTES; every thread picks a
+ * new setting up within a megabyte of allocation, or at the next t_init.
+ * Samples are dropped by t_init.
+ *
+ * @param fd File descriptor to write the text profile to.
+ * @return 0 on success, -1 if a write failed.
+ */
+int t_prof_dump(int fd);
+
 #endif // TDMM_H
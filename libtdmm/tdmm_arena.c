@@ -0,0 +1,758 @@
+#include "tdmm_internal.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define FASTBIN_KEY 0x5f1b93d1u
+
+size_t g_fastbin_max_bytes = TDMM_DEFAULT_FASTBIN_MAX_BYTES;
+tdmm_pages_e g_page_mode = TDMM_PAGES_DEFAULT;
+int g_soa_index = 0;
+
+// MAP_HUGETLB fails at mmap time when the pool is short, rather than at a
+// later fault. A kernel may already have dropped the reserved range by then,
+// which the fallback maps again straight away.
+int tdmm_commit_pages(void *at, size_t len, tdmm_pages_e mode) {
+#ifdef MAP_HUGETLB
+    if (mode == TDMM_PAGES_HUGETLB &&
+        mmap(at, len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1, 0) != MAP_FAILED) {
+        return 1;
+    }
+#endif
+    if (mmap(at, len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        return -1;
+    }
+#ifdef MADV_HUGEPAGE
+    if (mode != TDMM_PAGES_DEFAULT) madvise(at, len, MADV_HUGEPAGE);
+#endif
+    return 0;
+}
+
+// Commits are whole pages, or whole huge pages in the huge page modes
+static size_t commit_round_up(tdmm_pages_e mode, size_t n) {
+    if (mode == TDMM_PAGES_DEFAULT) return page_round_up(n);
+    return (n + TDMM_HUGE_PAGE_BYTES - 1) / TDMM_HUGE_PAGE_BYTES * TDMM_HUGE_PAGE_BYTES;
+}
+
+// Heap files from a build with another control block or payload alignment
+// are refused rather than misread
+static uint64_t file_layout(void) {
+    return (uint64_t)sizeof(arena_t) << 8 | TDMM_MIN_ALIGNMENT;
+}
+
+// Maps [at, at + len) of a reservation starting at base to the same range of
+// the file, extending the file first if it is shorter. The extension reads as
+// zero, like fresh anonymous memory.
+static int commit_file(int fd, void *base, void *at, size_t len) {
+    off_t end = (off_t)((uint8_t *)at - (uint8_t *)base + len);
+    struct stat st;
+    if (fstat(fd, &st) != 0) return -1;
+    if (st.st_size < end && ftruncate(fd, end) != 0) return -1;
+    if (mmap(at, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, end - (off_t)len) == MAP_FAILED) {
+        return -1;
+    }
+    return 0;
+}
+
+static int chunk_table_add(arena_t *a, uintptr_t base, size_t len) {
+    if (a->nchunks == a->chunks_cap) {
+        size_t cap = a->chunks_cap ? a->chunks_cap * 2 : page_round_up(1) / sizeof(chunk_t);
+        void *mem = mmap(NULL, page_round_up(cap * sizeof(chunk_t)), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) return 0;
+        if (a->chunks) {
+            memcpy(mem, a->chunks, a->nchunks * sizeof(chunk_t));
+            munmap(a->chunks, page_round_up(a->chunks_cap * sizeof(chunk_t)));
+        }
+        a->chunks = (chunk_t *)mem;
+        a->chunks_cap = cap;
+    }
+
+    size_t i = a->nchunks;
+    while (i > 0 && a->chunks[i - 1].base > base) {
+        a->chunks[i] = a->chunks[i - 1];
+        i--;
+    }
+    a->chunks[i] = (chunk_t){ base, len };
+    a->nchunks++;
+    return 1;
+}
+
+// Binary search over the committed chunks
+static int ptr_in_heap(const arena_t *a, const void *p) {
+    uintptr_t x = (uintptr_t)p;
+    size_t lo = 0, hi = a->nchunks;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (x < a->chunks[mid].base) hi = mid;
+        else if (x >= a->chunks[mid].base + a->chunks[mid].len) lo = mid + 1;
+        else return 1;
+    }
+    return 0;
+}
+
+// Coalesces a newly released (not yet indexed) block with its free neighbors,
+// found in O(1) through the next header and the boundary tag, and indexes the result
+static void merge(arena_t *a, block_hdr_t *b) {
+    if (!b) return;
+    block_hdr_t *n = next_block(b);
+    if (blk_free(n)) {
+        tdmm_index_remove(a, n);
+        set_blk_size(b, blk_size(b) + hdr_size() + blk_size(n));
+        a->metrics.block_count--;
+        if (a->rover == blk_off(a, n)) a->rover = blk_off(a, b);
+    }
+    if (b->size & BLOCK_PREV_FREE) {
+        block_hdr_t *p = prev_block(b);
+        tdmm_index_remove(a, p);
+        set_blk_size(p, blk_size(p) + hdr_size() + blk_size(b));
+        a->metrics.block_count--;
+        if (a->rover == blk_off(a, b)) a->rover = blk_off(a, p);
+        b = p;
+    }
+    mark_free(b);
+    tdmm_index_insert(a, b);
+}
+
+// Splits the tail of a free block b into a new free block. b keeps its
+// BLOCK_FREE flag; the caller marks it used afterwards.
+static void split_block(arena_t *a, block_hdr_t *b, size_t need) {
+    if (!b || blk_size(b) < need) return;
+
+    size_t hsz = hdr_size();
+    size_t remaining = blk_size(b) - need;
+
+    // Only split if leftover can hold a header + the minimum payload
+    if (remaining < hsz + tdmm_min_payload(arena_strat(a))) return;
+
+    set_blk_size(b, need);
+    block_hdr_t *n = next_block(b);
+    n->size = (uint32_t)(remaining - hsz);
+    a->metrics.block_count++;
+    mark_free(n);
+    tdmm_index_insert(a, n);
+}
+
+// Commits another chunk at the end of the reservation. The old end header becomes
+// the header of a new free block spanning the chunk, which merge() joins with a
+// trailing free block if there is one.
+static int heap_grow(arena_t *a, size_t need) {
+    size_t hsz = hdr_size();
+    size_t len = commit_round_up(a->pages, max((size_t)TDMM_CHUNK_BYTES, need + 2 * hsz));
+    if (len > a->reserved - a->committed) return 0;
+
+    uint8_t *at = (uint8_t *)a + a->committed;
+    int huge = a->file_magic ? commit_file(a->file_fd, a, at, len) : tdmm_commit_pages(at, len, a->pages);
+    if (huge < 0) return 0;
+    if (!chunk_table_add(a, (uintptr_t)at, len)) {
+        mmap(at, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+        return 0;
+    }
+    if (huge) a->hugetlb_bytes += len;
+
+    block_hdr_t *b = (block_hdr_t *)(at - hsz);
+    set_blk_size(b, len - hsz);
+    __atomic_store_n(&a->committed, a->committed + len, __ATOMIC_RELEASE);
+
+    block_hdr_t *end = next_block(b);
+    end->prev_size = 0;
+    end->size = 0;
+
+    a->metrics.block_count++;
+    int joins_tail = (b->size & BLOCK_PREV_FREE) != 0;
+    merge(a, b);
+    // The old end header is now payload of the tail block; clear it so the
+    // tail past clean_off still reads as zero
+    if (joins_tail) memset(b, 0, hsz);
+    return 1;
+}
+
+static fast_links_t *fast_of(block_hdr_t *b) {
+    return (fast_links_t *)payload_from_hdr(b);
+}
+
+// Merges every fast-binned block back into the free index. A block whose
+// neighbor is still binned is joined with it when the neighbor's turn comes.
+static void fast_consolidate(arena_t *a) {
+    if (!a->fast_blocks) return;
+    for (size_t k = 1; k < FASTBIN_CLASSES; k++) {
+        uint32_t off = a->fast_heads[k];
+        a->fast_heads[k] = 0;
+        a->fast_counts[k] = 0;
+        while (off) {
+            block_hdr_t *b = blk_at(a, off);
+            off = fast_of(b)->next;
+            fast_of(b)->key = 0;
+            merge(a, b);
+        }
+    }
+    a->fast_blocks = 0;
+    a->fast_bytes = 0;
+}
+
+// Parks a released block in its bin without merging it; returns 0 if it is
+// outside the binned sizes
+static int fast_push(arena_t *a, block_hdr_t *b) {
+    size_t sz = blk_size(b);
+    size_t k = sz / FASTBIN_CLASS_BYTES;
+    if (k == 0 || sz > __atomic_load_n(&g_fastbin_max_bytes, __ATOMIC_RELAXED)) return 0;
+
+    fast_links_t *l = fast_of(b);
+    l->next = a->fast_heads[k];
+    l->key = FASTBIN_KEY;
+    a->fast_heads[k] = blk_off(a, b);
+    a->fast_blocks++;
+    a->fast_bytes += sz;
+    if (++a->fast_counts[k] > FASTBIN_BIN_MAX) fast_consolidate(a);
+    return 1;
+}
+
+// The newest block of the bin holding need-byte payloads if it is big enough,
+// else the newest of the next bin up, whose blocks all are
+static block_hdr_t *fast_pop(arena_t *a, size_t need) {
+    size_t k = need / FASTBIN_CLASS_BYTES;
+    if (!a->fast_blocks || k >= FASTBIN_CLASSES) return NULL;
+    block_hdr_t *b = blk_at(a, a->fast_heads[k]);
+    if (!b || blk_size(b) < need) {
+        if (++k == FASTBIN_CLASSES) return NULL;
+        b = blk_at(a, a->fast_heads[k]);
+        if (!b) return NULL;
+    }
+
+    fast_links_t *l = fast_of(b);
+    a->fast_heads[k] = l->next;
+    l->key = 0;
+    a->fast_counts[k]--;
+    a->fast_blocks--;
+    a->fast_bytes -= blk_size(b);
+    return b;
+}
+
+// Whether a used-looking block is already waiting in a fast bin
+static int fast_binned(arena_t *a, block_hdr_t *b) {
+    size_t k = blk_size(b) / FASTBIN_CLASS_BYTES;
+    if (k == 0 || k >= FASTBIN_CLASSES || fast_of(b)->key != FASTBIN_KEY) return 0;
+    uint32_t off = blk_off(a, b);
+    for (uint32_t cur = a->fast_heads[k]; cur; cur = fast_of(blk_at(a, cur))->next) {
+        if (cur == off) return 1;
+    }
+    return 0;
+}
+
+// Every block given back to the arena goes through here
+static void release(arena_t *a, block_hdr_t *b) {
+    if (!fast_push(a, b)) merge(a, b);
+}
+
+// Raises the clean watermark past a block handed to the caller, together with
+// the header and index links a split may write right after it
+static void note_dirty(arena_t *a, block_hdr_t *b) {
+    size_t end = blk_off(a, b) + 2 * hdr_size() + blk_size(b) + tdmm_min_payload(arena_strat(a));
+    a->clean_off = max(a->clean_off, end);
+}
+
+static double util_epoch_value(const arena_metrics_t *m) {
+    return m->util_epoch_os ? (double)m->util_epoch_sum / (double)m->util_epoch_os : 0.0;
+}
+
+void tdmm_arena_update_metrics(arena_t *a, metric_event_t ev, size_t req_bytes, size_t actual_bytes) {
+    (void)req_bytes;
+    arena_metrics_t *m = &a->metrics;
+    if (ev == METRIC_MALLOC) {
+        m->cur_inuse_bytes += actual_bytes;
+        m->peak_inuse_bytes = max(m->peak_inuse_bytes, m->cur_inuse_bytes);
+    } else if (ev == METRIC_FREE) {
+        m->cur_inuse_bytes = max(0, (ssize_t)m->cur_inuse_bytes - (ssize_t)actual_bytes);
+    }
+
+    // Fold the running sum when the divisor changes (or the sum nears overflow)
+    size_t os = arena_os_bytes(a);
+    if (os != m->util_epoch_os || m->util_epoch_sum > UINT64_MAX / 2) {
+        m->util_sum += util_epoch_value(m);
+        m->util_epoch_sum = 0;
+        m->util_epoch_os = os;
+    }
+    m->util_epoch_sum += m->cur_inuse_bytes;
+    m->num_util += 1;
+}
+
+// Adds this arena's counters to out
+void tdmm_arena_stats(arena_t *a, tdmm_stats_t *out) {
+    const arena_metrics_t *m = &a->metrics;
+    out->bytes_from_os += arena_os_bytes(a);
+    // Control block, block headers, the end header and slab page headers
+    out->overhead_bytes += arena_first_block_off() + (m->block_count + 1) * hdr_size() +
+                           a->slab_pages * tdmm_slab_hdr_size();
+    out->slab_pages += a->slab_pages;
+    out->cur_inuse_bytes += m->cur_inuse_bytes;
+    out->peak_inuse_bound_bytes += m->peak_inuse_bytes;
+    out->util_sum += m->util_sum + util_epoch_value(m);
+    out->num_util += m->num_util;
+    out->block_count += m->block_count;
+    out->free_block_count += m->free_block_count + a->fast_blocks;
+    out->free_bytes += m->free_bytes + a->fast_bytes;
+    out->largest_free_block = max(out->largest_free_block, tdmm_index_largest(a));
+    for (size_t i = 0; i < TDMM_STATS_BINS; i++) out->free_histogram[i] += m->free_hist[i];
+    // A bin's sizes never straddle a power of two
+    for (size_t k = 1; k < FASTBIN_CLASSES; k++) {
+        out->free_histogram[tdmm_hist_bin(k * FASTBIN_CLASS_BYTES)] += a->fast_counts[k];
+    }
+}
+
+// Lays out a new arena whose control block is filled in up to committed:
+// [arena][first block ... ][end header]. The zero-sized end header stops walks
+// and carries the last block's boundary tag.
+static void arena_format(arena_t *a) {
+    size_t hsz = hdr_size();
+    a->head = (block_hdr_t *)((uint8_t *)a + arena_first_block_off());
+    a->head->prev_size = 0;
+    a->head->size = (uint32_t)(a->committed - arena_first_block_off() - 2 * hsz);
+
+    block_hdr_t *end = next_block(a->head);
+    end->prev_size = 0;
+    end->size = 0;
+
+    a->metrics.block_count = 1;
+    a->rover = 0;
+    a->clean_off = arena_first_block_off() + hsz + tdmm_min_payload(arena_strat(a));
+    mark_free(a->head);
+    tdmm_index_reset(a);
+    tdmm_index_insert(a, a->head);
+
+    tdmm_arena_update_metrics(a, METRIC_INIT, 0, 0);
+}
+
+arena_t *tdmm_arena_create(alloc_strat_e strat) {
+    // Reserve without committing; back off if the address space is limited.
+    // Huge pages need a 2 MiB aligned base, so over-reserve and trim.
+    tdmm_pages_e pages = g_page_mode;
+    size_t align = pages == TDMM_PAGES_DEFAULT ? 0 : TDMM_HUGE_PAGE_BYTES;
+    size_t first = commit_round_up(pages, (size_t)TDMM_CHUNK_BYTES);
+    size_t reserve = TDMM_HEAP_RESERVE_BYTES;
+    void *mem = MAP_FAILED;
+    while (reserve >= first) {
+        mem = mmap(NULL, reserve + align, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (mem != MAP_FAILED) break;
+        reserve /= 2;
+    }
+    if (mem == MAP_FAILED) return NULL;
+    if (align) {
+        uintptr_t raw = (uintptr_t)mem;
+        uintptr_t base = (raw + align - 1) & ~(uintptr_t)(align - 1);
+        if (base > raw) munmap(mem, base - raw);
+        munmap((void *)(base + reserve), raw + align - base);
+        mem = (void *)base;
+    }
+
+    int huge = tdmm_commit_pages(mem, first, pages);
+    if (huge < 0) {
+        munmap(mem, reserve);
+        return NULL;
+    }
+
+    // Fresh anonymous memory is zeroed, so only non-zero fields need setting
+    arena_t *a = (arena_t *)mem;
+    if (!chunk_table_add(a, (uintptr_t)mem, first)) {
+        munmap(mem, reserve);
+        return NULL;
+    }
+    pthread_mutex_init(&a->lock, NULL);
+    a->strat = strat;
+    a->soa = g_soa_index && soa_capable(strat);
+    a->index = a->soa ? &g_soa_index_ops[strat] : &g_index_ops[strat];
+    a->pages = pages;
+    a->hugetlb_bytes = huge ? first : 0;
+    a->committed = first;
+    a->reserved = reserve;
+    arena_format(a);
+    return a;
+}
+
+arena_t *tdmm_arena_open(int fd, size_t size, alloc_strat_e strat) {
+    // One process at a time; the lock goes away with the descriptor
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0) return NULL;
+
+    int fresh = st.st_size == 0;
+    size_t reserve;
+    size_t committed = TDMM_CHUNK_BYTES;
+    void *hint = NULL;
+    if (fresh) {
+        reserve = size ? page_round_up(size) : TDMM_HEAP_RESERVE_BYTES;
+        if (reserve < committed || reserve > TDMM_HEAP_RESERVE_BYTES) return NULL;
+    } else {
+        arena_t hdr;
+        if ((size_t)st.st_size < sizeof(hdr) || pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr)) return NULL;
+        if (hdr.file_magic != TDMM_FILE_MAGIC || hdr.file_layout != file_layout()) return NULL;
+        if (hdr.reserved > TDMM_HEAP_RESERVE_BYTES || hdr.committed > hdr.reserved ||
+            (off_t)hdr.committed > st.st_size || (unsigned)hdr.strat > ADDRESS_ORDERED_FIRST_FIT) {
+            return NULL;
+        }
+#ifdef TDMM_FIXED_STRATEGY
+        if (hdr.strat != TDMM_FIXED_STRATEGY) return NULL;
+#endif
+        strat = hdr.strat;
+        reserve = hdr.reserved;
+        committed = hdr.committed;
+        hint = (void *)hdr.file_base;
+    }
+
+    // Asking for the old base keeps pointers stored in the heap valid. Any
+    // other range works for the allocator itself, whose links are offsets.
+    void *mem = mmap(hint, reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) return NULL;
+    if (commit_file(fd, mem, mem, committed) != 0) {
+        munmap(mem, reserve);
+        return NULL;
+    }
+    arena_t *a = (arena_t *)mem;
+    a->chunks = NULL;
+    a->nchunks = 0;
+    a->chunks_cap = 0;
+    if (!chunk_table_add(a, (uintptr_t)mem, committed)) {
+        munmap(mem, reserve);
+        return NULL;
+    }
+
+    // Everything that points outside the file belonged to the last process
+    pthread_mutex_init(&a->lock, NULL);
+    a->strat = strat;
+    a->index = &g_index_ops[strat];
+    a->soa = 0;
+    a->soa_off = NULL;
+    a->soa_size = NULL;
+    a->soa_n = 0;
+    a->soa_cap = 0;
+    a->pages = TDMM_PAGES_DEFAULT;
+    a->hugetlb_bytes = 0;
+    a->committed = committed;
+    a->reserved = reserve;
+    a->head = (block_hdr_t *)((uint8_t *)a + arena_first_block_off());
+    memset(a->slab_partial, 0, sizeof(a->slab_partial));
+    a->slab_pages = 0;
+    a->remote_head = 0;
+    a->remote_slab_head = NULL;
+    a->remote_bytes = 0;
+    a->file_base = (uintptr_t)mem;
+    a->file_fd = fd;
+    if (fresh) {
+        arena_format(a);
+        // Last, so a file left half formatted is not taken for a heap
+        a->file_layout = file_layout();
+        a->file_magic = TDMM_FILE_MAGIC;
+    }
+    return a;
+}
+
+int tdmm_arena_sync(arena_t *a) {
+    if (!a->file_magic) return -1;
+    return msync(a, a->committed, MS_SYNC) == 0 ? 0 : -1;
+}
+
+// Drops every block at once: the committed area becomes a single free block
+// again and stays committed. Only the control block is touched, so the cost
+// does not depend on how many blocks were live. Thread caches and slab pages
+// are not tracked here; only arenas that never feed them may be reset.
+void tdmm_arena_reset(arena_t *a) {
+    a->head->prev_size = 0;
+    a->head->size = (uint32_t)(a->committed - arena_first_block_off() - 2 * hdr_size());
+    block_hdr_t *end = next_block(a->head);
+    end->prev_size = 0;
+    end->size = 0;
+
+    memset(a->fast_heads, 0, sizeof(a->fast_heads));
+    memset(a->fast_counts, 0, sizeof(a->fast_counts));
+    a->fast_blocks = 0;
+    a->fast_bytes = 0;
+    a->rover = 0;
+    __atomic_store_n(&a->remote_head, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&a->remote_bytes, 0, __ATOMIC_RELAXED);
+    a->metrics.block_count = 1;
+    a->metrics.cur_inuse_bytes = 0;
+    a->root = 0;
+    mark_free(a->head);
+    tdmm_index_reset(a);
+    tdmm_index_insert(a, a->head);
+    tdmm_arena_update_metrics(a, METRIC_INIT, 0, 0);
+}
+
+// Not synchronized with other users of the arena
+void tdmm_arena_destroy(arena_t *a) {
+    if (!a) return;
+    if (a->chunks) munmap(a->chunks, page_round_up(a->chunks_cap * sizeof(chunk_t)));
+    tdmm_soa_release(a);
+    pthread_mutex_destroy(&a->lock);
+    // A file keeps the heap; the page cache writes it back without a sync
+    int fd = a->file_magic ? a->file_fd : -1;
+    munmap(a, a->reserved);
+    if (fd >= 0) close(fd);
+}
+
+void tdmm_arena_remote_free(arena_t *a, block_hdr_t *b) {
+    uint32_t off = blk_off(a, b);
+    uint32_t *next = (uint32_t *)payload_from_hdr(b);
+    __atomic_add_fetch(&a->remote_bytes, blk_size_unlocked(b), __ATOMIC_RELAXED);
+
+    uint32_t head = __atomic_load_n(&a->remote_head, __ATOMIC_RELAXED);
+    do {
+        *next = head;
+    } while (!__atomic_compare_exchange_n(&a->remote_head, &head, off, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Takes the whole remote stack at once; a single consumer swapping the head
+// out cannot hit ABA, so producers never wait on the owner
+static void drain_remote(arena_t *a) {
+    if (!__atomic_load_n(&a->remote_head, __ATOMIC_RELAXED)) return;
+    uint32_t off = __atomic_exchange_n(&a->remote_head, 0, __ATOMIC_ACQUIRE);
+    size_t bytes = 0;
+    while (off) {
+        block_hdr_t *b = blk_at(a, off);
+        off = *(uint32_t *)payload_from_hdr(b);
+        bytes += blk_size(b);
+        release(a, b);
+    }
+    __atomic_sub_fetch(&a->remote_bytes, bytes, __ATOMIC_RELAXED);
+    tdmm_arena_update_metrics(a, METRIC_FREE, 0, bytes);
+}
+
+// Whoever holds an arena's lock drains its remote frees first
+void tdmm_arena_lock(arena_t *a) {
+    pthread_mutex_lock(&a->lock);
+    drain_remote(a);
+    tdmm_slab_drain_remote(a);
+}
+
+void tdmm_arena_unlock(arena_t *a) {
+    pthread_mutex_unlock(&a->lock);
+}
+
+void tdmm_arena_fork_unlock(arena_t *a, int child) {
+    if (child) pthread_mutex_init(&a->lock, NULL);
+    else pthread_mutex_unlock(&a->lock);
+}
+
+// Hands out free block b, already out of the index, trimmed to need bytes
+static void take_block(arena_t *a, block_hdr_t *b, size_t need) {
+    split_block(a, b, need);
+    mark_used(b);
+    // NEXT_FIT resumes after this block; the rover is only ever moved off a
+    // block when merge() absorbs it
+    block_hdr_t *n = next_block(b);
+    a->rover = blk_size(n) ? blk_off(a, n) : 0;
+    note_dirty(a, b);
+}
+
+// Free block of at least need bytes from the index, merging the fast bins
+// and then committing another chunk if it has none
+static block_hdr_t *find_free(arena_t *a, size_t need) {
+    block_hdr_t *b = tdmm_index_find(a, need);
+    if (!b && a->fast_blocks) {
+        fast_consolidate(a);
+        b = tdmm_index_find(a, need);
+    }
+    if (!b && heap_grow(a, need)) b = tdmm_index_find(a, need);
+    return b;
+}
+
+// Carves a used block with at least need payload bytes out of the arena.
+// A fast-binned block is handed back as it is, with no split.
+block_hdr_t *tdmm_arena_alloc_block(arena_t *a, size_t need) {
+    if (need >= a->reserved) return NULL;
+    block_hdr_t *b = fast_pop(a, need);
+    if (b) return b;
+    b = find_free(a, need);
+    if (!b) return NULL;
+
+    tdmm_index_remove(a, b);
+    take_block(a, b, need);
+    return b;
+}
+
+// Carves blocks of need bytes off the front of free block b, already out of
+// the index, until count are taken or the rest is too small for another;
+// the last one is trimmed like any other allocation
+static size_t carve_run(arena_t *a, block_hdr_t *b, size_t need, size_t count, void **out) {
+    size_t hsz = hdr_size();
+    size_t got = 0;
+    while (got + 1 < count && blk_size(b) >= 2 * need + hsz) {
+        size_t rest = blk_size(b) - need - hsz;
+        set_blk_size(b, need);
+        b->size &= ~BLOCK_FREE;
+        block_hdr_t *n = next_block(b);
+        n->size = (uint32_t)rest | BLOCK_FREE;
+        a->metrics.block_count++;
+        out[got++] = payload_from_hdr(b);
+        b = n;
+    }
+    take_block(a, b, need);
+    out[got++] = payload_from_hdr(b);
+    return got;
+}
+
+// Fills out with up to count blocks of need bytes and returns how many it got.
+// Each search asks for room for all the remaining blocks, so a batch usually
+// comes out of one free block; failing that, any block that fits one is
+// carved, and the heap only grows when none does.
+size_t tdmm_arena_alloc_batch(arena_t *a, size_t need, size_t count, void **out) {
+    if (need >= a->reserved) return 0;
+    size_t hsz = hdr_size();
+    size_t got = 0;
+    while (got < count) {
+        block_hdr_t *b = fast_pop(a, need);
+        if (!b) break;
+        out[got++] = payload_from_hdr(b);
+    }
+    while (got < count) {
+        size_t left = count - got;
+        block_hdr_t *b = NULL;
+        if (left > 1 && left < a->reserved / (need + hsz)) b = tdmm_index_find(a, left * (need + hsz) - hsz);
+        if (!b) b = find_free(a, need);
+        if (!b) break;
+        tdmm_index_remove(a, b);
+        got += carve_run(a, b, need, left, out + got);
+    }
+    return got;
+}
+
+// Carves a used block whose payload is a multiple of align (a power of two
+// above TDMM_MIN_ALIGNMENT). The search asks for enough room to put a
+// minimal free block in front of the aligned payload, so the padding is
+// split off and stays in the index instead of being wasted.
+block_hdr_t *tdmm_arena_alloc_aligned(arena_t *a, size_t align, size_t need) {
+    size_t hsz = hdr_size();
+    size_t lead_min = hsz + tdmm_min_payload(arena_strat(a));
+    if (need >= a->reserved || align >= a->reserved) return NULL;
+    block_hdr_t *b = find_free(a, need + align + lead_min);
+    if (!b) return NULL;
+
+    tdmm_index_remove(a, b);
+    uintptr_t p = (uintptr_t)payload_from_hdr(b);
+    if (p % align != 0) {
+        uintptr_t q = (p + lead_min + align - 1) & ~(uintptr_t)(align - 1);
+        size_t lead = q - hsz - p;
+        block_hdr_t *nb = (block_hdr_t *)(q - hsz);
+        nb->size = (uint32_t)(blk_size(b) - lead - hsz);
+        set_blk_size(b, lead);
+        a->metrics.block_count++;
+        mark_free(b);
+        tdmm_index_insert(a, b);
+        b = nb;
+    }
+    take_block(a, b, need);
+    return b;
+}
+
+// Resizes a used block in place: the tail beyond need is split off, and growth
+// absorbs a free successor, committing another chunk first when b is the last
+// block. Returns 0, leaving b untouched, if b cannot reach need in place.
+int tdmm_arena_resize(arena_t *a, block_hdr_t *b, size_t need) {
+    if (need >= a->reserved) return 0;
+    size_t old = blk_size(b);
+    block_hdr_t *n = next_block(b);
+    size_t avail = old + (blk_free(n) ? hdr_size() + blk_size(n) : 0);
+    if (avail < need) {
+        block_hdr_t *last = blk_free(n) ? next_block(n) : n;
+        if (blk_size(last) != 0 || !heap_grow(a, need - avail)) return 0;
+        // heap_grow left a free block right after b
+        n = next_block(b);
+        if (old + hdr_size() + blk_size(n) < need) return 0;
+    }
+
+    if (blk_free(n)) {
+        tdmm_index_remove(a, n);
+        if (a->rover == blk_off(a, n)) a->rover = blk_off(a, b);
+        set_blk_size(b, old + hdr_size() + blk_size(n));
+        a->metrics.block_count--;
+    }
+    split_block(a, b, need);
+    mark_used(b);
+    note_dirty(a, b);
+
+    size_t now = blk_size(b);
+    if (now >= old) tdmm_arena_update_metrics(a, METRIC_MALLOC, need, now - old);
+    else tdmm_arena_update_metrics(a, METRIC_FREE, 0, old - now);
+    return 1;
+}
+
+void tdmm_arena_release_block(arena_t *a, block_hdr_t *b) {
+    release(a, b);
+}
+
+void *tdmm_arena_malloc(arena_t *a, size_t size) {
+    if (size >= a->reserved) { tdmm_arena_update_metrics(a, METRIC_MALLOC, size, 0); return NULL; }
+
+    block_hdr_t *b = tdmm_arena_alloc_block(a, request_payload(arena_strat(a), size));
+    if (!b) { tdmm_arena_update_metrics(a, METRIC_MALLOC, size, 0); return NULL; }
+
+    void *p = payload_from_hdr(b);
+    if ((uintptr_t)p % TDMM_MIN_ALIGNMENT != 0) { tdmm_arena_update_metrics(a, METRIC_MALLOC, size, 0); return NULL; }
+
+    tdmm_arena_update_metrics(a, METRIC_MALLOC, size, blk_size(b));
+    return p;
+}
+
+void *tdmm_arena_aligned_malloc(arena_t *a, size_t align, size_t size) {
+    block_hdr_t *b = NULL;
+    if (size < a->reserved) b = tdmm_arena_alloc_aligned(a, align, request_payload(arena_strat(a), size));
+    tdmm_arena_update_metrics(a, METRIC_MALLOC, size, b ? blk_size(b) : 0);
+    return b ? payload_from_hdr(b) : NULL;
+}
+
+// Only the part of the payload below the clean watermark can hold old data
+void *tdmm_arena_calloc(arena_t *a, size_t size) {
+    size_t clean = a->clean_off;
+    void *p = tdmm_arena_malloc(a, size);
+    if (!p) return NULL;
+    size_t off = (size_t)((uint8_t *)p - (uint8_t *)a);
+    if (off < clean) memset(p, 0, size < clean - off ? size : clean - off);
+    return p;
+}
+
+void tdmm_arena_free(arena_t *a, void *ptr) {
+    block_hdr_t *b = hdr_from_payload(ptr);
+    if (!ptr_in_heap(a, b)) { tdmm_arena_update_metrics(a, METRIC_FREE, 0, 0); return; }
+    // The zero-sized end header is a sentinel, never a payload
+    if (blk_free(b) || blk_size(b) == 0) { tdmm_arena_update_metrics(a, METRIC_FREE, 0, 0); return; }
+    if (fast_binned(a, b)) { tdmm_arena_update_metrics(a, METRIC_FREE, 0, 0); return; }
+
+    size_t freed = blk_size(b);
+    release(a, b);
+    tdmm_arena_update_metrics(a, METRIC_FREE, 0, freed);
+}
+
+// ptrs holds n pointers into a's heap, sorted by address. Each run of
+// adjacent blocks is joined into one before it is released, so the run costs
+// a single merge, and the metrics are updated once for the whole batch.
+void tdmm_arena_free_batch(arena_t *a, void **ptrs, size_t n) {
+    size_t freed = 0;
+    block_hdr_t *run = NULL;
+    for (size_t i = 0; i < n; i++) {
+        if (i > 0 && ptrs[i] == ptrs[i - 1]) continue;
+        block_hdr_t *b = hdr_from_payload(ptrs[i]);
+        if (!ptr_in_heap(a, b) || blk_free(b) || blk_size(b) == 0 || fast_binned(a, b)) continue;
+
+        freed += blk_size(b);
+        if (run && next_block(run) == b) {
+            set_blk_size(run, blk_size(run) + hdr_size() + blk_size(b));
+            a->metrics.block_count--;
+            if (a->rover == blk_off(a, b)) a->rover = blk_off(a, run);
+            continue;
+        }
+        if (run) release(a, run);
+        run = b;
+    }
+    if (run) release(a, run);
+    tdmm_arena_update_metrics(a, METRIC_FREE, 0, freed);
+}
@@ -0,0 +1,553 @@
+#include "tdmm_internal.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+static free_links_t *links_of(block_hdr_t *b) {
+    return (free_links_t *)payload_from_hdr(b);
+}
+
+static tree_links_t *tree_of(block_hdr_t *b) {
+    return (tree_links_t *)payload_from_hdr(b);
+}
+
+static int uses_tree(alloc_strat_e strat) {
+    return strat == BEST_FIT || strat == WORST_FIT || strat == ADDRESS_ORDERED_FIRST_FIT;
+}
+
+static unsigned fls_size(size_t x) {
+    return (unsigned)(sizeof(unsigned long long) * 8 - 1) - (unsigned)__builtin_clzll((unsigned long long)x);
+}
+
+static void tlsf_mapping(size_t size, unsigned *fl, unsigned *sl) {
+    if (size < TLSF_SL_COUNT) {
+        *fl = 0;
+        *sl = (unsigned)size;
+        return;
+    }
+    unsigned f = fls_size(size);
+    *fl = f;
+    *sl = (unsigned)(size >> (f - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+}
+
+static void tlsf_insert(arena_t *a, block_hdr_t *b) {
+    unsigned fl, sl;
+    tlsf_mapping(blk_size(b), &fl, &sl);
+
+    uint32_t head = a->tlsf.heads[fl][sl];
+    links_of(b)->prev_free = 0;
+    links_of(b)->next_free = head;
+    if (head) links_of(blk_at(a, head))->prev_free = blk_off(a, b);
+    a->tlsf.heads[fl][sl] = blk_off(a, b);
+
+    a->tlsf.fl_bitmap |= 1u << fl;
+    a->tlsf.sl_bitmap[fl] |= 1u << sl;
+}
+
+static void tlsf_remove(arena_t *a, block_hdr_t *b) {
+    unsigned fl, sl;
+    tlsf_mapping(blk_size(b), &fl, &sl);
+
+    free_links_t *l = links_of(b);
+    if (l->prev_free) links_of(blk_at(a, l->prev_free))->next_free = l->next_free;
+    else a->tlsf.heads[fl][sl] = l->next_free;
+    if (l->next_free) links_of(blk_at(a, l->next_free))->prev_free = l->prev_free;
+
+    if (!a->tlsf.heads[fl][sl]) {
+        a->tlsf.sl_bitmap[fl] &= ~(1u << sl);
+        if (!a->tlsf.sl_bitmap[fl]) a->tlsf.fl_bitmap &= ~(1u << fl);
+    }
+}
+
+static block_hdr_t *tlsf_find(arena_t *a, size_t need) {
+    // Round up to the next class boundary so any block in the chosen list fits
+    if (need >= TLSF_SL_COUNT) {
+        size_t round = ((size_t)1 << (fls_size(need) - TLSF_SL_LOG2)) - 1;
+        if (need > SIZE_MAX - round) return NULL;
+        need += round;
+    }
+    unsigned fl, sl;
+    tlsf_mapping(need, &fl, &sl);
+    if (fl >= TLSF_FL_COUNT) return NULL;
+
+    uint32_t sl_map = a->tlsf.sl_bitmap[fl] & (~0u << sl);
+    if (!sl_map) {
+        uint32_t fl_map = (fl + 1 < TLSF_FL_COUNT) ? (a->tlsf.fl_bitmap & (~0u << (fl + 1))) : 0;
+        if (!fl_map) return NULL;
+        fl = (unsigned)__builtin_ctz(fl_map);
+        sl_map = a->tlsf.sl_bitmap[fl];
+    }
+    sl = (unsigned)__builtin_ctz(sl_map);
+    return blk_at(a, a->tlsf.heads[fl][sl]);
+}
+
+static block_hdr_t *rb_left(arena_t *a, block_hdr_t *b) {
+    return blk_at(a, tree_of(b)->left);
+}
+
+static block_hdr_t *rb_right(arena_t *a, block_hdr_t *b) {
+    return blk_at(a, tree_of(b)->right);
+}
+
+static block_hdr_t *rb_parent(arena_t *a, block_hdr_t *b) {
+    return blk_at(a, tree_of(b)->parent_red & ~1u);
+}
+
+static void rb_set_left(arena_t *a, block_hdr_t *b, block_hdr_t *x) {
+    tree_of(b)->left = blk_off(a, x);
+}
+
+static void rb_set_right(arena_t *a, block_hdr_t *b, block_hdr_t *x) {
+    tree_of(b)->right = blk_off(a, x);
+}
+
+static void rb_set_parent(arena_t *a, block_hdr_t *b, block_hdr_t *p) {
+    tree_of(b)->parent_red = blk_off(a, p) | (tree_of(b)->parent_red & 1u);
+}
+
+static int is_red(block_hdr_t *b) {
+    return b && (tree_of(b)->parent_red & 1u);
+}
+
+static void set_red(block_hdr_t *b, int red) {
+    tree_of(b)->parent_red = (tree_of(b)->parent_red & ~1u) | (red ? 1u : 0u);
+}
+
+// Orders blocks by size, breaking ties by address so equal sizes keep the
+// address-order preference of the original list scan
+static int size_key_less(const block_hdr_t *x, const block_hdr_t *y) {
+    if (blk_size(x) != blk_size(y)) return blk_size(x) < blk_size(y);
+    return (uintptr_t)x < (uintptr_t)y;
+}
+
+static int tree_key_less(const arena_t *a, const block_hdr_t *x, const block_hdr_t *y) {
+    if (arena_strat(a) == ADDRESS_ORDERED_FIRST_FIT) return (uintptr_t)x < (uintptr_t)y;
+    return size_key_less(x, y);
+}
+
+static uint32_t subtree_max(block_hdr_t *b) {
+    return b ? ((addr_tree_links_t *)payload_from_hdr(b))->subtree_max : 0;
+}
+
+// Recomputes b's augmented size from its children; a no-op for size-ordered trees
+static void tree_update(arena_t *a, block_hdr_t *b) {
+    if (arena_strat(a) != ADDRESS_ORDERED_FIRST_FIT) return;
+    uint32_t m = (uint32_t)blk_size(b);
+    m = max(m, subtree_max(rb_left(a, b)));
+    m = max(m, subtree_max(rb_right(a, b)));
+    ((addr_tree_links_t *)payload_from_hdr(b))->subtree_max = m;
+}
+
+static void tree_update_path(arena_t *a, block_hdr_t *b) {
+    if (arena_strat(a) != ADDRESS_ORDERED_FIRST_FIT) return;
+    for (; b; b = rb_parent(a, b)) tree_update(a, b);
+}
+
+static void tree_rotate_left(arena_t *a, block_hdr_t *x) {
+    block_hdr_t *y = rb_right(a, x);
+    block_hdr_t *p = rb_parent(a, x);
+
+    rb_set_right(a, x, rb_left(a, y));
+    if (rb_left(a, y)) rb_set_parent(a, rb_left(a, y), x);
+    rb_set_parent(a, y, p);
+    if (!p) a->tree_root = blk_off(a, y);
+    else if (rb_left(a, p) == x) rb_set_left(a, p, y);
+    else rb_set_right(a, p, y);
+    rb_set_left(a, y, x);
+    rb_set_parent(a, x, y);
+    tree_update(a, x);
+    tree_update(a, y);
+}
+
+static void tree_rotate_right(arena_t *a, block_hdr_t *x) {
+    block_hdr_t *y = rb_left(a, x);
+    block_hdr_t *p = rb_parent(a, x);
+
+    rb_set_left(a, x, rb_right(a, y));
+    if (rb_right(a, y)) rb_set_parent(a, rb_right(a, y), x);
+    rb_set_parent(a, y, p);
+    if (!p) a->tree_root = blk_off(a, y);
+    else if (rb_right(a, p) == x) rb_set_right(a, p, y);
+    else rb_set_left(a, p, y);
+    rb_set_right(a, y, x);
+    rb_set_parent(a, x, y);
+    tree_update(a, x);
+    tree_update(a, y);
+}
+
+static void tree_insert(arena_t *a, block_hdr_t *b) {
+    block_hdr_t *parent = NULL;
+    block_hdr_t *cur = blk_at(a, a->tree_root);
+    while (cur) {
+        parent = cur;
+        cur = tree_key_less(a, b, cur) ? rb_left(a, cur) : rb_right(a, cur);
+    }
+
+    tree_of(b)->left = 0;
+    tree_of(b)->right = 0;
+    tree_of(b)->parent_red = blk_off(a, parent) | 1u;
+    if (!parent) a->tree_root = blk_off(a, b);
+    else if (tree_key_less(a, b, parent)) rb_set_left(a, parent, b);
+    else rb_set_right(a, parent, b);
+    tree_update_path(a, b);
+
+    while (is_red(rb_parent(a, b))) {
+        block_hdr_t *p = rb_parent(a, b);
+        block_hdr_t *g = rb_parent(a, p);
+        if (p == rb_left(a, g)) {
+            block_hdr_t *u = rb_right(a, g);
+            if (is_red(u)) {
+                set_red(p, 0);
+                set_red(u, 0);
+                set_red(g, 1);
+                b = g;
+                continue;
+            }
+            if (b == rb_right(a, p)) {
+                tree_rotate_left(a, p);
+                b = p;
+                p = rb_parent(a, b);
+            }
+            set_red(p, 0);
+            set_red(g, 1);
+            tree_rotate_right(a, g);
+        } else {
+            block_hdr_t *u = rb_left(a, g);
+            if (is_red(u)) {
+                set_red(p, 0);
+                set_red(u, 0);
+                set_red(g, 1);
+                b = g;
+                continue;
+            }
+            if (b == rb_left(a, p)) {
+                tree_rotate_right(a, p);
+                b = p;
+                p = rb_parent(a, b);
+            }
+            set_red(p, 0);
+            set_red(g, 1);
+            tree_rotate_left(a, g);
+        }
+    }
+    set_red(blk_at(a, a->tree_root), 0);
+}
+
+// Replaces the subtree rooted at u with the one rooted at v
+static void tree_transplant(arena_t *a, block_hdr_t *u, block_hdr_t *v) {
+    block_hdr_t *p = rb_parent(a, u);
+    if (!p) a->tree_root = blk_off(a, v);
+    else if (rb_left(a, p) == u) rb_set_left(a, p, v);
+    else rb_set_right(a, p, v);
+    if (v) rb_set_parent(a, v, p);
+}
+
+static void tree_remove(arena_t *a, block_hdr_t *z) {
+    block_hdr_t *x;
+    block_hdr_t *x_parent;
+    int removed_red = is_red(z);
+
+    if (!rb_left(a, z)) {
+        x = rb_right(a, z);
+        x_parent = rb_parent(a, z);
+        tree_transplant(a, z, x);
+    } else if (!rb_right(a, z)) {
+        x = rb_left(a, z);
+        x_parent = rb_parent(a, z);
+        tree_transplant(a, z, x);
+    } else {
+        block_hdr_t *y = rb_right(a, z);
+        while (rb_left(a, y)) y = rb_left(a, y);
+        removed_red = is_red(y);
+        x = rb_right(a, y);
+        if (rb_parent(a, y) == z) {
+            x_parent = y;
+        } else {
+            x_parent = rb_parent(a, y);
+            tree_transplant(a, y, x);
+            rb_set_right(a, y, rb_right(a, z));
+            rb_set_parent(a, rb_right(a, y), y);
+        }
+        tree_transplant(a, z, y);
+        rb_set_left(a, y, rb_left(a, z));
+        rb_set_parent(a, rb_left(a, y), y);
+        set_red(y, is_red(z));
+    }
+    tree_update_path(a, x_parent);
+    if (removed_red) return;
+
+    while (x != blk_at(a, a->tree_root) && !is_red(x)) {
+        if (x == rb_left(a, x_parent)) {
+            block_hdr_t *w = rb_right(a, x_parent);
+            if (is_red(w)) {
+                set_red(w, 0);
+                set_red(x_parent, 1);
+                tree_rotate_left(a, x_parent);
+                w = rb_right(a, x_parent);
+            }
+            if (!is_red(rb_left(a, w)) && !is_red(rb_right(a, w))) {
+                set_red(w, 1);
+                x = x_parent;
+                x_parent = rb_parent(a, x);
+                continue;
+            }
+            if (!is_red(rb_right(a, w))) {
+                set_red(rb_left(a, w), 0);
+                set_red(w, 1);
+                tree_rotate_right(a, w);
+                w = rb_right(a, x_parent);
+            }
+            set_red(w, is_red(x_parent));
+            set_red(x_parent, 0);
+            if (rb_right(a, w)) set_red(rb_right(a, w), 0);
+            tree_rotate_left(a, x_parent);
+            x = blk_at(a, a->tree_root);
+        } else {
+            block_hdr_t *w = rb_left(a, x_parent);
+            if (is_red(w)) {
+                set_red(w, 0);
+                set_red(x_parent, 1);
+                tree_rotate_right(a, x_parent);
+                w = rb_left(a, x_parent);
+            }
+            if (!is_red(rb_left(a, w)) && !is_red(rb_right(a, w))) {
+                set_red(w, 1);
+                x = x_parent;
+                x_parent = rb_parent(a, x);
+                continue;
+            }
+            if (!is_red(rb_left(a, w))) {
+                set_red(rb_right(a, w), 0);
+                set_red(w, 1);
+                tree_rotate_left(a, w);
+                w = rb_left(a, x_parent);
+            }
+            set_red(w, is_red(x_parent));
+            set_red(x_parent, 0);
+            if (rb_left(a, w)) set_red(rb_left(a, w), 0);
+            tree_rotate_right(a, x_parent);
+            x = blk_at(a, a->tree_root);
+        }
+    }
+    if (x) set_red(x, 0);
+}
+
+// Smallest block with size >= need, lowest address among equal sizes
+static block_hdr_t *tree_lower_bound(arena_t *a, size_t need) {
+    block_hdr_t *choice = NULL;
+    for (block_hdr_t *cur = blk_at(a, a->tree_root); cur; ) {
+        if (blk_size(cur) >= need) {
+            choice = cur;
+            cur = rb_left(a, cur);
+        } else {
+            cur = rb_right(a, cur);
+        }
+    }
+    return choice;
+}
+
+static block_hdr_t *tree_largest(arena_t *a) {
+    block_hdr_t *cur = blk_at(a, a->tree_root);
+    if (!cur) return NULL;
+    while (rb_right(a, cur)) cur = rb_right(a, cur);
+    // Prefer the lowest-addressed block among those of the largest size
+    return tree_lower_bound(a, blk_size(cur));
+}
+
+// Lowest-addressed free block with size >= need: descend left whenever the left
+// subtree still holds a fit
+static block_hdr_t *tree_first_fit(arena_t *a, size_t need) {
+    block_hdr_t *cur = blk_at(a, a->tree_root);
+    if (subtree_max(cur) < need) return NULL;
+    while (cur) {
+        block_hdr_t *l = rb_left(a, cur);
+        if (subtree_max(l) >= need) cur = l;
+        else if (blk_size(cur) >= need) return cur;
+        else cur = rb_right(a, cur);
+    }
+    return NULL;
+}
+
+// NEXT_FIT: scan from the rover to the end of the heap, then wrap to the head
+static block_hdr_t *next_fit(arena_t *a, size_t need) {
+    block_hdr_t *start = a->rover ? blk_at(a, a->rover) : a->head;
+    for (block_hdr_t *cur = start; blk_size(cur); cur = next_block(cur)) {
+        if (blk_free(cur) && blk_size(cur) >= need) return cur;
+    }
+    for (block_hdr_t *cur = a->head; cur != start; cur = next_block(cur)) {
+        if (blk_free(cur) && blk_size(cur) >= need) return cur;
+    }
+    return NULL;
+}
+
+unsigned tdmm_hist_bin(size_t size) {
+    unsigned bin = fls_size(size);
+    return bin < TDMM_STATS_BINS ? bin : TDMM_STATS_BINS - 1;
+}
+
+// The per-strategy parts of the index. strat is a constant in every caller,
+// so each specialization below keeps only its own branch.
+static inline void index_insert(arena_t *a, block_hdr_t *b, alloc_strat_e strat) {
+    if (strat == TLSF) tlsf_insert(a, b);
+    else if (uses_tree(strat)) tree_insert(a, b);
+}
+
+static inline void index_remove(arena_t *a, block_hdr_t *b, alloc_strat_e strat) {
+    if (strat == TLSF) tlsf_remove(a, b);
+    else if (uses_tree(strat)) tree_remove(a, b);
+}
+
+static inline block_hdr_t *index_find(arena_t *a, size_t need, alloc_strat_e strat) {
+    if (strat == FIRST_FIT) {
+        for (block_hdr_t *cur = a->head; blk_size(cur); cur = next_block(cur)) {
+            if (blk_free(cur) && blk_size(cur) >= need) return cur;
+        }
+        return NULL;
+    }
+    if (strat == NEXT_FIT) return next_fit(a, need);
+    if (strat == ADDRESS_ORDERED_FIRST_FIT) return tree_first_fit(a, need);
+    if (strat == BEST_FIT) return tree_lower_bound(a, need);
+    if (strat == WORST_FIT) {
+        block_hdr_t *largest = tree_largest(a);
+        return (largest && blk_size(largest) >= need) ? largest : NULL;
+    }
+    if (strat == TLSF) return tlsf_find(a, need);
+    return NULL;
+}
+
+static inline size_t index_largest(arena_t *a, alloc_strat_e strat) {
+    size_t largest = 0;
+    if (strat == ADDRESS_ORDERED_FIRST_FIT) {
+        largest = subtree_max(blk_at(a, a->tree_root));
+    } else if (strat == BEST_FIT || strat == WORST_FIT) {
+        block_hdr_t *b = tree_largest(a);
+        largest = b ? blk_size(b) : 0;
+    } else if (strat == TLSF) {
+        // Only the highest non-empty class can hold the largest block
+        if (a->tlsf.fl_bitmap) {
+            unsigned fl = 31u - (unsigned)__builtin_clz(a->tlsf.fl_bitmap);
+            unsigned sl = 31u - (unsigned)__builtin_clz(a->tlsf.sl_bitmap[fl]);
+            for (block_hdr_t *b = blk_at(a, a->tlsf.heads[fl][sl]); b; b = blk_at(a, links_of(b)->next_free)) {
+                largest = max(largest, blk_size(b));
+            }
+        }
+    } else {
+        for (block_hdr_t *cur = a->head; blk_size(cur); cur = next_block(cur)) {
+            if (blk_free(cur)) largest = max(largest, blk_size(cur));
+        }
+    }
+    return largest;
+}
+
+#define INDEX_SPECIALIZE(strat) \
+    static void insert_##strat(arena_t *a, block_hdr_t *b) { index_insert(a, b, strat); } \
+    static void remove_##strat(arena_t *a, block_hdr_t *b) { index_remove(a, b, strat); } \
+    static block_hdr_t *find_##strat(arena_t *a, size_t need) { return index_find(a, need, strat); } \
+    static size_t largest_##strat(arena_t *a) { return index_largest(a, strat); }
+TDMM_STRATEGIES(INDEX_SPECIALIZE)
+
+#define INDEX_OPS(strat) [strat] = { insert_##strat, remove_##strat, find_##strat, largest_##strat },
+const index_ops_t g_index_ops[] = { TDMM_STRATEGIES(INDEX_OPS) };
+
+// Should the arrays fail to grow, the arena goes back to its strategy's own
+// index, built from the blocks they held
+static void soa_fallback(arena_t *a, block_hdr_t *b) {
+    alloc_strat_e strat = arena_strat(a);
+    a->soa = 0;
+    a->index = &g_index_ops[strat];
+    for (uint32_t i = 0; i < a->soa_n; i++) index_insert(a, blk_at(a, a->soa_off[i]), strat);
+    index_insert(a, b, strat);
+    tdmm_soa_release(a);
+}
+
+static void soa_insert(arena_t *a, block_hdr_t *b) {
+    if (!tdmm_soa_insert(a, b)) soa_fallback(a, b);
+}
+
+const index_ops_t g_soa_index_ops[] = {
+    [FIRST_FIT] = { soa_insert, tdmm_soa_remove, tdmm_soa_first_fit, tdmm_soa_largest },
+    [BEST_FIT] = { soa_insert, tdmm_soa_remove, tdmm_soa_best_fit, tdmm_soa_largest },
+    [WORST_FIT] = { soa_insert, tdmm_soa_remove, tdmm_soa_worst_fit, tdmm_soa_largest },
+};
+
+// Runtime builds go through the arena's table; fixed builds call their
+// specialization directly, where it can be inlined, unless the arena uses
+// the SoA index
+#ifdef TDMM_FIXED_STRATEGY
+#define INDEX_CALL(op, a, ...) \
+    (soa_capable(TDMM_FIXED_STRATEGY) && (a)->soa ? (a)->index->op(a, ##__VA_ARGS__) \
+                                                   : index_##op(a, ##__VA_ARGS__, TDMM_FIXED_STRATEGY))
+#else
+#define INDEX_CALL(op, a, ...) (a)->index->op(a, ##__VA_ARGS__)
+#endif
+
+// Free-block index hooks: every block that becomes free is inserted, and every
+// free block that is handed out or absorbed by a neighbor is removed, so the
+// free-block counters are kept here for every strategy
+void tdmm_index_insert(arena_t *a, block_hdr_t *b) {
+    INDEX_CALL(insert, a, b);
+
+    arena_metrics_t *m = &a->metrics;
+    size_t sz = blk_size(b);
+    m->free_block_count++;
+    m->free_bytes += sz;
+    unsigned bin = tdmm_hist_bin(sz);
+    if (m->free_hist[bin]++ == 0 || sz > m->bin_max[bin]) {
+        m->bin_max[bin] = sz;
+        m->bin_max_count[bin] = 1;
+    } else if (sz == m->bin_max[bin]) {
+        m->bin_max_count[bin]++;
+    }
+    m->free_bins |= 1u << bin;
+}
+
+void tdmm_index_remove(arena_t *a, block_hdr_t *b) {
+    INDEX_CALL(remove, a, b);
+
+    arena_metrics_t *m = &a->metrics;
+    size_t sz = blk_size(b);
+    m->free_block_count--;
+    m->free_bytes -= sz;
+    unsigned bin = tdmm_hist_bin(sz);
+    if (--m->free_hist[bin] == 0) {
+        m->bin_max[bin] = 0;
+        m->bin_max_count[bin] = 0;
+        m->free_bins &= ~(1u << bin);
+    } else if (sz == m->bin_max[bin] && m->bin_max_count[bin]) {
+        m->bin_max_count[bin]--;
+    }
+}
+
+void tdmm_index_reset(arena_t *a) {
+    a->tlsf = (tlsf_ctl_t){0};
+    a->tree_root = 0;
+    a->soa_n = 0;
+    arena_metrics_t *m = &a->metrics;
+    m->free_block_count = 0;
+    m->free_bytes = 0;
+    m->free_bins = 0;
+    for (size_t i = 0; i < TDMM_STATS_BINS; i++) {
+        m->free_hist[i] = 0;
+        m->bin_max[i] = 0;
+        m->bin_max_count[i] = 0;
+    }
+}
+
+// Payload size of the largest free block: the max of the highest bin in use.
+// Once that bin has lost its largest block while holding smaller ones, the
+// index is asked for the real max; a count of 1 may undercount, which only
+// means asking again sooner.
+size_t tdmm_index_largest(arena_t *a) {
+    arena_metrics_t *m = &a->metrics;
+    if (!m->free_bins) return 0;
+    unsigned bin = 31u - (unsigned)__builtin_clz(m->free_bins);
+    if (!m->bin_max_count[bin]) {
+        m->bin_max[bin] = INDEX_CALL(largest, a);
+        m->bin_max_count[bin] = 1;
+    }
+    return m->bin_max[bin];
+}
+
+block_hdr_t *tdmm_index_find(arena_t *a, size_t need) {
+    return INDEX_CALL(find, a, need);
+}
@@ -0,0 +1,471 @@
+#ifndef TDMM_INTERNAL_H
+#define TDMM_INTERNAL_H
+
+// Shared by the allocator's translation units; not part of the public API.
+
+#include "tdmm.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// Each arena reserves address space once and commits it in chunks on demand.
+// Block sizes and free-list links are 32-bit, so a reservation stays below 4 GiB.
+#define TDMM_HEAP_RESERVE_BYTES ((size_t)2u * 1024u * 1024u * 1024u)
+#define TDMM_CHUNK_BYTES (1u * 1024u * 1024u)
+#define TDMM_MAX_ARENAS 64
+// Reservations and commits are multiples of this in the huge page modes
+#define TDMM_HUGE_PAGE_BYTES ((size_t)2u * 1024u * 1024u)
+// Small requests come from slab pages of fixed-size objects. Pages are aligned
+// to their size, so an object's page is found by masking its address.
+#define SLAB_PAGE_BYTES (64u * 1024u)
+#define SLAB_REGION_BYTES ((size_t)1u * 1024u * 1024u * 1024u)
+#define SLAB_CLASS_BYTES 16u
+#define SLAB_CLASSES 32                   // class c holds objects of 16(c + 1) bytes
+#define SLAB_MAX_OBJECTS (SLAB_PAGE_BYTES / SLAB_CLASS_BYTES)
+// Fast bins hold released blocks unmerged, binned by payload size like the
+// thread caches, until a search fails or a bin grows past FASTBIN_BIN_MAX
+#define FASTBIN_CLASS_BYTES 16u
+#define FASTBIN_CLASSES 65                // class k holds payloads in [16k, 16k + 15]
+#define FASTBIN_BIN_MAX 32
+#define max(a, b) ((a) > (b) ? (a) : (b))
+// Marks a heap file as formatted; "tdmmheap" in the file's byte order
+#define TDMM_FILE_MAGIC 0x706165686d6d6474ull
+
+// Low bits of block_hdr_t::size; payload sizes are multiples of 4
+#define BLOCK_FREE      1u
+#define BLOCK_PREV_FREE 2u
+#define BLOCK_FLAGS     (BLOCK_FREE | BLOCK_PREV_FREE)
+
+typedef struct block_hdr {
+    uint32_t prev_size;  // boundary tag: previous block's payload size, only written while it is free
+    uint32_t size;       // payload bytes | BLOCK_FREE | BLOCK_PREV_FREE
+} block_hdr_t;
+
+// Links stored inside free payloads are 32-bit offsets from the owning arena.
+// The arena control block sits at offset 0, so offset 0 means "none".
+
+// Free blocks reuse their payload for segregated free-list links
+typedef struct free_links {
+    uint32_t prev_free;
+    uint32_t next_free;
+} free_links_t;
+
+// Fast-binned blocks stay marked used and link through their payloads; the
+// key catches most double frees
+typedef struct fast_links {
+    uint32_t next;
+    uint32_t key;
+} fast_links_t;
+
+// BEST_FIT/WORST_FIT keep free blocks in a red-black tree ordered by
+// (size, address), with the node stored in the free payload. The node
+// color lives in the low bit of the parent offset.
+typedef struct tree_links {
+    uint32_t left;
+    uint32_t right;
+    uint32_t parent_red;
+} tree_links_t;
+
+// ADDRESS_ORDERED_FIRST_FIT orders the same tree by address and augments each
+// node with the largest free size in its subtree, so the lowest-addressed fit
+// is found without visiting allocated blocks
+typedef struct addr_tree_links {
+    tree_links_t links;
+    uint32_t subtree_max;
+} addr_tree_links_t;
+
+// TLSF: first level splits sizes by power of two, second level splits each
+// power-of-two range into TLSF_SL_COUNT linear classes
+#define TLSF_SL_LOG2 4
+#define TLSF_SL_COUNT (1u << TLSF_SL_LOG2)
+#define TLSF_FL_COUNT 32
+
+typedef struct {
+    uint32_t fl_bitmap;
+    uint32_t sl_bitmap[TLSF_FL_COUNT];
+    uint32_t heads[TLSF_FL_COUNT][TLSF_SL_COUNT];
+} tlsf_ctl_t;
+
+// One committed mapping inside an arena's reservation
+typedef struct {
+    uintptr_t base;
+    size_t len;
+} chunk_t;
+
+// Kept up to date as blocks change, so reading them never walks the heap
+typedef struct {
+    // Memory usage
+    size_t cur_inuse_bytes;
+    size_t peak_inuse_bytes;
+    // Utilization. Samples taken while the committed size stays the same share
+    // a divisor, so they are summed as integers and divided once per epoch.
+    double util_sum;
+    uint64_t util_epoch_sum;
+    size_t util_epoch_os;
+    size_t num_util;
+    // Heap shape
+    size_t block_count;
+    size_t free_block_count;
+    size_t free_bytes;
+    size_t free_hist[TDMM_STATS_BINS];
+    uint32_t free_bins;                  // bit i set while free_hist[i] is nonzero
+    // Largest payload in each bin and how many free blocks have exactly that
+    // size. Once that count drops to 0 with the bin still in use, the max is
+    // stale and tdmm_index_largest looks it up again if the bin is the top one.
+    // Lower bins only need to be right once they become the top one.
+    size_t bin_max[TDMM_STATS_BINS];
+    size_t bin_max_count[TDMM_STATS_BINS];
+} arena_metrics_t;
+
+struct arena;
+
+// Header at the start of each slab page. The owning arena's lock guards it;
+// frees from other threads go through the arena's remote slab stack.
+typedef struct slab {
+    struct arena *arena;
+    struct slab *next;        // arena partial list, or the free page pool
+    struct slab *prev;
+    uint32_t obj_size;
+    uint32_t first;           // offset of the first object
+    uint32_t free_head;       // offset of the last freed object, 0 = none
+    uint32_t bump;            // offset of the first never-used object
+    uint32_t used;
+    uint32_t listed;          // on the arena's partial list
+    // One bit per object slot, set while the object is allocated or cached.
+    // Cleared atomically on free, so a second free of the same object is
+    // caught even when it races a remote free.
+    uint64_t live[SLAB_MAX_OBJECTS / 64];
+} slab_t;
+
+typedef enum {
+    METRIC_INIT = 0,
+    METRIC_MALLOC,
+    METRIC_FREE,
+} metric_event_t;
+
+// Every strategy, for code generated once per strategy
+#define TDMM_STRATEGIES(X) \
+    X(FIRST_FIT) X(BEST_FIT) X(WORST_FIT) X(TLSF) X(NEXT_FIT) X(ADDRESS_ORDERED_FIRST_FIT)
+
+// The free-block index operations of one strategy, specialized for it in
+// tdmm_index.c. Arenas pick theirs when created.
+typedef struct {
+    void (*insert)(struct arena *a, block_hdr_t *b);
+    void (*remove)(struct arena *a, block_hdr_t *b);
+    block_hdr_t *(*find)(struct arena *a, size_t need);
+    size_t (*largest)(struct arena *a);
+} index_ops_t;
+
+// An independent heap: its own reservation, block list, free index and lock.
+// The control block lives at the start of the reservation and the first block
+// header follows it.
+typedef struct arena {
+    pthread_mutex_t lock;       // guards everything below except remote_*
+    alloc_strat_e strat;
+    const index_ops_t *index;   // g_index_ops[strat], or g_soa_index_ops[strat] if soa
+    tdmm_pages_e pages;         // page mode the arena was created with
+    size_t hugetlb_bytes;       // committed bytes that came from the hugetlb pool
+    size_t committed;           // bytes committed from the arena base; grows only
+    size_t reserved;
+    chunk_t *chunks;            // sorted by base
+    size_t nchunks;
+    size_t chunks_cap;
+    block_hdr_t *head;          // first block
+    tlsf_ctl_t tlsf;
+    uint32_t tree_root;         // root of the free-block tree
+    // The SoA index (TDMM_PARAM_SOA_INDEX): offsets and sizes of the free
+    // blocks, unordered, in one mapping
+    int soa;
+    uint32_t *soa_off;
+    uint32_t *soa_size;         // soa_off + soa_cap
+    uint32_t soa_n;
+    uint32_t soa_cap;
+    uint32_t rover;             // NEXT_FIT: block the next search starts from, 0 = head
+    size_t clean_off;           // payload bytes from here to the end header were never written
+    uint32_t fast_heads[FASTBIN_CLASSES];  // released blocks not yet merged, newest first
+    uint8_t fast_counts[FASTBIN_CLASSES];
+    size_t fast_blocks;
+    size_t fast_bytes;
+    slab_t *slab_partial[SLAB_CLASSES];  // pages with free objects, per class
+    size_t slab_pages;
+    arena_metrics_t metrics;
+    // Blocks freed by threads that do not own the arena, pushed without the
+    // lock as a stack of offsets linked through their payloads; slab objects
+    // live outside the arena and use a pointer-linked stack
+    uint32_t remote_head;
+    void *remote_slab_head;
+    size_t remote_bytes;
+    uint32_t root;              // t_heap_set_root, as an offset; 0 = none
+    struct arena *next_heap;    // t_heap_create heaps, listed for the fork handlers
+    // Heaps mapped from a file (t_heap_open). The control block is the file's
+    // header, so these let a later process check it and map it again.
+    uint64_t file_magic;        // TDMM_FILE_MAGIC, or 0 for anonymous memory
+    uint64_t file_layout;       // layout of the build that wrote the file
+    uintptr_t file_base;        // where it was last mapped
+    int file_fd;
+} arena_t;
+
+typedef struct {
+    size_t count;
+    size_t mapped_bytes;
+    size_t inuse_bytes;
+    size_t peak_inuse_bytes;
+} large_stats_t;
+
+static inline size_t ALIGN4(size_t x) {
+    return (x + 3) / 4 * 4;
+}
+
+static inline size_t page_round_up(size_t n) {
+    long ps = sysconf(_SC_PAGESIZE);
+    if (ps <= 0) ps = 4096;
+    size_t p = (size_t)ps;
+    return (n + p - 1) / p * p;
+}
+
+static inline size_t hdr_size(void) {
+    return ALIGN4(sizeof(block_hdr_t));
+}
+
+static inline void *payload_from_hdr(block_hdr_t *h) {
+    return (void *)((uint8_t *)h + hdr_size());
+}
+
+static inline block_hdr_t *hdr_from_payload(void *p) {
+    return (block_hdr_t *)((uint8_t *)p - hdr_size());
+}
+
+static inline size_t blk_size(const block_hdr_t *b) {
+    return b->size & ~BLOCK_FLAGS;
+}
+
+static inline int blk_free(const block_hdr_t *b) {
+    return (b->size & BLOCK_FREE) != 0;
+}
+
+static inline void set_blk_size(block_hdr_t *b, size_t size) {
+    b->size = (uint32_t)size | (b->size & BLOCK_FLAGS);
+}
+
+// Thread caches and remote frees read the size word of blocks they own without
+// the arena lock. Those size bits never change, but a neighbor may flip
+// BLOCK_PREV_FREE under the lock, so flag updates on a neighbor's header are
+// single relaxed stores.
+static inline size_t blk_size_unlocked(const block_hdr_t *b) {
+    return __atomic_load_n(&b->size, __ATOMIC_RELAXED) & ~BLOCK_FLAGS;
+}
+
+static inline void store_size_word(block_hdr_t *b, uint32_t word) {
+    __atomic_store_n(&b->size, word, __ATOMIC_RELAXED);
+}
+
+static inline block_hdr_t *next_block(block_hdr_t *b) {
+    return (block_hdr_t *)((uint8_t *)b + hdr_size() + blk_size(b));
+}
+
+// Only valid while BLOCK_PREV_FREE is set, since that is when the tag is written
+static inline block_hdr_t *prev_block(block_hdr_t *b) {
+    return (block_hdr_t *)((uint8_t *)b - hdr_size() - b->prev_size);
+}
+
+// Marks a block free and writes its boundary tag into the following header
+static inline void mark_free(block_hdr_t *b) {
+    block_hdr_t *n = next_block(b);
+    b->size |= BLOCK_FREE;
+    store_size_word(n, n->size | BLOCK_PREV_FREE);
+    n->prev_size = (uint32_t)blk_size(b);
+}
+
+static inline void mark_used(block_hdr_t *b) {
+    block_hdr_t *n = next_block(b);
+    store_size_word(b, b->size & ~BLOCK_FREE);
+    store_size_word(n, n->size & ~BLOCK_PREV_FREE);
+}
+
+static inline block_hdr_t *blk_at(const arena_t *a, uint32_t off) {
+    return off ? (block_hdr_t *)((uint8_t *)a + off) : NULL;
+}
+
+static inline uint32_t blk_off(const arena_t *a, const block_hdr_t *b) {
+    return b ? (uint32_t)((const uint8_t *)b - (const uint8_t *)a) : 0;
+}
+
+// Offset of the first block header; keeps the first payload 16-byte aligned
+static inline size_t arena_first_block_off(void) {
+    return (sizeof(arena_t) + hdr_size() + 15) / 16 * 16 - hdr_size();
+}
+
+static inline size_t arena_os_bytes(const arena_t *a) {
+    return a->committed + a->slab_pages * SLAB_PAGE_BYTES;
+}
+
+// Lock-free check that p lies in the arena's committed block area
+static inline int arena_contains(const arena_t *a, const void *p) {
+    uintptr_t base = (uintptr_t)a;
+    uintptr_t x = (uintptr_t)p;
+    size_t committed = __atomic_load_n(&a->committed, __ATOMIC_ACQUIRE);
+    return x >= base + arena_first_block_off() + hdr_size() && x < base + committed;
+}
+
+// The strategy an arena runs. Builds fixed to one strategy make it a
+// constant, so every test of it folds away.
+#ifdef TDMM_FIXED_STRATEGY
+#define arena_strat(a) ((void)(a), TDMM_FIXED_STRATEGY)
+#else
+#define arena_strat(a) ((a)->strat)
+#endif
+
+// Strategies that can keep their free blocks in the SoA index instead
+static inline int soa_capable(alloc_strat_e strat) {
+    return strat == FIRST_FIT || strat == BEST_FIT || strat == WORST_FIT;
+}
+
+// tdmm_index.c: free-block indexes
+extern const index_ops_t g_index_ops[];
+extern const index_ops_t g_soa_index_ops[];
+void tdmm_index_insert(arena_t *a, block_hdr_t *b);
+void tdmm_index_remove(arena_t *a, block_hdr_t *b);
+void tdmm_index_reset(arena_t *a);
+block_hdr_t *tdmm_index_find(arena_t *a, size_t need);
+size_t tdmm_index_largest(arena_t *a);
+unsigned tdmm_hist_bin(size_t size);
+
+// tdmm_soa.c: the SoA index, under the arena lock. Insert returns 0 if the
+// arrays could not grow, leaving them unchanged.
+int tdmm_soa_insert(arena_t *a, block_hdr_t *b);
+void tdmm_soa_remove(arena_t *a, block_hdr_t *b);
+block_hdr_t *tdmm_soa_first_fit(arena_t *a, size_t need);
+block_hdr_t *tdmm_soa_best_fit(arena_t *a, size_t need);
+block_hdr_t *tdmm_soa_worst_fit(arena_t *a, size_t need);
+size_t tdmm_soa_largest(arena_t *a);
+void tdmm_soa_release(arena_t *a);
+
+// Rounds a payload size so the payload after it starts TDMM_MIN_ALIGNMENT
+// aligned. With 16-byte alignment and 8-byte headers every payload size is
+// 8 mod 16; splits, merges and chunk sizes all preserve that.
+static inline size_t align_payload(size_t size) {
+#if TDMM_MIN_ALIGNMENT > 4
+    return (size + hdr_size() + TDMM_MIN_ALIGNMENT - 1) / TDMM_MIN_ALIGNMENT * TDMM_MIN_ALIGNMENT - hdr_size();
+#else
+    return ALIGN4(size);
+#endif
+}
+
+// Smallest payload a block may have; free blocks must be able to hold their index links
+static inline size_t tdmm_min_payload(alloc_strat_e strat) {
+    if (strat == TLSF) return align_payload(sizeof(free_links_t));
+    if (strat == ADDRESS_ORDERED_FIRST_FIT) return align_payload(sizeof(addr_tree_links_t));
+    if (strat == BEST_FIT || strat == WORST_FIT) return align_payload(sizeof(tree_links_t));
+    return align_payload(4);
+}
+
+static inline size_t request_payload(alloc_strat_e strat, size_t size) {
+    return max(align_payload(size), tdmm_min_payload(strat));
+}
+
+// tdmm_arena.c: arena lifecycle and block management. Unless noted, the
+// caller holds a->lock.
+extern size_t g_fastbin_max_bytes;   // TDMM_PARAM_FASTBIN_MAX_BYTES
+extern tdmm_pages_e g_page_mode;     // TDMM_PARAM_PAGES as of the last t_init
+extern int g_soa_index;              // TDMM_PARAM_SOA_INDEX as of the last t_init
+// Maps [at, at + len) of a reservation read-write in the given mode. Returns
+// 1 if the range came from the hugetlb pool, 0 for ordinary pages, -1 on failure.
+int tdmm_commit_pages(void *at, size_t len, tdmm_pages_e mode);
+arena_t *tdmm_arena_create(alloc_strat_e strat);
+// Maps the heap stored in fd, or formats an empty file as a heap of at most
+// size bytes. NULL if the file holds something else or mapping fails; the
+// arena owns fd on success.
+arena_t *tdmm_arena_open(int fd, size_t size, alloc_strat_e strat);
+// Flushes a file-backed arena to its file; -1 if it has none or msync fails
+int tdmm_arena_sync(arena_t *a);
+void tdmm_arena_destroy(arena_t *a);
+void tdmm_arena_reset(arena_t *a);
+void tdmm_arena_lock(arena_t *a);
+void tdmm_arena_unlock(arena_t *a);
+// The *_fork_lock / *_fork_unlock pairs hold a lock across fork. In the child
+// the forking thread is the only one left, so the lock is re-initialized
+// rather than unlocked.
+void tdmm_arena_fork_unlock(arena_t *a, int child);
+block_hdr_t *tdmm_arena_alloc_block(arena_t *a, size_t need);
+block_hdr_t *tdmm_arena_alloc_aligned(arena_t *a, size_t align, size_t need);
+size_t tdmm_arena_alloc_batch(arena_t *a, size_t need, size_t count, void **out);
+void tdmm_arena_release_block(arena_t *a, block_hdr_t *b);
+int tdmm_arena_resize(arena_t *a, block_hdr_t *b, size_t need);
+void *tdmm_arena_malloc(arena_t *a, size_t size);
+void *tdmm_arena_aligned_malloc(arena_t *a, size_t align, size_t size);
+void *tdmm_arena_calloc(arena_t *a, size_t size);
+void tdmm_arena_free(arena_t *a, void *ptr);
+void tdmm_arena_free_batch(arena_t *a, void **ptrs, size_t n);
+void tdmm_arena_update_metrics(arena_t *a, metric_event_t ev, size_t req_bytes, size_t actual_bytes);
+void tdmm_arena_stats(arena_t *a, tdmm_stats_t *out);
+// Lock-free; may be called by any thread
+void tdmm_arena_remote_free(arena_t *a, block_hdr_t *b);
+
+// tdmm_slab.c: small fixed-size objects. Unless noted, the caller holds the
+// lock of the arena that owns (or will own) the page.
+extern uintptr_t g_slab_lo;
+extern uintptr_t g_slab_hi;
+
+// Lock-free: whether p lies in the slab region
+static inline int slab_contains(const void *p) {
+    uintptr_t x = (uintptr_t)p;
+    return x >= __atomic_load_n(&g_slab_lo, __ATOMIC_ACQUIRE) &&
+           x < __atomic_load_n(&g_slab_hi, __ATOMIC_ACQUIRE);
+}
+
+static inline slab_t *slab_of(const void *p) {
+    return (slab_t *)((uintptr_t)p & ~(uintptr_t)(SLAB_PAGE_BYTES - 1));
+}
+
+// Object size if p is a live object start in a slab page, else 0. Lock-free:
+// a page's class only changes while it has no live objects.
+size_t tdmm_slab_obj_size(const void *p);
+void *tdmm_slab_alloc(arena_t *a, size_t cls);
+// Lock-free: clears p's live bit; 0 if p was already free
+int tdmm_slab_release(void *p);
+// Both take an object already released by tdmm_slab_release
+void tdmm_slab_free(arena_t *a, void *p);
+void tdmm_slab_remote_free(arena_t *a, void *p);
+void tdmm_slab_drain_remote(arena_t *a);
+size_t tdmm_slab_pool_bytes(void);
+// Committed part of the slab region and how much of it is hugetlb-backed
+void tdmm_slab_backing(uintptr_t *lo, uintptr_t *hi, size_t *hugetlb_bytes);
+size_t tdmm_slab_hdr_size(void);
+void tdmm_slab_reset(void);
+void tdmm_slab_fork_lock(void);
+void tdmm_slab_fork_unlock(int child);
+
+// tdmm_large.c: requests served by dedicated mappings, under their own lock
+size_t tdmm_large_hdr_size(void);
+void *tdmm_large_alloc(size_t size, size_t align);
+size_t tdmm_large_free(void *ptr);
+void *tdmm_large_realloc(void *ptr, size_t size);
+size_t tdmm_large_usable_size(void *ptr);
+void tdmm_large_release_all(void);
+large_stats_t tdmm_large_stats(void);
+void tdmm_large_fork_lock(void);
+void tdmm_large_fork_unlock(int child);
+
+// tdmm_prof.c: sampling heap profiler, under its own lock
+extern size_t g_prof_sample_bytes;   // TDMM_PARAM_PROF_SAMPLE_BYTES
+extern size_t g_prof_live;           // live samples
+void tdmm_prof_set_sample_bytes(size_t bytes);
+// Draws the next countdown once *left has gone negative; returns the bytes
+// the triggering allocation stands for, or 0 if sampling is off
+size_t tdmm_prof_rearm(ptrdiff_t *left, uint64_t *rng);
+void tdmm_prof_record(void *p, size_t size, size_t weight);
+void tdmm_prof_free(void *p);
+void tdmm_prof_move(void *old, void *p);
+void tdmm_prof_reset(void);
+int tdmm_prof_dump(int fd);
+void tdmm_prof_fork_lock(void);
+void tdmm_prof_fork_unlock(int child);
+
+// Drops p's sample, if it has one; a single load while nothing is sampled
+static inline void prof_forget(void *p) {
+    if (__atomic_load_n(&g_prof_live, __ATOMIC_RELAXED)) tdmm_prof_free(p);
+}
+
+#endif // TDMM_INTERNAL_H
@@ -0,0 +1,265 @@
+#define _GNU_SOURCE  // mremap
+#include "tdmm_internal.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <pthread.h>
+
+// Prefix of a large allocation served by its own mapping; the payload follows
+// it. The header always lies in the first page of the mapping, so the mapping
+// starts at the header's page.
+typedef struct {
+    size_t map_len;
+    size_t size;
+} large_hdr_t;
+
+#define LARGE_TOMBSTONE ((uintptr_t)1)
+
+// Open-addressed set of large payload addresses, so t_free can validate a
+// pointer before touching its header. Large requests are rare next to heap traffic, so
+// one lock shared by every arena is enough.
+static uintptr_t *g_large_tab = NULL;
+static size_t g_large_cap = 0;
+static size_t g_large_used = 0;   // live entries plus tombstones
+static size_t g_large_count = 0;
+static size_t g_large_bytes = 0;
+static size_t g_large_inuse = 0;
+static size_t g_large_peak = 0;
+static pthread_mutex_t g_large_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Every payload lives in its own mapping, hence its own page
+static size_t large_slot(uintptr_t p, size_t cap) {
+    return (size_t)(((uint64_t)(p >> 12) * 0x9E3779B97F4A7C15ull) >> 32) & (cap - 1);
+}
+
+static large_hdr_t *large_hdr(uintptr_t p) {
+    return (large_hdr_t *)(p - tdmm_large_hdr_size());
+}
+
+static uintptr_t large_map_base(uintptr_t p) {
+    return (p - tdmm_large_hdr_size()) & ~(uintptr_t)(page_round_up(1) - 1);
+}
+
+static int large_tab_insert(uintptr_t p);
+
+static int large_tab_rehash(size_t cap) {
+    void *mem = mmap(NULL, cap * sizeof(uintptr_t), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return 0;
+
+    uintptr_t *old = g_large_tab;
+    size_t old_cap = g_large_cap;
+    g_large_tab = (uintptr_t *)mem;
+    g_large_cap = cap;
+    g_large_used = 0;
+    g_large_count = 0;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i] > LARGE_TOMBSTONE) large_tab_insert(old[i]);
+    }
+    if (old) munmap(old, old_cap * sizeof(uintptr_t));
+    return 1;
+}
+
+// Makes room for one more entry, so the next insert cannot fail
+static int large_tab_reserve(void) {
+    // Keep the load (tombstones included) under one half
+    if ((g_large_used + 1) * 2 > g_large_cap) {
+        size_t cap = g_large_cap ? g_large_cap : page_round_up(1) / sizeof(uintptr_t);
+        if (g_large_count * 4 >= cap) cap *= 2;
+        if (!large_tab_rehash(cap)) return 0;
+    }
+    return 1;
+}
+
+static int large_tab_insert(uintptr_t p) {
+    if (!large_tab_reserve()) return 0;
+    size_t i = large_slot(p, g_large_cap);
+    while (g_large_tab[i] > LARGE_TOMBSTONE) i = (i + 1) & (g_large_cap - 1);
+    if (g_large_tab[i] == 0) g_large_used++;
+    g_large_tab[i] = p;
+    g_large_count++;
+    return 1;
+}
+
+// Returns the slot holding p, or g_large_cap if it is not a large payload
+static size_t large_tab_find(uintptr_t p) {
+    if (!g_large_cap) return 0;
+    size_t i = large_slot(p, g_large_cap);
+    while (g_large_tab[i] != 0) {
+        if (g_large_tab[i] == p) return i;
+        i = (i + 1) & (g_large_cap - 1);
+    }
+    return g_large_cap;
+}
+
+size_t tdmm_large_hdr_size(void) {
+    // Keeps the payload 16-byte aligned within the page-aligned mapping
+    return (sizeof(large_hdr_t) + 15) / 16 * 16;
+}
+
+// Payloads are 16-byte aligned at least. A larger align over-maps by align
+// and unmaps the whole pages on either side of the aligned payload.
+void *tdmm_large_alloc(size_t size, size_t align) {
+    size_t hsz = tdmm_large_hdr_size();
+    size_t ps = page_round_up(1);
+    if (align < 16) align = 16;
+    size_t extra = align > 16 ? align : 0;
+    if (size > SIZE_MAX - hsz - ps || extra > SIZE_MAX - hsz - ps - size) return NULL;
+    size_t len = page_round_up(hsz + size + extra);
+    void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return NULL;
+
+    uintptr_t p = ((uintptr_t)mem + hsz + align - 1) & ~(uintptr_t)(align - 1);
+    uintptr_t base = large_map_base(p);
+    uintptr_t end = page_round_up(p + size);
+    if (base > (uintptr_t)mem) munmap(mem, base - (uintptr_t)mem);
+    if (end < (uintptr_t)mem + len) munmap((void *)end, (uintptr_t)mem + len - end);
+    len = end - base;
+
+    large_hdr_t *h = large_hdr(p);
+    h->map_len = len;
+    h->size = ALIGN4(size);
+
+    pthread_mutex_lock(&g_large_lock);
+    if (!large_tab_insert(p)) {
+        pthread_mutex_unlock(&g_large_lock);
+        munmap((void *)base, len);
+        return NULL;
+    }
+    g_large_bytes += len;
+    g_large_inuse += h->size;
+    g_large_peak = max(g_large_peak, g_large_inuse);
+    pthread_mutex_unlock(&g_large_lock);
+    return (void *)p;
+}
+
+// Unmaps ptr if it is a large allocation and returns its payload size, else 0
+size_t tdmm_large_free(void *ptr) {
+    uintptr_t p = (uintptr_t)ptr;
+    if (p % 16 != 0) return 0;
+
+    pthread_mutex_lock(&g_large_lock);
+    size_t slot = large_tab_find(p);
+    if (slot == g_large_cap) {
+        pthread_mutex_unlock(&g_large_lock);
+        return 0;
+    }
+    large_hdr_t *h = large_hdr(p);
+    size_t size = h->size;
+    size_t len = h->map_len;
+    g_large_tab[slot] = LARGE_TOMBSTONE;
+    g_large_count--;
+    g_large_bytes -= len;
+    g_large_inuse -= size;
+    pthread_mutex_unlock(&g_large_lock);
+
+    munmap((void *)large_map_base(p), len);
+    return size;
+}
+
+// Maps a new allocation and copies the payload over, for when the old
+// mapping cannot be resized in place or moved
+static void *large_realloc_copy(void *ptr, size_t old, size_t size) {
+    void *q = tdmm_large_alloc(size, 16);
+    if (!q) return NULL;
+    memcpy(q, ptr, old < size ? old : size);
+    tdmm_large_free(ptr);
+    return q;
+}
+
+// Resizes a large allocation with mremap, which moves page mappings rather
+// than copying, or else by copying into a new mapping. Returns the new
+// payload, or NULL if ptr is not a large allocation or no memory is left
+// (ptr stays valid).
+void *tdmm_large_realloc(void *ptr, size_t size) {
+    uintptr_t p = (uintptr_t)ptr;
+    if (p % 16 != 0) return NULL;
+    uintptr_t base = large_map_base(p);
+    // mremap moves whole pages, so the payload keeps its offset in the mapping
+    size_t off = p - base;
+    if (size > SIZE_MAX - off - page_round_up(1)) return NULL;
+    size_t len = page_round_up(off + size);
+
+    pthread_mutex_lock(&g_large_lock);
+    size_t slot = large_tab_find(p);
+    if (slot == g_large_cap) {
+        pthread_mutex_unlock(&g_large_lock);
+        return NULL;
+    }
+    size_t old = large_hdr(p)->size;
+    if (!large_tab_reserve()) {
+        pthread_mutex_unlock(&g_large_lock);
+        return large_realloc_copy(ptr, old, size);
+    }
+    // The reserve may have rehashed
+    slot = large_tab_find(p);
+    size_t old_len = large_hdr(p)->map_len;
+    if (len != old_len) {
+        void *mem = mremap((void *)base, old_len, len, MREMAP_MAYMOVE);
+        if (mem == MAP_FAILED) {
+            pthread_mutex_unlock(&g_large_lock);
+            return large_realloc_copy(ptr, old, size);
+        }
+        g_large_bytes = g_large_bytes - old_len + len;
+        if ((uintptr_t)mem != base) {
+            g_large_tab[slot] = LARGE_TOMBSTONE;
+            g_large_count--;
+            p = (uintptr_t)mem + off;
+            large_tab_insert(p);
+        }
+        large_hdr(p)->map_len = len;
+    }
+    large_hdr_t *h = large_hdr(p);
+    g_large_inuse = g_large_inuse - h->size + ALIGN4(size);
+    g_large_peak = max(g_large_peak, g_large_inuse);
+    h->size = ALIGN4(size);
+    pthread_mutex_unlock(&g_large_lock);
+    return (void *)p;
+}
+
+// Bytes from ptr to the end of its mapping, or 0 if ptr is not a large allocation
+size_t tdmm_large_usable_size(void *ptr) {
+    uintptr_t p = (uintptr_t)ptr;
+    if (p % 16 != 0) return 0;
+    pthread_mutex_lock(&g_large_lock);
+    size_t usable = 0;
+    if (large_tab_find(p) != g_large_cap) usable = large_map_base(p) + large_hdr(p)->map_len - p;
+    pthread_mutex_unlock(&g_large_lock);
+    return usable;
+}
+
+void tdmm_large_release_all(void) {
+    pthread_mutex_lock(&g_large_lock);
+    for (size_t i = 0; i < g_large_cap; i++) {
+        if (g_large_tab[i] > LARGE_TOMBSTONE) {
+            uintptr_t p = g_large_tab[i];
+            munmap((void *)large_map_base(p), large_hdr(p)->map_len);
+        }
+        g_large_tab[i] = 0;
+    }
+    g_large_used = 0;
+    g_large_count = 0;
+    g_large_bytes = 0;
+    g_large_inuse = 0;
+    g_large_peak = 0;
+    pthread_mutex_unlock(&g_large_lock);
+}
+
+large_stats_t tdmm_large_stats(void) {
+    pthread_mutex_lock(&g_large_lock);
+    large_stats_t s = { g_large_count, g_large_bytes, g_large_inuse, g_large_peak };
+    pthread_mutex_unlock(&g_large_lock);
+    return s;
+}
+
+void tdmm_large_fork_lock(void) {
+    pthread_mutex_lock(&g_large_lock);
+}
+
+void tdmm_large_fork_unlock(int child) {
+    if (child) pthread_mutex_init(&g_large_lock, NULL);
+    else pthread_mutex_unlock(&g_large_lock);
+}
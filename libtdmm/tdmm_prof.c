@@ -0,0 +1,364 @@
+#include "tdmm_internal.h"
+
+#include <execinfo.h>
+#include <math.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// Sampling heap profiler. Each thread counts down the bytes it allocates; when
+// the count runs out the allocation is sampled with its backtrace and a fresh
+// exponentially distributed count is drawn, so samples fall on allocated bytes
+// as a Poisson process. Everything here stays off the heap: tables are mapped
+// directly, and a sample taken while recording one is dropped.
+#define PROF_DEPTH 16                   // frames kept per call site
+#define PROF_RECHECK_BYTES (1u << 20)   // countdown while sampling is off
+#define PROF_FILTER_SLOTS (1u << 16)
+#define PROF_TOMBSTONE ((uintptr_t)1)
+
+size_t g_prof_sample_bytes = 0;
+size_t g_prof_live = 0;
+
+typedef struct {
+    uint64_t hash;
+    uint32_t depth;
+    void *pcs[PROF_DEPTH];
+    size_t live_samples;
+    size_t live_bytes;      // requested sizes of the live samples
+    size_t live_weight;     // bytes the live samples stand for
+    size_t total_samples;   // since t_init
+} prof_site_t;
+
+typedef struct {
+    uintptr_t ptr;
+    size_t size;
+    size_t weight;
+    uint32_t site;
+} prof_obj_t;
+
+// Live samples, open-addressed by payload address
+static prof_obj_t *g_objs = NULL;
+static size_t g_objs_cap = 0;
+static size_t g_objs_used = 0;    // live entries plus tombstones
+// Call sites in first-seen order, and an open-addressed index of them by
+// stack hash holding site + 1
+static prof_site_t *g_sites = NULL;
+static size_t g_sites_cap = 0;
+static size_t g_nsites = 0;
+static uint32_t *g_site_idx = NULL;
+static size_t g_site_idx_cap = 0;
+// Live samples per hash of their address, read without the lock so t_free
+// only locks for pointers that may have been sampled
+static uint32_t g_filter[PROF_FILTER_SLOTS];
+static pthread_mutex_t g_prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int t_prof_busy __attribute__((tls_model("initial-exec")));
+
+static size_t obj_slot(uintptr_t p, size_t cap) {
+    return (size_t)(((uint64_t)(p >> 4) * 0x9E3779B97F4A7C15ull) >> 32) & (cap - 1);
+}
+
+static size_t filter_slot(const void *p) {
+    return (size_t)(((uint64_t)((uintptr_t)p >> 4) * 0x9E3779B97F4A7C15ull) >> 48);
+}
+
+static void *prof_map(size_t bytes) {
+    void *mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return mem == MAP_FAILED ? NULL : mem;
+}
+
+// ---- Sampling interval ----
+
+// xorshift64*, seeded per thread
+static uint64_t prof_rand(uint64_t *s) {
+    uint64_t x = *s;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *s = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+// Exponentially distributed, with the given mean
+static ptrdiff_t prof_interval(uint64_t *rng, size_t mean) {
+    double u = (double)((prof_rand(rng) >> 11) + 1) / 9007199254740992.0;   // (0, 1]
+    double v = -log(u) * (double)mean;
+    if (v < 1.0) return 1;
+    if (v > (double)(PTRDIFF_MAX / 2)) return PTRDIFF_MAX / 2;
+    return (ptrdiff_t)v;
+}
+
+// Called once a thread's countdown has run out. Each interval stands for mean
+// bytes, so the allocation is weighted by the intervals it crossed; that
+// keeps the estimate unbiased for sizes both below and above the mean.
+size_t tdmm_prof_rearm(ptrdiff_t *left, uint64_t *rng) {
+    size_t mean = __atomic_load_n(&g_prof_sample_bytes, __ATOMIC_RELAXED);
+    if (!mean) {
+        *left = PROF_RECHECK_BYTES;
+        *rng = 0;
+        return 0;
+    }
+    // A thread's first countdown starts at the allocation that noticed sampling is on
+    if (!*rng) {
+        *rng = ((uint64_t)(uintptr_t)rng * 0x9E3779B97F4A7C15ull) | 1;
+        *left += prof_interval(rng, mean);
+    }
+    size_t n = 0;
+    while (*left < 0) {
+        *left += prof_interval(rng, mean);
+        n++;
+    }
+    return n * mean;
+}
+
+void tdmm_prof_set_sample_bytes(size_t bytes) {
+    // The first backtrace loads the unwinder, which allocates; do it here
+    // rather than inside an allocation
+    if (bytes) {
+        void *pc;
+        backtrace(&pc, 1);
+    }
+    __atomic_store_n(&g_prof_sample_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+// ---- Tables; the caller holds g_prof_lock ----
+
+static int obj_insert(const prof_obj_t *o);
+
+static int obj_rehash(size_t cap) {
+    prof_obj_t *mem = (prof_obj_t *)prof_map(cap * sizeof(prof_obj_t));
+    if (!mem) return 0;
+    prof_obj_t *old = g_objs;
+    size_t old_cap = g_objs_cap;
+    g_objs = mem;
+    g_objs_cap = cap;
+    g_objs_used = 0;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].ptr > PROF_TOMBSTONE) obj_insert(&old[i]);
+    }
+    if (old) munmap(old, old_cap * sizeof(prof_obj_t));
+    return 1;
+}
+
+static int obj_insert(const prof_obj_t *o) {
+    if ((g_objs_used + 1) * 2 > g_objs_cap) {
+        size_t cap = g_objs_cap ? g_objs_cap : page_round_up(1) / sizeof(prof_obj_t);
+        if (g_prof_live * 4 >= cap) cap *= 2;
+        if (!obj_rehash(cap)) return 0;
+    }
+    size_t i = obj_slot(o->ptr, g_objs_cap);
+    while (g_objs[i].ptr > PROF_TOMBSTONE) i = (i + 1) & (g_objs_cap - 1);
+    if (g_objs[i].ptr == 0) g_objs_used++;
+    g_objs[i] = *o;
+    return 1;
+}
+
+static prof_obj_t *obj_find(uintptr_t p) {
+    if (!g_objs_cap) return NULL;
+    size_t i = obj_slot(p, g_objs_cap);
+    while (g_objs[i].ptr != 0) {
+        if (g_objs[i].ptr == p) return &g_objs[i];
+        i = (i + 1) & (g_objs_cap - 1);
+    }
+    return NULL;
+}
+
+static uint64_t stack_hash(void *const *pcs, int depth) {
+    uint64_t h = (uint64_t)depth;
+    for (int i = 0; i < depth; i++) h = (h ^ (uint64_t)(uintptr_t)pcs[i]) * 0x100000001B3ull;
+    return h ^ (h >> 29);
+}
+
+static int site_idx_rehash(size_t cap) {
+    uint32_t *mem = (uint32_t *)prof_map(cap * sizeof(uint32_t));
+    if (!mem) return 0;
+    if (g_site_idx) munmap(g_site_idx, g_site_idx_cap * sizeof(uint32_t));
+    g_site_idx = mem;
+    g_site_idx_cap = cap;
+    for (size_t s = 0; s < g_nsites; s++) {
+        size_t i = g_sites[s].hash & (cap - 1);
+        while (g_site_idx[i]) i = (i + 1) & (cap - 1);
+        g_site_idx[i] = (uint32_t)(s + 1);
+    }
+    return 1;
+}
+
+// Returns the site for this stack, adding it if new, or UINT32_MAX when out of memory
+static uint32_t site_get(void *const *pcs, int depth) {
+    uint64_t h = stack_hash(pcs, depth);
+    if (g_site_idx_cap) {
+        for (size_t i = h & (g_site_idx_cap - 1); g_site_idx[i]; i = (i + 1) & (g_site_idx_cap - 1)) {
+            prof_site_t *s = &g_sites[g_site_idx[i] - 1];
+            if (s->hash == h && s->depth == (uint32_t)depth &&
+                memcmp(s->pcs, pcs, (size_t)depth * sizeof(void *)) == 0) {
+                return g_site_idx[i] - 1;
+            }
+        }
+    }
+
+    if (g_nsites == g_sites_cap) {
+        size_t cap = g_sites_cap ? g_sites_cap * 2 : page_round_up(1) / sizeof(prof_site_t) * 4;
+        prof_site_t *mem = (prof_site_t *)prof_map(cap * sizeof(prof_site_t));
+        if (!mem) return UINT32_MAX;
+        if (g_sites) {
+            memcpy(mem, g_sites, g_nsites * sizeof(prof_site_t));
+            munmap(g_sites, g_sites_cap * sizeof(prof_site_t));
+        }
+        g_sites = mem;
+        g_sites_cap = cap;
+    }
+    if ((g_nsites + 1) * 2 > g_site_idx_cap && !site_idx_rehash(g_site_idx_cap ? g_site_idx_cap * 2 : 1024)) {
+        return UINT32_MAX;
+    }
+
+    prof_site_t *s = &g_sites[g_nsites];
+    memset(s, 0, sizeof(*s));
+    s->hash = h;
+    s->depth = (uint32_t)depth;
+    memcpy(s->pcs, pcs, (size_t)depth * sizeof(void *));
+    size_t i = h & (g_site_idx_cap - 1);
+    while (g_site_idx[i]) i = (i + 1) & (g_site_idx_cap - 1);
+    g_site_idx[i] = (uint32_t)(g_nsites + 1);
+    return (uint32_t)g_nsites++;
+}
+
+static void obj_remove(prof_obj_t *o) {
+    prof_site_t *s = &g_sites[o->site];
+    s->live_samples--;
+    s->live_bytes -= o->size;
+    s->live_weight -= o->weight;
+    __atomic_sub_fetch(&g_filter[filter_slot((void *)o->ptr)], 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&g_prof_live, 1, __ATOMIC_RELAXED);
+    o->ptr = PROF_TOMBSTONE;
+}
+
+static void obj_add(uintptr_t p, size_t size, size_t weight, uint32_t site) {
+    prof_obj_t o = { p, size, weight, site };
+    if (!obj_insert(&o)) return;
+    prof_site_t *s = &g_sites[site];
+    s->live_samples++;
+    s->live_bytes += size;
+    s->live_weight += weight;
+    s->total_samples++;
+    __atomic_add_fetch(&g_filter[filter_slot((void *)p)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_prof_live, 1, __ATOMIC_RELAXED);
+}
+
+// ---- Recording ----
+
+// The unwinder may allocate on its first use in a thread; those allocations
+// see t_prof_busy and go unsampled
+void tdmm_prof_record(void *p, size_t size, size_t weight) {
+    if (t_prof_busy) return;
+    t_prof_busy = 1;
+    void *pcs[PROF_DEPTH + 1];
+    int depth = backtrace(pcs, PROF_DEPTH + 1);
+    // Frame 0 is this function
+    int skip = depth > 1 ? 1 : 0;
+
+    pthread_mutex_lock(&g_prof_lock);
+    prof_obj_t *stale = obj_find((uintptr_t)p);
+    if (stale) obj_remove(stale);
+    uint32_t site = site_get(pcs + skip, depth - skip);
+    if (site != UINT32_MAX) obj_add((uintptr_t)p, size, weight, site);
+    pthread_mutex_unlock(&g_prof_lock);
+    t_prof_busy = 0;
+}
+
+void tdmm_prof_free(void *p) {
+    if (!__atomic_load_n(&g_filter[filter_slot(p)], __ATOMIC_RELAXED)) return;
+    pthread_mutex_lock(&g_prof_lock);
+    prof_obj_t *o = obj_find((uintptr_t)p);
+    if (o) obj_remove(o);
+    pthread_mutex_unlock(&g_prof_lock);
+}
+
+void tdmm_prof_move(void *old, void *p) {
+    if (!__atomic_load_n(&g_filter[filter_slot(old)], __ATOMIC_RELAXED)) return;
+    pthread_mutex_lock(&g_prof_lock);
+    prof_obj_t *o = obj_find((uintptr_t)old);
+    if (o) {
+        prof_obj_t moved = *o;
+        obj_remove(o);
+        // The site keeps counting the sample as taken once
+        g_sites[moved.site].total_samples--;
+        obj_add((uintptr_t)p, moved.size, moved.weight, moved.site);
+    }
+    pthread_mutex_unlock(&g_prof_lock);
+}
+
+void tdmm_prof_reset(void) {
+    pthread_mutex_lock(&g_prof_lock);
+    for (size_t i = 0; i < g_objs_cap; i++) {
+        if (g_objs[i].ptr > PROF_TOMBSTONE) g_filter[filter_slot((void *)g_objs[i].ptr)] = 0;
+    }
+    if (g_objs) munmap(g_objs, g_objs_cap * sizeof(prof_obj_t));
+    if (g_sites) munmap(g_sites, g_sites_cap * sizeof(prof_site_t));
+    if (g_site_idx) munmap(g_site_idx, g_site_idx_cap * sizeof(uint32_t));
+    g_objs = NULL;
+    g_objs_cap = 0;
+    g_objs_used = 0;
+    g_sites = NULL;
+    g_sites_cap = 0;
+    g_nsites = 0;
+    g_site_idx = NULL;
+    g_site_idx_cap = 0;
+    __atomic_store_n(&g_prof_live, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&g_prof_lock);
+}
+
+void tdmm_prof_fork_lock(void) {
+    pthread_mutex_lock(&g_prof_lock);
+}
+
+void tdmm_prof_fork_unlock(int child) {
+    if (child) pthread_mutex_init(&g_prof_lock, NULL);
+    else pthread_mutex_unlock(&g_prof_lock);
+}
+
+// ---- Dump ----
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) return -1;
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Formats into a stack buffer; snprintf does not allocate for these conversions
+int tdmm_prof_dump(int fd) {
+    char line[256];
+    int err = 0;
+    pthread_mutex_lock(&g_prof_lock);
+    size_t sites = 0, weight = 0;
+    for (size_t s = 0; s < g_nsites; s++) {
+        if (!g_sites[s].live_samples) continue;
+        sites++;
+        weight += g_sites[s].live_weight;
+    }
+    int n = snprintf(line, sizeof(line),
+                     "heap profile: %zu sites, %zu live samples, %zu bytes estimated live, sampling every %zu bytes\n",
+                     sites, g_prof_live, weight, __atomic_load_n(&g_prof_sample_bytes, __ATOMIC_RELAXED));
+    err |= write_all(fd, line, (size_t)n);
+
+    for (size_t s = 0; s < g_nsites && !err; s++) {
+        const prof_site_t *site = &g_sites[s];
+        if (!site->live_samples) continue;
+        n = snprintf(line, sizeof(line),
+                     "\nsite %zu: %zu bytes estimated live, %zu live samples of %zu bytes, %zu samples taken\n",
+                     s, site->live_weight, site->live_samples, site->live_bytes, site->total_samples);
+        err |= write_all(fd, line, (size_t)n);
+        for (uint32_t i = 0; i < site->depth && !err; i++) {
+            err |= write_all(fd, "    ", 4);
+            backtrace_symbols_fd((void *const *)&site->pcs[i], 1, fd);
+        }
+    }
+    pthread_mutex_unlock(&g_prof_lock);
+    return err ? -1 : 0;
+}
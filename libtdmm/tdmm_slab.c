@@ -0,0 +1,242 @@
+#include "tdmm_internal.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <pthread.h>
+
+// One reservation holds every slab page. Pages are committed in address order
+// and never unmapped until t_init; emptied pages go back to a pool shared by
+// all arenas.
+uintptr_t g_slab_lo = 0;
+uintptr_t g_slab_hi = 0;
+static uintptr_t g_slab_region = 0;    // unaligned reservation, for unmapping
+static size_t g_slab_region_len = 0;
+static uintptr_t g_slab_next = 0;      // first page never handed out
+static uintptr_t g_slab_end = 0;       // end of the committed part of the region
+static tdmm_pages_e g_slab_pages = TDMM_PAGES_DEFAULT;
+static size_t g_slab_hugetlb = 0;
+static slab_t *g_slab_pool = NULL;
+static size_t g_slab_pool_pages = 0;
+static pthread_mutex_t g_slab_lock = PTHREAD_MUTEX_INITIALIZER;
+
+size_t tdmm_slab_hdr_size(void) {
+    return (sizeof(slab_t) + 15) / 16 * 16;
+}
+
+// Caller holds g_slab_lock
+static int slab_region_init(void) {
+    g_slab_pages = g_page_mode;
+    size_t align = g_slab_pages == TDMM_PAGES_DEFAULT ? SLAB_PAGE_BYTES : TDMM_HUGE_PAGE_BYTES;
+    size_t len = SLAB_REGION_BYTES + align;
+    void *mem = mmap(NULL, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) return 0;
+
+    uintptr_t lo = ((uintptr_t)mem + align - 1) & ~(uintptr_t)(align - 1);
+    g_slab_region = (uintptr_t)mem;
+    g_slab_region_len = len;
+    g_slab_next = lo;
+    g_slab_end = lo;
+    __atomic_store_n(&g_slab_lo, lo, __ATOMIC_RELEASE);
+    __atomic_store_n(&g_slab_hi, lo, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Caller holds g_slab_lock. Commits one page at a time, or in the huge page
+// modes one huge page at a time, so small objects fill a huge page before
+// the next is touched.
+static int slab_commit_next(void) {
+    if (g_slab_next < g_slab_end) return 1;
+    size_t len = g_slab_pages == TDMM_PAGES_DEFAULT ? SLAB_PAGE_BYTES : TDMM_HUGE_PAGE_BYTES;
+    if (g_slab_end + len > g_slab_lo + SLAB_REGION_BYTES) return 0;
+    int huge = tdmm_commit_pages((void *)g_slab_end, len, g_slab_pages);
+    if (huge < 0) return 0;
+    if (huge) g_slab_hugetlb += len;
+    g_slab_end += len;
+    return 1;
+}
+
+// Emptied pages are reused newest first, while they are still warm
+static slab_t *slab_page_get(void) {
+    slab_t *s = NULL;
+    pthread_mutex_lock(&g_slab_lock);
+    if (g_slab_pool) {
+        s = g_slab_pool;
+        g_slab_pool = s->next;
+        g_slab_pool_pages--;
+    } else if ((g_slab_region || slab_region_init()) && slab_commit_next()) {
+        s = (slab_t *)g_slab_next;
+        g_slab_next += SLAB_PAGE_BYTES;
+        __atomic_store_n(&g_slab_hi, g_slab_next, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&g_slab_lock);
+    return s;
+}
+
+static void slab_page_put(slab_t *s) {
+    pthread_mutex_lock(&g_slab_lock);
+    __atomic_store_n(&s->obj_size, 0, __ATOMIC_RELAXED);
+    s->arena = NULL;
+    s->next = g_slab_pool;
+    g_slab_pool = s;
+    g_slab_pool_pages++;
+    pthread_mutex_unlock(&g_slab_lock);
+}
+
+static void slab_list_push(arena_t *a, slab_t *s, size_t cls) {
+    s->prev = NULL;
+    s->next = a->slab_partial[cls];
+    if (s->next) s->next->prev = s;
+    a->slab_partial[cls] = s;
+    s->listed = 1;
+}
+
+static void slab_list_remove(arena_t *a, slab_t *s, size_t cls) {
+    if (s->prev) s->prev->next = s->next;
+    else a->slab_partial[cls] = s->next;
+    if (s->next) s->next->prev = s->prev;
+    s->listed = 0;
+}
+
+static size_t slab_class(const slab_t *s) {
+    return s->obj_size / SLAB_CLASS_BYTES - 1;
+}
+
+static size_t slab_slot(const slab_t *s, const void *p) {
+    return ((uintptr_t)p - (uintptr_t)s - s->first) / s->obj_size;
+}
+
+size_t tdmm_slab_obj_size(const void *p) {
+    const slab_t *s = slab_of(p);
+    size_t size = __atomic_load_n(&s->obj_size, __ATOMIC_RELAXED);
+    size_t off = (uintptr_t)p - (uintptr_t)s;
+    if (!size || off < tdmm_slab_hdr_size() || (off - tdmm_slab_hdr_size()) % size != 0) return 0;
+    if (off >= __atomic_load_n(&s->bump, __ATOMIC_RELAXED)) return 0;
+    size_t slot = (off - tdmm_slab_hdr_size()) / size;
+    uint64_t word = __atomic_load_n(&s->live[slot / 64], __ATOMIC_RELAXED);
+    return (word >> (slot % 64)) & 1 ? size : 0;
+}
+
+int tdmm_slab_release(void *p) {
+    slab_t *s = slab_of(p);
+    // Pooled pages have no class and no live objects
+    if (!__atomic_load_n(&s->obj_size, __ATOMIC_RELAXED)) return 0;
+    size_t slot = slab_slot(s, p);
+    uint64_t bit = (uint64_t)1 << (slot % 64);
+    return (__atomic_fetch_and(&s->live[slot / 64], ~bit, __ATOMIC_RELAXED) & bit) != 0;
+}
+
+// Pops a recycled object, or bumps into the untouched tail of the page
+void *tdmm_slab_alloc(arena_t *a, size_t cls) {
+    slab_t *s = a->slab_partial[cls];
+    if (!s) {
+        s = slab_page_get();
+        if (!s) return NULL;
+        s->arena = a;
+        s->first = (uint32_t)tdmm_slab_hdr_size();
+        s->free_head = 0;
+        s->bump = s->first;
+        s->used = 0;
+        __atomic_store_n(&s->obj_size, (uint32_t)((cls + 1) * SLAB_CLASS_BYTES), __ATOMIC_RELAXED);
+        a->slab_pages++;
+        slab_list_push(a, s, cls);
+    }
+
+    uint8_t *base = (uint8_t *)s;
+    void *p;
+    if (s->free_head) {
+        p = base + s->free_head;
+        s->free_head = *(uint32_t *)p;
+    } else {
+        p = base + s->bump;
+        __atomic_store_n(&s->bump, s->bump + s->obj_size, __ATOMIC_RELAXED);
+    }
+    size_t slot = slab_slot(s, p);
+    // Atomic because remote frees clear other bits of the same word
+    __atomic_fetch_or(&s->live[slot / 64], (uint64_t)1 << (slot % 64), __ATOMIC_RELAXED);
+    s->used++;
+    if (!s->free_head && s->bump + s->obj_size > SLAB_PAGE_BYTES) slab_list_remove(a, s, cls);
+    return p;
+}
+
+void tdmm_slab_free(arena_t *a, void *p) {
+    slab_t *s = slab_of(p);
+    size_t cls = slab_class(s);
+    *(uint32_t *)p = s->free_head;
+    s->free_head = (uint32_t)((uintptr_t)p - (uintptr_t)s);
+    s->used--;
+
+    if (!s->listed) {
+        slab_list_push(a, s, cls);
+    } else if (s->used == 0 && (s->prev || s->next)) {
+        // Keep one page per class so alternating malloc/free does not churn pages
+        slab_list_remove(a, s, cls);
+        a->slab_pages--;
+        slab_page_put(s);
+    }
+}
+
+void tdmm_slab_remote_free(arena_t *a, void *p) {
+    __atomic_add_fetch(&a->remote_bytes, slab_of(p)->obj_size, __ATOMIC_RELAXED);
+    void *head = __atomic_load_n(&a->remote_slab_head, __ATOMIC_RELAXED);
+    do {
+        *(void **)p = head;
+    } while (!__atomic_compare_exchange_n(&a->remote_slab_head, &head, p, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Same single-consumer swap as the block remote stack
+void tdmm_slab_drain_remote(arena_t *a) {
+    if (!__atomic_load_n(&a->remote_slab_head, __ATOMIC_RELAXED)) return;
+    void *p = __atomic_exchange_n(&a->remote_slab_head, NULL, __ATOMIC_ACQUIRE);
+    size_t bytes = 0;
+    while (p) {
+        void *next = *(void **)p;
+        bytes += slab_of(p)->obj_size;
+        tdmm_slab_free(a, p);
+        p = next;
+    }
+    __atomic_sub_fetch(&a->remote_bytes, bytes, __ATOMIC_RELAXED);
+    tdmm_arena_update_metrics(a, METRIC_FREE, 0, bytes);
+}
+
+// Pooled pages plus pages committed ahead of use in the huge page modes
+size_t tdmm_slab_pool_bytes(void) {
+    pthread_mutex_lock(&g_slab_lock);
+    size_t bytes = g_slab_pool_pages * SLAB_PAGE_BYTES + (g_slab_end - g_slab_next);
+    pthread_mutex_unlock(&g_slab_lock);
+    return bytes;
+}
+
+void tdmm_slab_backing(uintptr_t *lo, uintptr_t *hi, size_t *hugetlb_bytes) {
+    pthread_mutex_lock(&g_slab_lock);
+    *lo = g_slab_lo;
+    *hi = g_slab_end;
+    *hugetlb_bytes = g_slab_hugetlb;
+    pthread_mutex_unlock(&g_slab_lock);
+}
+
+void tdmm_slab_fork_lock(void) {
+    pthread_mutex_lock(&g_slab_lock);
+}
+
+void tdmm_slab_fork_unlock(int child) {
+    if (child) pthread_mutex_init(&g_slab_lock, NULL);
+    else pthread_mutex_unlock(&g_slab_lock);
+}
+
+// Drops every page; only called while no arena exists
+void tdmm_slab_reset(void) {
+    pthread_mutex_lock(&g_slab_lock);
+    if (g_slab_region) munmap((void *)g_slab_region, g_slab_region_len);
+    g_slab_region = 0;
+    g_slab_region_len = 0;
+    g_slab_next = 0;
+    g_slab_end = 0;
+    g_slab_hugetlb = 0;
+    g_slab_pool = NULL;
+    g_slab_pool_pages = 0;
+    __atomic_store_n(&g_slab_lo, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&g_slab_hi, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&g_slab_lock);
+}
@@ -0,0 +1,239 @@
+#include "tdmm_internal.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SOA_X86 1
+#endif
+
+// The SoA index keeps the offset and size of every free block in two dense
+// arrays, in no particular order. A search scans 8 bytes per free block from
+// a few contiguous pages instead of chasing headers across the heap, 8 or 4
+// blocks per instruction where the CPU allows. Each indexed block holds its
+// slot in the first word of its payload, so removal moves the last entry
+// into the hole.
+
+static uint32_t *slot_of(block_hdr_t *b) {
+    return (uint32_t *)payload_from_hdr(b);
+}
+
+// Kernels: the smallest (largest) val[i] over the i with lo <= key[i] <= hi,
+// or UINT32_MAX (0) if there is none
+typedef uint32_t (*soa_scan_fn)(const uint32_t *val, const uint32_t *key, size_t n, uint32_t lo, uint32_t hi);
+
+static uint32_t scan_min_scalar(const uint32_t *val, const uint32_t *key, size_t n, uint32_t lo, uint32_t hi) {
+    uint32_t best = UINT32_MAX;
+    for (size_t i = 0; i < n; i++) {
+        if (key[i] >= lo && key[i] <= hi && val[i] < best) best = val[i];
+    }
+    return best;
+}
+
+static uint32_t scan_max_scalar(const uint32_t *val, const uint32_t *key, size_t n, uint32_t lo, uint32_t hi) {
+    uint32_t best = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (key[i] >= lo && key[i] <= hi && val[i] > best) best = val[i];
+    }
+    return best;
+}
+
+#ifdef SOA_X86
+// A key is in range when clamping it to [lo, hi] leaves it unchanged. Lanes out
+// of range become all ones for a min and zero for a max.
+__attribute__((target("avx2")))
+static uint32_t scan_min_avx2(const uint32_t *val, const uint32_t *key, size_t n, uint32_t lo, uint32_t hi) {
+    const __m256i vlo = _mm256_set1_epi32((int)lo);
+    const __m256i vhi = _mm256_set1_epi32((int)hi);
+    const __m256i ones = _mm256_set1_epi32(-1);
+    __m256i best = ones;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i k = _mm256_loadu_si256((const __m256i *)(key + i));
+        __m256i v = _mm256_loadu_si256((const __m256i *)(val + i));
+        __m256i in = _mm256_cmpeq_epi32(_mm256_min_epu32(_mm256_max_epu32(k, vlo), vhi), k);
+        best = _mm256_min_epu32(best, _mm256_or_si256(v, _mm256_andnot_si256(in, ones)));
+    }
+    __m128i m = _mm_min_epu32(_mm256_castsi256_si128(best), _mm256_extracti128_si256(best, 1));
+    m = _mm_min_epu32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm_min_epu32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(2, 3, 0, 1)));
+    uint32_t r = (uint32_t)_mm_cvtsi128_si32(m);
+    uint32_t tail = scan_min_scalar(val + i, key + i, n - i, lo, hi);
+    return tail < r ? tail : r;
+}
+
+__attribute__((target("avx2")))
+static uint32_t scan_max_avx2(const uint32_t *val, const uint32_t *key, size_t n, uint32_t lo, uint32_t hi) {
+    const __m256i vlo = _mm256_set1_epi32((int)lo);
+    const __m256i vhi = _mm256_set1_epi32((int)hi);
+    __m256i best = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i k = _mm256_loadu_si256((const __m256i *)(key + i));
+        __m256i v = _mm256_loadu_si256((const __m256i *)(val + i));
+        __m256i in = _mm256_cmpeq_epi32(_mm256_min_epu32(_mm256_max_epu32(k, vlo), vhi), k);
+        best = _mm256_max_epu32(best, _mm256_and_si256(v, in));
+    }
+    __m128i m = _mm_max_epu32(_mm256_castsi256_si128(best), _mm256_extracti128_si256(best, 1));
+    m = _mm_max_epu32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm_max_epu32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(2, 3, 0, 1)));
+    uint32_t r = (uint32_t)_mm_cvtsi128_si32(m);
+    uint32_t tail = scan_max_scalar(val + i, key + i, n - i, lo, hi);
+    return tail > r ? tail : r;
+}
+
+__attribute__((target("sse4.1")))
+static uint32_t scan_min_sse41(const uint32_t *val, const uint32_t *key, size_t n, uint32_t lo, uint32_t hi) {
+    const __m128i vlo = _mm_set1_epi32((int)lo);
+    const __m128i vhi = _mm_set1_epi32((int)hi);
+    const __m128i ones = _mm_set1_epi32(-1);
+    __m128i best = ones;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i k = _mm_loadu_si128((const __m128i *)(key + i));
+        __m128i v = _mm_loadu_si128((const __m128i *)(val + i));
+        __m128i in = _mm_cmpeq_epi32(_mm_min_epu32(_mm_max_epu32(k, vlo), vhi), k);
+        best = _mm_min_epu32(best, _mm_or_si128(v, _mm_andnot_si128(in, ones)));
+    }
+    best = _mm_min_epu32(best, _mm_shuffle_epi32(best, _MM_SHUFFLE(1, 0, 3, 2)));
+    best = _mm_min_epu32(best, _mm_shuffle_epi32(best, _MM_SHUFFLE(2, 3, 0, 1)));
+    uint32_t r = (uint32_t)_mm_cvtsi128_si32(best);
+    uint32_t tail = scan_min_scalar(val + i, key + i, n - i, lo, hi);
+    return tail < r ? tail : r;
+}
+
+__attribute__((target("sse4.1")))
+static uint32_t scan_max_sse41(const uint32_t *val, const uint32_t *key, size_t n, uint32_t lo, uint32_t hi) {
+    const __m128i vlo = _mm_set1_epi32((int)lo);
+    const __m128i vhi = _mm_set1_epi32((int)hi);
+    __m128i best = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i k = _mm_loadu_si128((const __m128i *)(key + i));
+        __m128i v = _mm_loadu_si128((const __m128i *)(val + i));
+        __m128i in = _mm_cmpeq_epi32(_mm_min_epu32(_mm_max_epu32(k, vlo), vhi), k);
+        best = _mm_max_epu32(best, _mm_and_si128(v, in));
+    }
+    best = _mm_max_epu32(best, _mm_shuffle_epi32(best, _MM_SHUFFLE(1, 0, 3, 2)));
+    best = _mm_max_epu32(best, _mm_shuffle_epi32(best, _MM_SHUFFLE(2, 3, 0, 1)));
+    uint32_t r = (uint32_t)_mm_cvtsi128_si32(best);
+    uint32_t tail = scan_max_scalar(val + i, key + i, n - i, lo, hi);
+    return tail > r ? tail : r;
+}
+#endif
+
+static soa_scan_fn g_scan_min;
+static soa_scan_fn g_scan_max;
+
+// Picks the widest kernels the CPU runs, once. Racing threads store the same
+// pointers.
+static void pick_kernels(void) {
+    soa_scan_fn lo = scan_min_scalar, hi = scan_max_scalar;
+#ifdef SOA_X86
+    // May run before constructors, when the preloaded library serves the
+    // dynamic loader's own allocations
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        lo = scan_min_avx2;
+        hi = scan_max_avx2;
+    } else if (__builtin_cpu_supports("sse4.1")) {
+        lo = scan_min_sse41;
+        hi = scan_max_sse41;
+    }
+#endif
+    __atomic_store_n(&g_scan_max, hi, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_scan_min, lo, __ATOMIC_RELEASE);
+}
+
+static uint32_t scan_min(const uint32_t *val, const uint32_t *key, size_t n, uint32_t lo, uint32_t hi) {
+    soa_scan_fn f = __atomic_load_n(&g_scan_min, __ATOMIC_ACQUIRE);
+    if (!f) {
+        pick_kernels();
+        f = g_scan_min;
+    }
+    return f(val, key, n, lo, hi);
+}
+
+static uint32_t scan_max(const uint32_t *val, const uint32_t *key, size_t n, uint32_t lo, uint32_t hi) {
+    soa_scan_fn f = __atomic_load_n(&g_scan_max, __ATOMIC_ACQUIRE);
+    if (!f) {
+        pick_kernels();
+        f = g_scan_max;
+    }
+    return f(val, key, n, lo, hi);
+}
+
+// Both arrays share one mapping, sizes right after the cap offsets
+static int soa_grow(arena_t *a) {
+    size_t cap = a->soa_cap ? (size_t)a->soa_cap * 2 : page_round_up(1) / sizeof(uint32_t);
+    if (cap > UINT32_MAX) return 0;
+    void *mem = mmap(NULL, page_round_up(2 * cap * sizeof(uint32_t)), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return 0;
+    uint32_t *off = (uint32_t *)mem;
+    uint32_t *size = off + cap;
+    if (a->soa_off) {
+        memcpy(off, a->soa_off, a->soa_n * sizeof(uint32_t));
+        memcpy(size, a->soa_size, a->soa_n * sizeof(uint32_t));
+        munmap(a->soa_off, page_round_up(2 * (size_t)a->soa_cap * sizeof(uint32_t)));
+    }
+    a->soa_off = off;
+    a->soa_size = size;
+    a->soa_cap = (uint32_t)cap;
+    return 1;
+}
+
+int tdmm_soa_insert(arena_t *a, block_hdr_t *b) {
+    if (a->soa_n == a->soa_cap && !soa_grow(a)) return 0;
+    uint32_t i = a->soa_n++;
+    a->soa_off[i] = blk_off(a, b);
+    a->soa_size[i] = (uint32_t)blk_size(b);
+    *slot_of(b) = i;
+    return 1;
+}
+
+void tdmm_soa_remove(arena_t *a, block_hdr_t *b) {
+    uint32_t i = *slot_of(b);
+    uint32_t last = --a->soa_n;
+    if (i == last) return;
+    a->soa_off[i] = a->soa_off[last];
+    a->soa_size[i] = a->soa_size[last];
+    *slot_of(blk_at(a, a->soa_off[i])) = i;
+}
+
+// Ties go to the lowest address, as in the heap walk and the size-ordered trees
+
+// Lowest-addressed block with size >= need
+block_hdr_t *tdmm_soa_first_fit(arena_t *a, size_t need) {
+    if (need > UINT32_MAX) return NULL;
+    uint32_t off = scan_min(a->soa_off, a->soa_size, a->soa_n, (uint32_t)need, UINT32_MAX);
+    return off == UINT32_MAX ? NULL : blk_at(a, off);
+}
+
+// Smallest block with size >= need
+block_hdr_t *tdmm_soa_best_fit(arena_t *a, size_t need) {
+    if (need > UINT32_MAX) return NULL;
+    uint32_t size = scan_min(a->soa_size, a->soa_size, a->soa_n, (uint32_t)need, UINT32_MAX);
+    if (size == UINT32_MAX) return NULL;
+    return blk_at(a, scan_min(a->soa_off, a->soa_size, a->soa_n, size, size));
+}
+
+block_hdr_t *tdmm_soa_worst_fit(arena_t *a, size_t need) {
+    size_t size = tdmm_soa_largest(a);
+    if (!a->soa_n || size < need) return NULL;
+    return blk_at(a, scan_min(a->soa_off, a->soa_size, a->soa_n, (uint32_t)size, (uint32_t)size));
+}
+
+size_t tdmm_soa_largest(arena_t *a) {
+    return scan_max(a->soa_size, a->soa_size, a->soa_n, 0, UINT32_MAX);
+}
+
+void tdmm_soa_release(arena_t *a) {
+    if (a->soa_off) munmap(a->soa_off, page_round_up(2 * (size_t)a->soa_cap * sizeof(uint32_t)));
+    a->soa_off = NULL;
+    a->soa_size = NULL;
+    a->soa_n = 0;
+    a->soa_cap = 0;
+}
@@ -1,10 +1,13 @@
 #define _POSIX_C_SOURCE 200809L
 
 #include "tdmm.h"
+#include "tdmm_counters.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
 #include <time.h>
+#include <pthread.h>
 
 #ifndef MiB
 #define MiB (1024u * 1024u)
@@ -28,20 +31,25 @@ static const char *policy_name(alloc_strat_e s) {
         case FIRST_FIT: return "FIRST_FIT";
         case BEST_FIT:  return "BEST_FIT";
         case WORST_FIT: return "WORST_FIT";
+        case TLSF:      return "TLSF";
+        case NEXT_FIT:  return "NEXT_FIT";
+        case ADDRESS_ORDERED_FIRST_FIT: return "ADDRESS_ORDERED_FIRST_FIT";
         default:        return "UNKNOWN";
     }
 }
 
-typedef struct {
-    size_t bytes_from_os;
-    size_t cur_inuse_bytes;
-    size_t peak_inuse_bytes;
-    double util_sum;
-    size_t num_util;
-} tdmm_metrics_t;
+// Runs with TDMM_PARAM_SOA_INDEX are labeled e.g. FIRST_FIT_SOA
+static const char *run_name(alloc_strat_e s, int soa) {
+    static char buf[64];
+    snprintf(buf, sizeof(buf), "%s%s", policy_name(s), soa ? "_SOA" : "");
+    return buf;
+}
 
-extern const tdmm_metrics_t *t_metrics_ptr(void);
-extern size_t t_overhead_bytes(void);
+static tdmm_stats_t stats_now(void) {
+    tdmm_stats_t s;
+    t_stats(&s);
+    return s;
+}
 
 static FILE *open_csv_or_die(const char *path) {
     FILE *f = fopen(path, "w");
@@ -53,6 +61,21 @@ static FILE *open_csv_or_die(const char *path) {
     return f;
 }
 
+// Trace rows carry no counts of their own
+static void end_row(FILE *out) {
+    tdmm_counters_csv_blank(out);
+    fprintf(out, "\n");
+}
+
+// Counts for one phase of one round, which include the t_stats call and
+// the sampled fprintf after every operation
+static void phase_counters(FILE *out, size_t round, const char *phase, tdmm_counters_t *ctr) {
+    tdmm_counters_stop(ctr);
+    fprintf(out, "COUNTERS,%zu,%s,0,0.0,0,0", round, phase);
+    tdmm_counters_csv_row(out, ctr);
+    fprintf(out, "\n");
+}
+
 static void run_util_trace_to_csv(alloc_strat_e strat) {
     const size_t N = 4000;
     const size_t M = 2000;
@@ -64,7 +87,9 @@ static void run_util_trace_to_csv(alloc_strat_e strat) {
     snprintf(path, sizeof(path), "util_trace_%s.csv", policy_name(strat));
     FILE *out = open_csv_or_die(path);
 
-    fprintf(out, "policy,event,op,req_bytes,utilization,cur_inuse_bytes,overhead_bytes\n");
+    fprintf(out, "policy,event,op,req_bytes,utilization,cur_inuse_bytes,overhead_bytes");
+    tdmm_counters_csv_header(out);
+    fprintf(out, "\n");
 
     void **ptrs = (void **)calloc(N + M, sizeof(void *));
     if (!ptrs) {
@@ -78,98 +103,129 @@ static void run_util_trace_to_csv(alloc_strat_e strat) {
     t_init(strat);
     uint64_t event = 0;
     size_t overhead_peak = 0;
+    tdmm_counters_t ctr;
+    tdmm_counters_open(&ctr);
 
     for (size_t round = 0; round < R; round++) {
         // Phase 1: allocate N
+        tdmm_counters_start(&ctr);
         for (size_t i = 0; i < N; i++) {
             size_t sz = MIN_SZ + (xorshift32(&rng) % (MAX_SZ - MIN_SZ + 1));
             ptrs[i] = t_malloc(sz);
 
-            const tdmm_metrics_t *m = t_metrics_ptr();
-            double u = (m->bytes_from_os ? (double)m->cur_inuse_bytes / (double)m->bytes_from_os : 0.0);
-            size_t oh = t_overhead_bytes();
+            tdmm_stats_t m = stats_now();
+            double u = (m.bytes_from_os ? (double)m.cur_inuse_bytes / (double)m.bytes_from_os : 0.0);
+            size_t oh = m.overhead_bytes;
             if (oh > overhead_peak) overhead_peak = oh;
             
             if (i % 100 == 0) {
-                fprintf(out, "%s,%llu,malloc,%zu,%.10f,%zu,%zu\n",
-                        policy_name(strat), (unsigned long long)event++, sz, u, m->cur_inuse_bytes, oh);
+                fprintf(out, "%s,%llu,malloc,%zu,%.10f,%zu,%zu",
+                        policy_name(strat), (unsigned long long)event++, sz, u, m.cur_inuse_bytes, oh);
+                end_row(out);
             }
         }
 
+        phase_counters(out, round, "phase_alloc_n", &ctr);
+
         // Phase 2: free every other
+        tdmm_counters_start(&ctr);
         for (size_t i = 0; i < N; i += 2) {
             if (!ptrs[i]) continue;
             t_free(ptrs[i]);
             ptrs[i] = NULL;
 
-            const tdmm_metrics_t *m = t_metrics_ptr();
-            double u = (m->bytes_from_os ? (double)m->cur_inuse_bytes / (double)m->bytes_from_os : 0.0);
-            size_t oh = t_overhead_bytes();
+            tdmm_stats_t m = stats_now();
+            double u = (m.bytes_from_os ? (double)m.cur_inuse_bytes / (double)m.bytes_from_os : 0.0);
+            size_t oh = m.overhead_bytes;
             if (oh > overhead_peak) overhead_peak = oh;
             
             if (i % 100 == 0) {
-                fprintf(out, "%s,%llu,free,0,%.10f,%zu,%zu\n",
-                        policy_name(strat), (unsigned long long)event++, u, m->cur_inuse_bytes, oh);
+                fprintf(out, "%s,%llu,free,0,%.10f,%zu,%zu",
+                        policy_name(strat), (unsigned long long)event++, u, m.cur_inuse_bytes, oh);
+                end_row(out);
             }
         }
 
+        phase_counters(out, round, "phase_free_half", &ctr);
+
         // Phase 3: allocate M more
+        tdmm_counters_start(&ctr);
         for (size_t j = 0; j < M; j++) {
             size_t sz = MIN_SZ + (xorshift32(&rng) % (MAX_SZ - MIN_SZ + 1));
             ptrs[N + j] = t_malloc(sz);
 
-            const tdmm_metrics_t *m = t_metrics_ptr();
-            double u = (m->bytes_from_os ? (double)m->cur_inuse_bytes / (double)m->bytes_from_os : 0.0);
-            size_t oh = t_overhead_bytes();
+            tdmm_stats_t m = stats_now();
+            double u = (m.bytes_from_os ? (double)m.cur_inuse_bytes / (double)m.bytes_from_os : 0.0);
+            size_t oh = m.overhead_bytes;
             if (oh > overhead_peak) overhead_peak = oh;
             
             if (j % 100 == 0) {
-                fprintf(out, "%s,%llu,malloc,%zu,%.10f,%zu,%zu\n",
-                        policy_name(strat), (unsigned long long)event++, sz, u, m->cur_inuse_bytes, oh);
+                fprintf(out, "%s,%llu,malloc,%zu,%.10f,%zu,%zu",
+                        policy_name(strat), (unsigned long long)event++, sz, u, m.cur_inuse_bytes, oh);
+                end_row(out);
             }
         }
 
+        phase_counters(out, round, "phase_alloc_m", &ctr);
+
         // Phase 4: free all remaining
+        tdmm_counters_start(&ctr);
         for (size_t i = 0; i < N + M; i++) {
             if (!ptrs[i]) continue;
             t_free(ptrs[i]);
             ptrs[i] = NULL;
 
-            const tdmm_metrics_t *m = t_metrics_ptr();
-            double u = (m->bytes_from_os ? (double)m->cur_inuse_bytes / (double)m->bytes_from_os : 0.0);
-            size_t oh = t_overhead_bytes();
+            tdmm_stats_t m = stats_now();
+            double u = (m.bytes_from_os ? (double)m.cur_inuse_bytes / (double)m.bytes_from_os : 0.0);
+            size_t oh = m.overhead_bytes;
             if (oh > overhead_peak) overhead_peak = oh;
             
             if (i % 100 == 0) {
-                fprintf(out, "%s,%llu,free,0,%.10f,%zu,%zu\n",
-                        policy_name(strat), (unsigned long long)event++, u, m->cur_inuse_bytes, oh);
+                fprintf(out, "%s,%llu,free,0,%.10f,%zu,%zu",
+                        policy_name(strat), (unsigned long long)event++, u, m.cur_inuse_bytes, oh);
+                end_row(out);
             }
         }
-    }
 
-    const tdmm_metrics_t *m = t_metrics_ptr();
-    double avg_u = (m->num_util ? (m->util_sum / (double)m->num_util) : 0.0);
-    double peak_u = (m->bytes_from_os ? (double)m->peak_inuse_bytes / (double)m->bytes_from_os : 0.0);
-    size_t oh_end = t_overhead_bytes();
-
-    fprintf(out, "SUMMARY,0,avg_util,0,%.10f,0,0\n", avg_u);
-    fprintf(out, "SUMMARY,0,peak_util,0,%.10f,0,0\n", peak_u);
-    fprintf(out, "SUMMARY,0,os_bytes,0,0.0,0,%zu\n", m->bytes_from_os);
-    fprintf(out, "SUMMARY,0,samples,0,0.0,%zu,0\n", m->num_util);
-    fprintf(out, "SUMMARY,0,overhead_end,0,0.0,0,%zu\n", oh_end);
-    fprintf(out, "SUMMARY,0,overhead_peak,0,0.0,0,%zu\n", overhead_peak);
+        phase_counters(out, round, "phase_free_all", &ctr);
+    }
+    tdmm_counters_close(&ctr);
+
+    tdmm_stats_t m = stats_now();
+    double avg_u = (m.num_util ? (m.util_sum / (double)m.num_util) : 0.0);
+    double peak_u = (m.bytes_from_os ? (double)m.peak_inuse_bound_bytes / (double)m.bytes_from_os : 0.0);
+    size_t oh_end = m.overhead_bytes;
+
+    fprintf(out, "SUMMARY,0,avg_util,0,%.10f,0,0", avg_u);
+    end_row(out);
+    fprintf(out, "SUMMARY,0,peak_util,0,%.10f,0,0", peak_u);
+    end_row(out);
+    fprintf(out, "SUMMARY,0,os_bytes,0,0.0,0,%zu", m.bytes_from_os);
+    end_row(out);
+    fprintf(out, "SUMMARY,0,samples,0,0.0,%zu,0", m.num_util);
+    end_row(out);
+    fprintf(out, "SUMMARY,0,overhead_end,0,0.0,0,%zu", oh_end);
+    end_row(out);
+    fprintf(out, "SUMMARY,0,overhead_peak,0,0.0,0,%zu", overhead_peak);
+    end_row(out);
 
     free(ptrs);
     fclose(out);
 }
 
-static void run_speed_curve_to_csv(alloc_strat_e strat) {
+static void run_speed_curve_to_csv(alloc_strat_e strat, int soa) {
     char path[128];
-    snprintf(path, sizeof(path), "speed_%s.csv", policy_name(strat));
+    snprintf(path, sizeof(path), "speed_%s.csv", run_name(strat, soa));
     FILE *out = open_csv_or_die(path);
 
-    fprintf(out, "policy,size_bytes,iters,avg_malloc_ns,avg_free_ns,overhead_bytes\n");
+    fprintf(out, "policy,size_bytes,iters,avg_malloc_ns,avg_free_ns,overhead_bytes,path");
+    tdmm_counters_csv_header(out);
+    fprintf(out, "\n");
+    tdmm_counters_t ctr;
+    tdmm_counters_open(&ctr);
+    t_set_param(TDMM_PARAM_SOA_INDEX, (size_t)soa);
     t_init(strat);
+    t_set_param(TDMM_PARAM_MMAP_THRESHOLD, TDMM_DEFAULT_MMAP_THRESHOLD);
 
     for (int k = 0; k <= 23; k++) {
         size_t sz = (size_t)1u << k;
@@ -185,6 +241,7 @@ static void run_speed_curve_to_csv(alloc_strat_e strat) {
         uint64_t malloc_sum = 0;
         uint64_t free_sum = 0;
 
+        tdmm_counters_start(&ctr);
         for (uint64_t i = 0; i < iters; i++) {
             uint64_t a0 = now_ns();
             void *p = t_malloc(sz);
@@ -197,29 +254,37 @@ static void run_speed_curve_to_csv(alloc_strat_e strat) {
             malloc_sum += (a1 - a0);
             free_sum += (f1 - f0);
         }
+        tdmm_counters_stop(&ctr);
 
         double avg_m = iters ? (double)malloc_sum / (double)iters : 0.0;
         double avg_f = iters ? (double)free_sum / (double)iters : 0.0;
-        size_t oh = t_overhead_bytes();
+        size_t oh = stats_now().overhead_bytes;
 
-        fprintf(out, "%s,%zu,%llu,%.4f,%.4f,%zu\n",
-                policy_name(strat), sz, (unsigned long long)iters, avg_m, avg_f, oh);
+        fprintf(out, "%s,%zu,%llu,%.4f,%.4f,%zu,%s",
+                run_name(strat, soa), sz, (unsigned long long)iters, avg_m, avg_f, oh,
+                sz >= TDMM_DEFAULT_MMAP_THRESHOLD ? "mmap" : "heap");
+        tdmm_counters_csv_row(out, &ctr);
+        fprintf(out, "\n");
     }
+    t_set_param(TDMM_PARAM_SOA_INDEX, 0);
+    tdmm_counters_close(&ctr);
 
     fclose(out);
 }
 
-static void run_program_runtime_to_csv(alloc_strat_e strat) {
+static void run_program_runtime_to_csv(alloc_strat_e strat, int soa) {
     const size_t OPS = 300000;
     const size_t LIVE = 20000;
     const size_t MIN_SZ = 8;
     const size_t MAX_SZ = 8192;
 
     char path[128];
-    snprintf(path, sizeof(path), "runtime_%s.csv", policy_name(strat));
+    snprintf(path, sizeof(path), "runtime_%s.csv", run_name(strat, soa));
     FILE *out = open_csv_or_die(path);
 
-    fprintf(out, "policy,total_runtime_ns,avg_util,peak_util,os_bytes,samples,overhead_end,overhead_peak\n");
+    fprintf(out, "policy,total_runtime_ns,avg_util,peak_util,os_bytes,samples,overhead_end,overhead_peak");
+    tdmm_counters_csv_header(out);
+    fprintf(out, "\n");
 
     void **live = (void **)calloc(LIVE, sizeof(void *));
     if (!live) {
@@ -230,8 +295,12 @@ static void run_program_runtime_to_csv(alloc_strat_e strat) {
 
     uint32_t rng = 0xBADC0DEu;
 
+    t_set_param(TDMM_PARAM_SOA_INDEX, (size_t)soa);
     t_init(strat);
     size_t overhead_peak = 0;
+    tdmm_counters_t ctr;
+    tdmm_counters_open(&ctr);
+    tdmm_counters_start(&ctr);
     uint64_t start = now_ns();
 
     for (size_t op = 0; op < OPS; op++) {
@@ -246,7 +315,7 @@ static void run_program_runtime_to_csv(alloc_strat_e strat) {
             live[idx] = t_malloc(sz);
         }
         if ((op & 255u) == 0u) {
-            size_t oh = t_overhead_bytes();
+            size_t oh = stats_now().overhead_bytes;
             if (oh > overhead_peak) overhead_peak = oh;
         }
     }
@@ -257,35 +326,155 @@ static void run_program_runtime_to_csv(alloc_strat_e strat) {
 
     uint64_t end = now_ns();
     uint64_t total = end - start;
+    tdmm_counters_stop(&ctr);
+    tdmm_counters_close(&ctr);
 
-    const tdmm_metrics_t *m = t_metrics_ptr();
-    double avg_u = (m->num_util ? (m->util_sum / (double)m->num_util) : 0.0);
-    double peak_u = (m->bytes_from_os ? (double)m->peak_inuse_bytes / (double)m->bytes_from_os : 0.0);
+    tdmm_stats_t m = stats_now();
+    double avg_u = (m.num_util ? (m.util_sum / (double)m.num_util) : 0.0);
+    double peak_u = (m.bytes_from_os ? (double)m.peak_inuse_bound_bytes / (double)m.bytes_from_os : 0.0);
 
-    size_t overhead_end = t_overhead_bytes();
+    size_t overhead_end = m.overhead_bytes;
     if (overhead_end > overhead_peak) overhead_peak = overhead_end;
 
-    fprintf(out, "%s,%llu,%.10f,%.10f,%zu,%zu,%zu,%zu\n",
-            policy_name(strat),
+    fprintf(out, "%s,%llu,%.10f,%.10f,%zu,%zu,%zu,%zu",
+            run_name(strat, soa),
             (unsigned long long)total,
             avg_u,
             peak_u,
-            m->bytes_from_os,
-            m->num_util,
+            m.bytes_from_os,
+            m.num_util,
             overhead_end,
             overhead_peak);
+    tdmm_counters_csv_row(out, &ctr);
+    fprintf(out, "\n");
 
+    t_set_param(TDMM_PARAM_SOA_INDEX, 0);
     free(live);
     fclose(out);
 }
 
-int main(void) {
-    alloc_strat_e policies[3] = { FIRST_FIT, BEST_FIT, WORST_FIT };
+typedef struct {
+    size_t size;
+    size_t ops;
+    uint32_t seed;
+    pthread_barrier_t *start;
+} thread_job_t;
+
+// Churns a small private window of same-sized objects, the pattern thread
+// caches are meant to absorb
+static void *thread_churn(void *arg) {
+    thread_job_t *job = (thread_job_t *)arg;
+    void *slots[64] = {0};
+    uint32_t rng = job->seed;
+
+    pthread_barrier_wait(job->start);
+    for (size_t op = 0; op < job->ops; op++) {
+        size_t idx = xorshift32(&rng) % 64;
+        if (slots[idx]) {
+            t_free(slots[idx]);
+            slots[idx] = NULL;
+        } else {
+            slots[idx] = t_malloc(job->size);
+            if (slots[idx]) *(volatile char *)slots[idx] = 1;
+        }
+    }
+    for (size_t i = 0; i < 64; i++) {
+        if (slots[i]) t_free(slots[i]);
+    }
+    return NULL;
+}
+
+static uint64_t run_threads_once(size_t nthreads, size_t size, size_t ops) {
+    pthread_t tids[16];
+    thread_job_t jobs[16];
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, (unsigned)nthreads + 1);
+
+    for (size_t t = 0; t < nthreads; t++) {
+        jobs[t] = (thread_job_t){ size, ops, 0x9E3779B9u * (uint32_t)(t + 1), &start };
+        // The barrier counts every thread, so a missing one would never release it
+        int err = pthread_create(&tids[t], NULL, thread_churn, &jobs[t]);
+        if (err) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            exit(1);
+        }
+    }
+    uint64_t t0 = now_ns();
+    pthread_barrier_wait(&start);
+    for (size_t t = 0; t < nthreads; t++) pthread_join(tids[t], NULL);
+    uint64_t t1 = now_ns();
+
+    pthread_barrier_destroy(&start);
+    return t1 - t0;
+}
+
+// Threads x size grid in three modes: per-thread caches over per-CPU arenas;
+// no caches, so every call takes the lock of the arena its thread is assigned;
+// and no caches with one arena, so every call takes the same lock
+static void run_thread_scaling_to_csv(alloc_strat_e strat) {
+    const size_t OPS = 200000;
+    const size_t threads[] = { 1, 2, 4, 8, 16 };
+    const size_t sizes[] = { 16, 64, 256 };
+    const char *modes[] = { "tcache", "no_tcache", "single_lock" };
+    const size_t nmodes = sizeof(modes) / sizeof(modes[0]);
+
+    char path[128];
+    snprintf(path, sizeof(path), "threads_%s.csv", policy_name(strat));
+    FILE *out = open_csv_or_die(path);
+
+    fprintf(out, "policy,mode,threads,size_bytes,ops_per_thread,total_ns,mops_per_sec\n");
+
+    for (size_t m = 0; m < nmodes; m++) {
+        t_set_param(TDMM_PARAM_ARENAS, m == 2 ? 1 : 0);
+        t_init(strat);
+        t_set_param(TDMM_PARAM_TCACHE_MAX_BYTES, m == 0 ? TDMM_DEFAULT_TCACHE_MAX_BYTES : 0);
+
+        for (size_t si = 0; si < sizeof(sizes) / sizeof(sizes[0]); si++) {
+            for (size_t ti = 0; ti < sizeof(threads) / sizeof(threads[0]); ti++) {
+                uint64_t ns = run_threads_once(threads[ti], sizes[si], OPS);
+                double mops = ns ? (double)(threads[ti] * OPS) * 1e3 / (double)ns : 0.0;
+                fprintf(out, "%s,%s,%zu,%zu,%zu,%llu,%.4f\n",
+                        policy_name(strat), modes[m], threads[ti], sizes[si], OPS,
+                        (unsigned long long)ns, mops);
+            }
+        }
+    }
+    t_set_param(TDMM_PARAM_TCACHE_MAX_BYTES, TDMM_DEFAULT_TCACHE_MAX_BYTES);
+    t_set_param(TDMM_PARAM_ARENAS, 0);
+
+    fclose(out);
+}
+
+int main(int argc, char **argv) {
+    alloc_strat_e policies[] = { FIRST_FIT, BEST_FIT, WORST_FIT, TLSF, NEXT_FIT, ADDRESS_ORDERED_FIRST_FIT };
+    int npolicies = (int)(sizeof(policies) / sizeof(policies[0]));
+
+    // "soa": the SoA index against the heap walk and trees it replaces, for
+    // the strategies that can use it. FIRST_FIT's walk makes this run long.
+    if (argc > 1 && strcmp(argv[1], "soa") == 0) {
+        for (int i = 0; i < npolicies; i++) {
+            if (policies[i] != FIRST_FIT && policies[i] != BEST_FIT && policies[i] != WORST_FIT) continue;
+            for (int soa = 0; soa <= 1; soa++) {
+                run_program_runtime_to_csv(policies[i], soa);
+                run_speed_curve_to_csv(policies[i], soa);
+            }
+        }
+        printf("Wrote CSVs: runtime_*.csv, speed_*.csv\n");
+        return 0;
+    }
+
+    // "counters": the runtime and speed benchmarks for every strategy, with
+    // the hardware and software event counts next to the timings
+    if (argc > 1 && strcmp(argv[1], "counters") == 0) {
+        for (int i = 0; i < npolicies; i++) run_program_runtime_to_csv(policies[i], 0);
+        for (int i = 0; i < npolicies; i++) run_speed_curve_to_csv(policies[i], 0);
+        printf("Wrote CSVs: runtime_*.csv, speed_*.csv\n");
+        return 0;
+    }
 
-    for (int i = 0; i < 3; i++) run_util_trace_to_csv(policies[i]);
-    // for (int i = 0; i < 3; i++) run_program_runtime_to_csv(policies[i]);
-    // for (int i = 0; i < 3; i++) run_speed_curve_to_csv(policies[i]);
+    for (int i = 0; i < npolicies; i++) run_util_trace_to_csv(policies[i]);
+    for (int i = 0; i < npolicies; i++) run_thread_scaling_to_csv(policies[i]);
 
-    printf("Wrote CSVs: util_trace_*.csv, runtime_*.csv, speed_*.csv\n");
+    printf("Wrote CSVs: util_trace_*.csv, threads_*.csv\n");
     return 0;
 }
\ No newline at end of file
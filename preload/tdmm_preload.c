@@ -0,0 +1,210 @@
+// Replaces the C allocator with tdmm when preloaded:
+//
+//   LD_PRELOAD=./build/libtdmm_preload.so TDMM_STRATEGY=BEST_FIT <command>
+//
+// TDMM_STRATEGY picks the alloc_strat_e. It defaults to TLSF, since the
+// linear-scan strategies are quadratic on the heap sizes real programs reach.
+// TDMM_TRACE=<path> records every call to a binary trace (see tdmm_trace.h)
+// for tdmm_replay. TDMM_PROFILE=<path> samples the heap (on average every
+// TDMM_PROFILE_SAMPLE bytes, 512 KiB by default) and writes the live heap
+// profile to path at exit.
+#include "tdmm.h"
+#include "tdmm_record.h"
+#include "tdmm_trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define EXPORT __attribute__((visibility("default")))
+
+// Allocations made while the heap is being set up (by the loader, or by libc
+// calls inside t_init) are bumped out of a static buffer and never freed. Each
+// one is prefixed with its size so realloc can move it into the heap.
+#define BOOT_BYTES (64u * 1024u)
+#define BOOT_HDR 16u
+
+static unsigned char g_boot[BOOT_BYTES] __attribute__((aligned(64)));
+static size_t g_boot_used = 0;
+
+enum { INIT_NONE, INIT_RUNNING, INIT_DONE };
+static int g_state = INIT_NONE;
+static const char *g_profile_path = NULL;
+static __thread int t_in_init __attribute__((tls_model("initial-exec")));
+
+static int is_boot(const void *p) {
+    return (const unsigned char *)p >= g_boot && (const unsigned char *)p < g_boot + BOOT_BYTES;
+}
+
+static void *boot_alloc(size_t size, size_t align) {
+    if (align < BOOT_HDR) align = BOOT_HDR;
+    size_t start = (g_boot_used + BOOT_HDR + align - 1) & ~(align - 1);
+    if (start > BOOT_BYTES || size > BOOT_BYTES - start) return NULL;
+    g_boot_used = start + size;
+    *(size_t *)(g_boot + start - BOOT_HDR) = size;
+    // Static storage is zeroed and never reused, so this also serves calloc
+    return g_boot + start;
+}
+
+static size_t boot_size(const void *p) {
+    return *(const size_t *)((const unsigned char *)p - BOOT_HDR);
+}
+
+static alloc_strat_e strategy_from_env(void) {
+    static const struct { const char *name; alloc_strat_e strat; } names[] = {
+        { "FIRST_FIT", FIRST_FIT },
+        { "BEST_FIT", BEST_FIT },
+        { "WORST_FIT", WORST_FIT },
+        { "TLSF", TLSF },
+        { "NEXT_FIT", NEXT_FIT },
+        { "ADDRESS_ORDERED_FIRST_FIT", ADDRESS_ORDERED_FIRST_FIT },
+    };
+    const char *s = getenv("TDMM_STRATEGY");
+    for (size_t i = 0; s && i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(s, names[i].name) == 0) return names[i].strat;
+    }
+    return TLSF;
+}
+
+// Returns 1 once the heap can serve this thread, or 0 while this thread is
+// inside the setup itself and must use the bootstrap buffer
+static int heap_ready(void) {
+    if (__atomic_load_n(&g_state, __ATOMIC_ACQUIRE) == INIT_DONE) return 1;
+    if (t_in_init) return 0;
+
+    int expected = INIT_NONE;
+    if (__atomic_compare_exchange_n(&g_state, &expected, INIT_RUNNING, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        t_in_init = 1;
+        t_init(strategy_from_env());
+        const char *trace = getenv("TDMM_TRACE");
+        if (trace) tdmm_record_open(trace);
+        g_profile_path = getenv("TDMM_PROFILE");
+        if (g_profile_path) {
+            const char *sample = getenv("TDMM_PROFILE_SAMPLE");
+            size_t bytes = sample ? (size_t)strtoull(sample, NULL, 10) : 0;
+            t_set_param(TDMM_PARAM_PROF_SAMPLE_BYTES, bytes ? bytes : 512u * 1024u);
+        }
+        // The first allocation registers this thread's cache and sizes the
+        // arena table through libc; any allocation those make lands in the
+        // bootstrap buffer instead of recursing into a half-built heap
+        t_free(t_malloc(1));
+        t_in_init = 0;
+        __atomic_store_n(&g_state, INIT_DONE, __ATOMIC_RELEASE);
+        return 1;
+    }
+    while (__atomic_load_n(&g_state, __ATOMIC_ACQUIRE) != INIT_DONE) sched_yield();
+    return 1;
+}
+
+__attribute__((destructor)) static void profile_write(void) {
+    if (!g_profile_path) return;
+    int fd = open(g_profile_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+    t_prof_dump(fd);
+    close(fd);
+}
+
+// malloc(0) must return a unique pointer, which t_malloc(0) does not
+static size_t nonzero(size_t size) {
+    return size ? size : 1;
+}
+
+EXPORT void *malloc(size_t size) {
+    if (!heap_ready()) return boot_alloc(size, 16);
+    void *p = t_malloc(nonzero(size));
+    if (!p) errno = ENOMEM;
+    else if (g_record_on) tdmm_record_alloc(TDMM_TRACE_MALLOC, p, size, 0);
+    return p;
+}
+
+EXPORT void free(void *ptr) {
+    if (!ptr || is_boot(ptr)) return;
+    if (g_record_on) tdmm_record_free(ptr);
+    t_free(ptr);
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size) {
+    if (size && nmemb > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (!heap_ready()) return boot_alloc(nmemb * size, 16);
+    void *p = t_calloc(1, nonzero(nmemb * size));
+    if (!p) errno = ENOMEM;
+    else if (g_record_on) tdmm_record_alloc(TDMM_TRACE_CALLOC, p, nmemb * size, 0);
+    return p;
+}
+
+EXPORT void *realloc(void *ptr, size_t size) {
+    if (ptr && is_boot(ptr)) {
+        void *p = malloc(size);
+        if (p) {
+            size_t old = boot_size(ptr);
+            memcpy(p, ptr, old < size ? old : size);
+        }
+        return p;
+    }
+    if (!heap_ready()) return boot_alloc(size, 16);
+    if (!ptr) return malloc(size);
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    void *p;
+    if (g_record_on) {
+        tdmm_record_lock();
+        p = t_realloc(ptr, size);
+        tdmm_record_realloc_locked(ptr, p, size);
+        tdmm_record_unlock();
+    } else {
+        p = t_realloc(ptr, size);
+    }
+    if (!p) errno = ENOMEM;
+    return p;
+}
+
+static void *aligned(size_t align, size_t size) {
+    if (!heap_ready()) return boot_alloc(size, align);
+    void *p = t_aligned_alloc(align, nonzero(size));
+    if (p && g_record_on) tdmm_record_alloc(TDMM_TRACE_ALIGNED, p, size, align);
+    return p;
+}
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0) return EINVAL;
+    void *p = aligned(alignment, size);
+    if (!p) return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size) {
+    void *p = aligned(alignment, size);
+    if (!p) errno = (alignment == 0 || (alignment & (alignment - 1))) ? EINVAL : ENOMEM;
+    return p;
+}
+
+EXPORT void *memalign(size_t alignment, size_t size) {
+    return aligned_alloc(alignment, size);
+}
+
+EXPORT void *valloc(size_t size) {
+    return aligned_alloc((size_t)sysconf(_SC_PAGESIZE), size);
+}
+
+EXPORT void *pvalloc(size_t size) {
+    size_t ps = (size_t)sysconf(_SC_PAGESIZE);
+    return aligned_alloc(ps, (size + ps - 1) / ps * ps);
+}
+
+EXPORT size_t malloc_usable_size(void *ptr) {
+    if (!ptr) return 0;
+    if (is_boot(ptr)) return boot_size(ptr);
+    return t_usable_size(ptr);
+}
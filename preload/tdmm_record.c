@@ -0,0 +1,213 @@
+#include "tdmm_record.h"
+#include "tdmm_trace.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REC_BUF 4096              // records buffered between writes
+#define REC_TOMBSTONE ((uintptr_t)1)
+
+int g_record_on = 0;
+
+static pthread_mutex_t g_rec_lock = PTHREAD_MUTEX_INITIALIZER;
+static int g_rec_fd = -1;
+static pid_t g_rec_pid = 0;       // a forked child stops recording
+static uint64_t g_rec_start = 0;
+static uint32_t g_next_id = 1;
+static uint16_t g_next_thread = 0;
+static tdmm_trace_rec_t g_buf[REC_BUF];
+static size_t g_buf_n = 0;
+static __thread int t_thread __attribute__((tls_model("initial-exec")));  // index + 1; 0 until first record
+
+// Open-addressed map from live pointers to object ids
+typedef struct {
+    uintptr_t ptr;
+    uint32_t id;
+} rec_slot_t;
+
+static rec_slot_t *g_tab = NULL;
+static size_t g_cap = 0;
+static size_t g_used = 0;         // live entries plus tombstones
+static size_t g_count = 0;
+
+static uint64_t mono_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static size_t slot_of(uintptr_t p, size_t cap) {
+    return (size_t)(((uint64_t)(p >> 4) * 0x9E3779B97F4A7C15ull) >> 32) & (cap - 1);
+}
+
+static int tab_insert(uintptr_t p, uint32_t id);
+
+static int tab_rehash(size_t cap) {
+    void *mem = mmap(NULL, cap * sizeof(rec_slot_t), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return 0;
+    rec_slot_t *old = g_tab;
+    size_t old_cap = g_cap;
+    g_tab = (rec_slot_t *)mem;
+    g_cap = cap;
+    g_used = 0;
+    g_count = 0;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].ptr > REC_TOMBSTONE) tab_insert(old[i].ptr, old[i].id);
+    }
+    if (old) munmap(old, old_cap * sizeof(rec_slot_t));
+    return 1;
+}
+
+static int tab_insert(uintptr_t p, uint32_t id) {
+    if ((g_used + 1) * 2 > g_cap) {
+        size_t cap = g_cap ? g_cap : 4096;
+        if (g_count * 4 >= cap) cap *= 2;
+        if (!tab_rehash(cap)) return 0;
+    }
+    size_t i = slot_of(p, g_cap);
+    while (g_tab[i].ptr > REC_TOMBSTONE) i = (i + 1) & (g_cap - 1);
+    if (g_tab[i].ptr == 0) g_used++;
+    g_tab[i] = (rec_slot_t){ p, id };
+    g_count++;
+    return 1;
+}
+
+// Removes p and returns its id, or 0 if it was allocated before recording began
+static uint32_t tab_take(uintptr_t p) {
+    if (!g_cap) return 0;
+    for (size_t i = slot_of(p, g_cap); g_tab[i].ptr != 0; i = (i + 1) & (g_cap - 1)) {
+        if (g_tab[i].ptr == p) {
+            g_tab[i].ptr = REC_TOMBSTONE;
+            g_count--;
+            return g_tab[i].id;
+        }
+    }
+    return 0;
+}
+
+// Caller holds g_rec_lock
+static void flush_locked(void) {
+    if (getpid() != g_rec_pid) {
+        g_buf_n = 0;
+        g_record_on = 0;
+        return;
+    }
+    const char *src = (const char *)g_buf;
+    size_t left = g_buf_n * sizeof(tdmm_trace_rec_t);
+    while (left) {
+        ssize_t n = write(g_rec_fd, src, left);
+        if (n <= 0) break;
+        src += n;
+        left -= (size_t)n;
+    }
+    g_buf_n = 0;
+}
+
+// Caller holds g_rec_lock
+static void append_locked(int op, uint32_t id, size_t size, size_t align) {
+    if (g_rec_fd < 0) return;
+    if (!t_thread) t_thread = ++g_next_thread;
+    tdmm_trace_rec_t *r = &g_buf[g_buf_n++];
+    r->ts_ns = mono_ns() - g_rec_start;
+    r->size = size;
+    r->id = id;
+    r->op = (uint8_t)op;
+    r->align_log2 = align ? (uint8_t)__builtin_ctzll(align) : 0;
+    r->thread = (uint16_t)(t_thread - 1);
+    if (g_buf_n == REC_BUF) flush_locked();
+}
+
+// realloc holds g_rec_lock across the heap call, so it is taken before fork
+// ahead of the heap's locks: registered after t_init, this prepare handler
+// runs first. A child stops recording.
+static void record_fork_prepare(void) {
+    pthread_mutex_lock(&g_rec_lock);
+}
+
+static void record_fork_parent(void) {
+    pthread_mutex_unlock(&g_rec_lock);
+}
+
+static void record_fork_child(void) {
+    pthread_mutex_init(&g_rec_lock, NULL);
+    g_buf_n = 0;
+    g_record_on = 0;
+}
+
+void tdmm_record_open(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+    tdmm_trace_hdr_t h;
+    memset(&h, 0, sizeof(h));
+    h.magic = TDMM_TRACE_MAGIC;
+    h.version = TDMM_TRACE_VERSION;
+    h.record_size = sizeof(tdmm_trace_rec_t);
+    g_rec_start = mono_ns();
+    h.start_ns = g_rec_start;
+    if (write(fd, &h, sizeof(h)) != (ssize_t)sizeof(h)) {
+        close(fd);
+        return;
+    }
+    g_rec_fd = fd;
+    g_rec_pid = getpid();
+    pthread_atfork(record_fork_prepare, record_fork_parent, record_fork_child);
+    g_record_on = 1;
+}
+
+void tdmm_record_alloc(int op, void *p, size_t size, size_t align) {
+    if (!p) return;
+    pthread_mutex_lock(&g_rec_lock);
+    uint32_t id = g_next_id++;
+    if (tab_insert((uintptr_t)p, id)) append_locked(op, id, size, align);
+    pthread_mutex_unlock(&g_rec_lock);
+}
+
+void tdmm_record_free(void *p) {
+    pthread_mutex_lock(&g_rec_lock);
+    uint32_t id = tab_take((uintptr_t)p);
+    if (id) append_locked(TDMM_TRACE_FREE, id, 0, 0);
+    pthread_mutex_unlock(&g_rec_lock);
+}
+
+void tdmm_record_lock(void) {
+    pthread_mutex_lock(&g_rec_lock);
+}
+
+void tdmm_record_unlock(void) {
+    pthread_mutex_unlock(&g_rec_lock);
+}
+
+// An object the trace has not seen yet shows up as a fresh allocation
+void tdmm_record_realloc_locked(void *old, void *p, size_t size) {
+    if (!p) return;
+    uint32_t id = old ? tab_take((uintptr_t)old) : 0;
+    int op = TDMM_TRACE_REALLOC;
+    if (!id) {
+        id = g_next_id++;
+        op = TDMM_TRACE_MALLOC;
+    }
+    if (tab_insert((uintptr_t)p, id)) append_locked(op, id, size, 0);
+}
+
+// Flushes the tail of the trace and fills in max_id
+__attribute__((destructor)) static void record_close(void) {
+    pthread_mutex_lock(&g_rec_lock);
+    if (g_rec_fd >= 0) {
+        flush_locked();
+        if (getpid() == g_rec_pid) {
+            uint32_t max_id = g_next_id - 1;
+            pwrite(g_rec_fd, &max_id, sizeof(max_id), offsetof(tdmm_trace_hdr_t, max_id));
+        }
+        close(g_rec_fd);
+        g_rec_fd = -1;
+        g_record_on = 0;
+    }
+    pthread_mutex_unlock(&g_rec_lock);
+}
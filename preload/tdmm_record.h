@@ -0,0 +1,24 @@
+#ifndef TDMM_RECORD_H
+#define TDMM_RECORD_H
+
+#include <stddef.h>
+
+// Trace recording for the preload library. Everything here stays off the
+// heap: buffers and the pointer table are static or mapped directly.
+extern int g_record_on;
+
+// Starts writing a trace to path; called once, before the first allocation is served
+void tdmm_record_open(const char *path);
+
+// Frees are recorded before the block is released and allocations after they
+// are served, so a pointer's records never overlap with its next owner's
+void tdmm_record_alloc(int op, void *p, size_t size, size_t align);
+void tdmm_record_free(void *p);
+
+// realloc releases the old pointer internally, so the whole call runs under
+// the recorder's lock: record_lock, t_realloc, record_realloc_locked, record_unlock
+void tdmm_record_lock(void);
+void tdmm_record_unlock(void);
+void tdmm_record_realloc_locked(void *old, void *p, size_t size);
+
+#endif // TDMM_RECORD_H
@@ -5,6 +5,11 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 #ifndef EXPECT
 #define EXPECT(cond) do { \
@@ -15,24 +20,23 @@
 } while (0)
 #endif
 
-typedef struct {
-    size_t bytes_from_os;
-    size_t cur_inuse_bytes;
-    size_t peak_inuse_bytes;
-    double util_sum;
-    size_t num_util;
-} tdmm_metrics_t;
-
-extern const tdmm_metrics_t *t_metrics_ptr(void);
-extern size_t t_overhead_bytes(void);
+static tdmm_stats_t stats_now(void) {
+    tdmm_stats_t s;
+    t_stats(&s);
+    return s;
+}
 
+// Tests that tune the size parameters leave them set; each test starts from the defaults
 static void reset_and_init(alloc_strat_e strat) {
+    EXPECT(t_set_param(TDMM_PARAM_MMAP_THRESHOLD, TDMM_DEFAULT_MMAP_THRESHOLD) == 0);
+    EXPECT(t_set_param(TDMM_PARAM_TCACHE_MAX_BYTES, TDMM_DEFAULT_TCACHE_MAX_BYTES) == 0);
+    EXPECT(t_set_param(TDMM_PARAM_SLAB_MAX_BYTES, TDMM_DEFAULT_SLAB_MAX_BYTES) == 0);
+    EXPECT(t_set_param(TDMM_PARAM_FASTBIN_MAX_BYTES, TDMM_DEFAULT_FASTBIN_MAX_BYTES) == 0);
     t_reset();
     t_init(strat);
-    const tdmm_metrics_t *m = t_metrics_ptr();
-    EXPECT(m != NULL);
-    EXPECT(m->bytes_from_os > 0);
-    EXPECT(m->cur_inuse_bytes == 0);
+    tdmm_stats_t m = stats_now();
+    EXPECT(m.bytes_from_os > 0);
+    EXPECT(m.cur_inuse_bytes == 0);
 }
 
 static void test_alignment(alloc_strat_e strat) {
@@ -40,11 +44,53 @@ static void test_alignment(alloc_strat_e strat) {
     for (size_t sz = 1; sz <= 256; sz++) {
         void *p = t_malloc(sz);
         EXPECT(p != NULL);
-        EXPECT(((uintptr_t)p % 4u) == 0u);
+        EXPECT(((uintptr_t)p % TDMM_MIN_ALIGNMENT) == 0u);
         t_free(p);
     }
 }
 
+static void test_aligned_alloc(alloc_strat_e strat) {
+    reset_and_init(strat);
+
+    EXPECT(t_aligned_alloc(24, 64) == NULL);
+    EXPECT(t_aligned_alloc(0, 64) == NULL);
+
+    enum { N = 48 };
+    void *p[N];
+    size_t i = 0;
+    for (size_t align = 8; align <= 4096; align *= 2) {
+        for (size_t sz = 1; sz <= 5000 && i < N; sz = sz * 3 + 7) {
+            p[i] = t_aligned_alloc(align, sz);
+            EXPECT(p[i] != NULL);
+            EXPECT((uintptr_t)p[i] % align == 0);
+            memset(p[i], 0x5A, sz);
+            i++;
+        }
+    }
+    for (size_t j = 0; j < i; j++) t_free(p[j]);
+    EXPECT(stats_now().cur_inuse_bytes == 0);
+
+    // The padding in front of an aligned block goes back to the free pool
+    reset_and_init(strat);
+    void *q = t_aligned_alloc(2048, 4000);
+    EXPECT(q != NULL && (uintptr_t)q % 2048 == 0);
+    tdmm_stats_t m = stats_now();
+    EXPECT(m.cur_inuse_bytes < 4000 + 64);
+    EXPECT(m.free_block_count >= 1);
+    t_free(q);
+
+    // Large requests get an aligned mapping; like realloc, t_realloc only
+    // keeps the default alignment
+    void *big = t_aligned_alloc(64 * 1024, 1024 * 1024);
+    EXPECT(big != NULL && (uintptr_t)big % (64 * 1024) == 0);
+    memset(big, 1, 1024 * 1024);
+    big = t_realloc(big, 3 * 1024 * 1024);
+    EXPECT(big != NULL && (uintptr_t)big % 16 == 0);
+    EXPECT(((unsigned char *)big)[1024 * 1024 - 1] == 1);
+    t_free(big);
+    EXPECT(stats_now().large_count == 0);
+}
+
 static void test_non_overlap_simple(alloc_strat_e strat) {
     reset_and_init(strat);
 
@@ -66,34 +112,257 @@ static void test_non_overlap_simple(alloc_strat_e strat) {
 static void test_split_and_reuse(alloc_strat_e strat) {
     reset_and_init(strat);
 
+    // Fast bins would keep a's block whole for a same-size request
+    EXPECT(t_set_param(TDMM_PARAM_FASTBIN_MAX_BYTES, 0) == 0);
     void *a = t_malloc(1024);
     EXPECT(a);
 
     t_free(a);
-    void *b = t_malloc(128);
+    // Above the slab limit, so it is split from the block a left behind
+    void *b = t_malloc(384);
     EXPECT(b);
     EXPECT(b == a);
 
     t_free(b);
 }
 
+static void test_fast_bins(alloc_strat_e strat) {
+    reset_and_init(strat);
+
+    // Freed and reallocated at the same size: the block comes straight back
+    void *a = t_malloc(800);
+    void *guard = t_malloc(800);
+    EXPECT(a && guard);
+    size_t blocks = stats_now().block_count;
+    t_free(a);
+    tdmm_stats_t s = stats_now();
+    EXPECT(s.block_count == blocks);
+    EXPECT(s.free_block_count == 2);
+    EXPECT(s.cur_inuse_bytes == t_usable_size(guard));
+    void *b = t_malloc(800);
+    EXPECT(b == a);
+    EXPECT(stats_now().block_count == blocks);
+
+    // A double free is caught while the block waits in its bin
+    t_free(b);
+    t_free(b);
+    void *c = t_malloc(800);
+    void *d = t_malloc(800);
+    EXPECT(c == b && d != c);
+    t_free(c);
+    t_free(d);
+    t_free(guard);
+
+    // A bin that grows past its limit is merged back in one go
+    enum { N = 40 };
+    void *ptrs[N];
+    for (int i = 0; i < N; i++) ptrs[i] = t_malloc(1000);
+    for (int i = 0; i < N; i++) t_free(ptrs[i]);
+    s = stats_now();
+    EXPECT(s.block_count < N);
+    EXPECT(s.cur_inuse_bytes == 0);
+}
+
+static void test_batch_alloc_free(alloc_strat_e strat) {
+    reset_and_init(strat);
+
+    enum { N = 100 };
+    static void *ptrs[N];
+    // Slab objects, heap blocks and separate mappings
+    static const size_t sizes[] = { 48, 700, 200000 };
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t sz = sizes[s];
+        EXPECT(t_malloc_batch(sz, N, ptrs) == N);
+        for (int i = 0; i < N; i++) {
+            EXPECT(ptrs[i] != NULL);
+            EXPECT(t_usable_size(ptrs[i]) >= sz);
+            memset(ptrs[i], i, sz);
+        }
+        for (int i = 0; i < N; i++) EXPECT(((unsigned char *)ptrs[i])[sz - 1] == (unsigned char)i);
+        EXPECT(stats_now().cur_inuse_bytes >= N * sz);
+
+        // Shuffled, and with a NULL entry, to exercise the sort
+        for (int i = N - 1; i > 0; i--) {
+            int j = (i * 7919) % (i + 1);
+            void *t = ptrs[i];
+            ptrs[i] = ptrs[j];
+            ptrs[j] = t;
+        }
+        t_free(ptrs[3]);
+        ptrs[3] = NULL;
+        t_free_batch(ptrs, N);
+        EXPECT(stats_now().cur_inuse_bytes == 0);
+    }
+
+    // Heap blocks carved as one run coalesce back into the heap's single block
+    EXPECT(t_malloc_batch(700, N, ptrs) == N);
+    for (int i = 1; i < N; i++) EXPECT((char *)ptrs[i] > (char *)ptrs[i - 1]);
+    t_free_batch(ptrs, N);
+    tdmm_stats_t s = stats_now();
+    EXPECT(s.block_count == 1);
+    EXPECT(s.cur_inuse_bytes == 0);
+}
+
+static void test_huge_page_backing(alloc_strat_e strat) {
+    EXPECT(t_set_param(TDMM_PARAM_PAGES, TDMM_PAGES_HUGETLB + 1) == -1);
+    EXPECT(t_set_param(TDMM_PARAM_PAGES, TDMM_PAGES_THP) == 0);
+    reset_and_init(strat);
+
+    void *small = t_malloc(32);
+    void *mid = t_malloc(3000);
+    EXPECT(small && mid);
+    memset(small, 1, 32);
+    memset(mid, 2, 3000);
+
+    // Both the arena and the slab region are committed in whole huge pages
+    const size_t huge = 2u * 1024u * 1024u;
+    tdmm_backing_t b;
+    EXPECT(t_page_backing(&b) == 0);
+    EXPECT(b.heap_bytes >= 2 * huge);
+    EXPECT(b.heap_bytes % huge == 0);
+    EXPECT(b.thp_bytes <= b.heap_bytes);
+    EXPECT(b.hugetlb_bytes <= b.heap_bytes);
+
+    t_free(small);
+    t_free(mid);
+    EXPECT(stats_now().cur_inuse_bytes == 0);
+    EXPECT(t_set_param(TDMM_PARAM_PAGES, TDMM_PAGES_DEFAULT) == 0);
+    reset_and_init(strat);
+}
+
+// Reads back the header line of a dump
+static void prof_header(size_t *samples, size_t *est_bytes) {
+    FILE *f = tmpfile();
+    EXPECT(f != NULL);
+    EXPECT(t_prof_dump(fileno(f)) == 0);
+    rewind(f);
+    size_t sites = 0, period = 0;
+    EXPECT(fscanf(f, "heap profile: %zu sites, %zu live samples, %zu bytes estimated live, sampling every %zu bytes",
+                  &sites, samples, est_bytes, &period) == 4);
+    fclose(f);
+}
+
+static void test_heap_profile(alloc_strat_e strat) {
+    EXPECT(t_set_param(TDMM_PARAM_PROF_SAMPLE_BYTES, 4096) == 0);
+    reset_and_init(strat);
+
+    enum { N = 512 };
+    static void *small[N], *mid[N];
+    for (int i = 0; i < N; i++) {
+        small[i] = t_malloc(64);
+        mid[i] = t_malloc(1000);
+        EXPECT(small[i] && mid[i]);
+    }
+    // About 130 samples standing for the 544768 bytes allocated
+    size_t samples, est;
+    prof_header(&samples, &est);
+    EXPECT(samples > 0);
+    EXPECT(est > N * 1064 / 2 && est < N * 1064 * 2);
+
+    for (int i = 0; i < N; i++) {
+        t_free(small[i]);
+        t_free(mid[i]);
+    }
+    prof_header(&samples, &est);
+    EXPECT(samples == 0);
+    EXPECT(est == 0);
+
+    EXPECT(t_set_param(TDMM_PARAM_PROF_SAMPLE_BYTES, 0) == 0);
+    reset_and_init(strat);
+}
+
+static void test_heap_handles(alloc_strat_e strat) {
+    reset_and_init(strat);
+    void *global = t_malloc(200);
+    EXPECT(global != NULL);
+    tdmm_stats_t before = stats_now();
+
+    t_heap_t *h = t_heap_create(strat);
+    EXPECT(h != NULL);
+    void *first = t_heap_malloc(h, 100);
+    EXPECT(first != NULL);
+    enum { N = 2000 };
+    static void *ptrs[N];
+    for (int i = 0; i < N; i++) {
+        size_t sz = 16 + (size_t)(i * 37) % 5000;
+        ptrs[i] = t_heap_malloc(h, sz);
+        EXPECT(ptrs[i] != NULL);
+        EXPECT((uintptr_t)ptrs[i] % TDMM_MIN_ALIGNMENT == 0);
+        memset(ptrs[i], i, sz);
+    }
+    for (int i = 0; i < N; i += 3) t_heap_free(h, ptrs[i]);
+    // Blocks of another heap are not the default heap's to free
+    t_free(ptrs[1]);
+    t_heap_free(h, global);
+
+    // The default heap never saw any of it
+    tdmm_stats_t after = stats_now();
+    EXPECT(after.cur_inuse_bytes == before.cur_inuse_bytes);
+    EXPECT(after.block_count == before.block_count);
+
+    // After a reset the heap hands out its first block again
+    t_heap_reset(h);
+    EXPECT(t_heap_malloc(h, 100) == first);
+    t_heap_destroy(h);
+
+    // NULL is the default heap
+    void *p = t_heap_malloc(NULL, 64);
+    EXPECT(p != NULL);
+    t_heap_free(NULL, p);
+    t_free(global);
+    EXPECT(stats_now().cur_inuse_bytes == 0);
+}
+
+static void test_fit_order(alloc_strat_e strat) {
+    if (strat != NEXT_FIT && strat != ADDRESS_ORDERED_FIRST_FIT) return;
+    reset_and_init(strat);
+
+    // Two equal holes separated by live blocks
+    void *a = t_malloc(2048);
+    void *s1 = t_malloc(2048);
+    void *b = t_malloc(2048);
+    void *s2 = t_malloc(2048);
+    EXPECT(a && s1 && b && s2);
+    t_free(a);
+    t_free(b);
+
+    void *c = t_malloc(2048);
+    void *d = t_malloc(2048);
+    EXPECT(c && d);
+    if (strat == ADDRESS_ORDERED_FIRST_FIT) {
+        // Lowest-addressed fits, like FIRST_FIT
+        EXPECT(c == a);
+        EXPECT(d == b);
+    } else {
+        // The rover stays past s2, so both come from the untouched tail
+        EXPECT((uintptr_t)c > (uintptr_t)s2);
+        EXPECT((uintptr_t)d > (uintptr_t)c);
+    }
+
+    t_free(c);
+    t_free(d);
+    t_free(s1);
+    t_free(s2);
+}
+
 static void test_coalesce_all(alloc_strat_e strat) {
     reset_and_init(strat);
 
-    size_t before = t_overhead_bytes();
+    size_t before = stats_now().overhead_bytes;
 
-    void *a = t_malloc(256);
-    void *b = t_malloc(256);
-    void *c = t_malloc(256);
+    // Above the slab limit, so each is a heap block with its own header
+    void *a = t_malloc(384);
+    void *b = t_malloc(384);
+    void *c = t_malloc(384);
     EXPECT(a && b && c);
 
-    size_t during = t_overhead_bytes();
-    EXPECT(during >= before);
+    size_t during = stats_now().overhead_bytes;
+    EXPECT(during > before);
 
     t_free(a);
     t_free(b);
     t_free(c);
-    size_t after = t_overhead_bytes();
+    size_t after = stats_now().overhead_bytes;
     EXPECT(after <= during);
 }
 
@@ -111,6 +380,26 @@ static void test_double_free_safe(alloc_strat_e strat) {
     t_free(q);
 }
 
+static void test_slab_double_free_safe(alloc_strat_e strat) {
+    reset_and_init(strat);
+
+    // Without the thread cache the second free reaches the slab page itself
+    EXPECT(t_set_param(TDMM_PARAM_TCACHE_MAX_BYTES, 0) == 0);
+    void *a = t_malloc(32);
+    EXPECT(a);
+    t_free(a);
+    t_free(a);
+    EXPECT(t_usable_size(a) == 0);
+
+    void *p = t_malloc(32);
+    void *q = t_malloc(32);
+    EXPECT(p && q);
+    EXPECT(p != q);
+    t_free(p);
+    t_free(q);
+    EXPECT(stats_now().cur_inuse_bytes == 0);
+}
+
 static void test_invalid_free_safe(alloc_strat_e strat) {
     reset_and_init(strat);
 
@@ -125,26 +414,146 @@ static void test_invalid_free_safe(alloc_strat_e strat) {
 
 static void test_inuse_bookkeeping(alloc_strat_e strat) {
     reset_and_init(strat);
-    const tdmm_metrics_t *m = t_metrics_ptr();
+    tdmm_stats_t m = stats_now();
 
     void *a = t_malloc(10);
     void *b = t_malloc(10);
     EXPECT(a && b);
 
-    EXPECT(m->cur_inuse_bytes > 0);
-    EXPECT(m->cur_inuse_bytes <= m->bytes_from_os);
+    m = stats_now();
+    EXPECT(m.cur_inuse_bytes > 0);
+    EXPECT(m.cur_inuse_bytes <= m.bytes_from_os);
 
     t_free(a);
     t_free(b);
 
-    EXPECT(m->cur_inuse_bytes == 0);
-    EXPECT(m->peak_inuse_bytes > 0);
+    m = stats_now();
+    EXPECT(m.cur_inuse_bytes == 0);
+    EXPECT(m.peak_inuse_bound_bytes > 0);
+}
+
+static size_t histogram_total(const tdmm_stats_t *s) {
+    size_t n = 0;
+    for (size_t i = 0; i < TDMM_STATS_BINS; i++) n += s->free_histogram[i];
+    return n;
+}
+
+static void test_stats_counters(alloc_strat_e strat) {
+    reset_and_init(strat);
+
+    tdmm_stats_t s = stats_now();
+    EXPECT(s.block_count == 1);
+    EXPECT(s.free_block_count == 1);
+    EXPECT(s.largest_free_block == s.free_bytes);
+    EXPECT(histogram_total(&s) == 1);
+    size_t overhead_before = s.overhead_bytes;
+
+    // Above the thread-cache limit, so every call reaches the heap, and
+    // merged on free rather than parked in fast bins
+    EXPECT(t_set_param(TDMM_PARAM_FASTBIN_MAX_BYTES, 0) == 0);
+    void *a = t_malloc(1000);
+    void *b = t_malloc(2000);
+    void *c = t_malloc(3000);
+    EXPECT(a && b && c);
+    s = stats_now();
+    EXPECT(s.block_count == 4);
+    EXPECT(s.free_block_count == 1);
+    EXPECT(s.largest_free_block == s.free_bytes);
+    EXPECT(s.overhead_bytes > overhead_before);
+
+    size_t b_size = t_usable_size(b);
+    t_free(b);
+    s = stats_now();
+    EXPECT(s.free_block_count == 2);
+    EXPECT(histogram_total(&s) == 2);
+    EXPECT(s.largest_free_block < s.free_bytes);
+    // The tail, alone in the top bin, is the largest block
+    EXPECT(s.largest_free_block == s.free_bytes - b_size);
+
+    t_free(a);
+    s = stats_now();
+    EXPECT(s.block_count == 3);
+    EXPECT(s.free_block_count == 2);
+
+    t_free(c);
+    s = stats_now();
+    EXPECT(s.block_count == 1);
+    EXPECT(s.free_block_count == 1);
+    EXPECT(s.largest_free_block == s.free_bytes);
+    EXPECT(s.overhead_bytes == overhead_before);
+    EXPECT(s.num_util > 0);
+    EXPECT(s.util_sum >= 0.0 && s.util_sum <= (double)s.num_util);
+}
+
+// Two free blocks share the top histogram bin; handing out the larger must
+// not leave its size behind as the largest free block. Both are bigger than
+// the heap's tail. The request is a TLSF class boundary below x, so every
+// strategy takes x, whatever the payload alignment adds.
+static void test_largest_free_exact(alloc_strat_e strat) {
+    reset_and_init(strat);
+    EXPECT(t_set_param(TDMM_PARAM_TCACHE_MAX_BYTES, 0) == 0);
+    EXPECT(t_set_param(TDMM_PARAM_MMAP_THRESHOLD, 0) == 0);
+
+    void *x = t_malloc(1536u * 1024u);
+    void *g1 = t_malloc(4000);
+    void *y = t_malloc(1280u * 1024u);
+    void *g2 = t_malloc(4000);
+    EXPECT(x && g1 && y && g2);
+    size_t x_size = t_usable_size(x);
+    size_t y_size = t_usable_size(y);
+    t_free(x);
+    t_free(y);
+    EXPECT(stats_now().largest_free_block == x_size);
+
+    void *p = t_malloc(1504u * 1024u);
+    EXPECT(p == x);
+    EXPECT(stats_now().largest_free_block == y_size);
+
+    t_free(p);
+    EXPECT(stats_now().largest_free_block == x_size);
+    t_free(g1);
+    t_free(g2);
+    EXPECT(stats_now().cur_inuse_bytes == 0);
+}
+
+static void test_slab_small_objects(alloc_strat_e strat) {
+    reset_and_init(strat);
+    size_t overhead_before = stats_now().overhead_bytes;
+
+    enum { N = 4000 };
+    static void *ptrs[N];
+    for (int i = 0; i < N; i++) {
+        ptrs[i] = t_malloc(24);
+        EXPECT(ptrs[i] != NULL);
+        EXPECT(((uintptr_t)ptrs[i] % 16u) == 0u);
+        memset(ptrs[i], i & 0xFF, 24);
+    }
+    for (int i = 0; i < N; i++) EXPECT(((unsigned char *)ptrs[i])[23] == (i & 0xFF));
+
+    // Small objects carry no block header and leave the block list alone
+    tdmm_stats_t s = stats_now();
+    EXPECT(s.block_count == 1);
+    EXPECT(s.slab_pages >= 1);
+    EXPECT(s.cur_inuse_bytes == (size_t)N * 32);
+    EXPECT(s.overhead_bytes - overhead_before < (size_t)N);
+
+    for (int i = 0; i < N; i += 2) t_free(ptrs[i]);
+    for (int i = 1; i < N; i += 2) t_free_sized(ptrs[i], 24);
+    EXPECT(stats_now().cur_inuse_bytes == 0);
+
+    // Disabling the slab sends small requests back to the block heap
+    EXPECT(t_set_param(TDMM_PARAM_SLAB_MAX_BYTES, 0) == 0);
+    EXPECT(t_set_param(TDMM_PARAM_TCACHE_MAX_BYTES, 0) == 0);
+    void *p = t_malloc(24);
+    EXPECT(p != NULL);
+    EXPECT(stats_now().block_count == 2);
+    t_free_sized(p, 24);
+    EXPECT(stats_now().cur_inuse_bytes == 0);
 }
 
 static void test_out_of_memory_returns_null(alloc_strat_e strat) {
     reset_and_init(strat);
-    const tdmm_metrics_t *m = t_metrics_ptr();
-    size_t too_big = m->bytes_from_os;
+    size_t too_big = SIZE_MAX / 2;
 
     void *p = t_malloc(too_big);
     EXPECT(p == NULL);
@@ -153,25 +562,542 @@ static void test_out_of_memory_returns_null(alloc_strat_e strat) {
     t_free(q);
 }
 
+static void test_heap_grows_on_demand(alloc_strat_e strat) {
+    reset_and_init(strat);
+    tdmm_stats_t m = stats_now();
+    size_t initial = m.bytes_from_os;
+
+    // More than the initial commit in total, so the heap must map more chunks
+    enum { PIECES = 96 };
+    void *p[PIECES];
+    for (size_t i = 0; i < PIECES; i++) {
+        p[i] = t_malloc(32 * 1024);
+        EXPECT(p[i] != NULL);
+        memset(p[i], (int)i, 32 * 1024);
+    }
+    m = stats_now();
+    EXPECT(m.bytes_from_os > initial);
+    EXPECT(((unsigned char *)p[0])[0] == 0);
+
+    for (size_t i = 0; i < PIECES; i++) t_free(p[i]);
+    EXPECT(stats_now().cur_inuse_bytes == 0);
+}
+
+static void test_large_alloc_own_mapping(alloc_strat_e strat) {
+    reset_and_init(strat);
+    tdmm_stats_t m = stats_now();
+    size_t os_before = m.bytes_from_os;
+
+    size_t big = 4u * 1024u * 1024u;
+    void *p = t_malloc(big);
+    EXPECT(p != NULL);
+    EXPECT(((uintptr_t)p % 16u) == 0u);
+    memset(p, 0x77, big);
+    m = stats_now();
+    EXPECT(m.bytes_from_os >= os_before + big);
+
+    t_free((char *)p + 4096);
+    t_free(p);
+    t_free(p);
+    m = stats_now();
+    EXPECT(m.cur_inuse_bytes == 0);
+    EXPECT(m.bytes_from_os == os_before);
+
+    EXPECT(t_set_param(TDMM_PARAM_MMAP_THRESHOLD, 0) == 0);
+    void *q = t_malloc(big);
+    EXPECT(q != NULL);
+    EXPECT(stats_now().bytes_from_os > os_before);
+    t_free(q);
+    EXPECT(t_set_param(TDMM_PARAM_MMAP_THRESHOLD, TDMM_DEFAULT_MMAP_THRESHOLD) == 0);
+
+    // A mapping split by mprotect cannot be mremapped, so realloc copies
+    os_before = stats_now().bytes_from_os;
+    unsigned char *r = t_malloc(big);
+    EXPECT(r != NULL);
+    for (size_t i = 0; i < big; i += 4096) r[i] = (unsigned char)(i >> 12);
+    uintptr_t last = ((uintptr_t)r + big - 1) & ~(uintptr_t)4095;
+    EXPECT(mprotect((void *)last, 4096, PROT_READ) == 0);
+    unsigned char *s = t_realloc(r, 2 * big);
+    EXPECT(s != NULL && s != r);
+    for (size_t i = 0; i < big; i += 4096) EXPECT(s[i] == (unsigned char)(i >> 12));
+    t_free(s);
+    EXPECT(stats_now().bytes_from_os == os_before);
+}
+
+static void test_realloc_in_place(alloc_strat_e strat) {
+    reset_and_init(strat);
+
+    // The first block is followed by the free tail, so growth stays in place
+    unsigned char *p = t_malloc(1024);
+    EXPECT(p != NULL);
+    for (size_t i = 0; i < 1024; i++) p[i] = (unsigned char)i;
+    for (size_t sz = 2048; sz <= 64 * 1024; sz *= 2) {
+        unsigned char *q = t_realloc(p, sz);
+        EXPECT(q == p);
+    }
+    unsigned char *q = t_realloc(p, 1500);
+    EXPECT(q == p);
+    for (size_t i = 0; i < 1024; i++) EXPECT(p[i] == (unsigned char)i);
+
+    // A live neighbor forces a move
+    void *fence = t_malloc(1024);
+    EXPECT(fence != NULL);
+    q = t_realloc(p, 128 * 1024 - 1);
+    EXPECT(q != NULL && q != p);
+    for (size_t i = 0; i < 1024; i++) EXPECT(q[i] == (unsigned char)i);
+
+    // Past the mmap threshold the block moves to its own mapping and keeps growing there
+    p = t_realloc(q, 512 * 1024);
+    EXPECT(p != NULL);
+    p = t_realloc(p, 4 * 1024 * 1024);
+    EXPECT(p != NULL);
+    for (size_t i = 0; i < 1024; i++) EXPECT(p[i] == (unsigned char)i);
+    EXPECT(stats_now().large_count == 1);
+
+    EXPECT(t_realloc(NULL, 0) == NULL);
+    EXPECT(t_realloc(p, 0) == NULL);
+    t_free(fence);
+    EXPECT(stats_now().cur_inuse_bytes == 0);
+}
+
+static int all_zero(const unsigned char *p, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (p[i]) return 0;
+    }
+    return 1;
+}
+
+static void test_calloc_zeroes(alloc_strat_e strat) {
+    reset_and_init(strat);
+
+    EXPECT(t_calloc(SIZE_MAX / 2, 4) == NULL);
+    EXPECT(t_calloc(0, 16) == NULL);
+
+    // Dirty a stretch of the heap, then hand it back out through t_calloc
+    static const size_t sizes[] = { 24, 200, 700, 3000, 20000, 90000 };
+    enum { N = sizeof(sizes) / sizeof(sizes[0]) };
+    void *dirty[N];
+    for (size_t i = 0; i < N; i++) {
+        dirty[i] = t_malloc(sizes[i]);
+        EXPECT(dirty[i] != NULL);
+        memset(dirty[i], 0xCD, sizes[i]);
+    }
+    for (size_t i = 0; i < N; i++) t_free(dirty[i]);
+
+    for (size_t i = 0; i < N; i++) {
+        dirty[i] = t_calloc(1, sizes[N - 1 - i]);
+        EXPECT(dirty[i] != NULL);
+        EXPECT(all_zero(dirty[i], sizes[N - 1 - i]));
+    }
+    // Served partly from memory nothing has touched yet
+    unsigned char *fresh = t_calloc(300, 1000);
+    EXPECT(fresh != NULL);
+    EXPECT(all_zero(fresh, 300 * 1000));
+
+    for (size_t i = 0; i < N; i++) t_free(dirty[i]);
+    t_free(fresh);
+    EXPECT(stats_now().cur_inuse_bytes == 0);
+}
+
+static void test_random_churn_integrity(alloc_strat_e strat) {
+    reset_and_init(strat);
+
+    enum { SLOTS = 512 };
+    void *ptrs[SLOTS] = {0};
+    size_t sizes[SLOTS] = {0};
+    uint32_t rng = 0x1234567u;
+
+    for (int op = 0; op < 20000; op++) {
+        rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+        size_t i = rng % SLOTS;
+        if (ptrs[i]) {
+            unsigned char *c = (unsigned char *)ptrs[i];
+            for (size_t k = 0; k < sizes[i]; k++) EXPECT(c[k] == (unsigned char)i);
+            t_free(ptrs[i]);
+            ptrs[i] = NULL;
+        } else {
+            sizes[i] = 1 + (rng >> 8) % 2048;
+            ptrs[i] = t_malloc(sizes[i]);
+            EXPECT(ptrs[i] != NULL);
+            memset(ptrs[i], (int)i, sizes[i]);
+        }
+    }
+    for (size_t i = 0; i < SLOTS; i++) {
+        if (ptrs[i]) t_free(ptrs[i]);
+    }
+    EXPECT(stats_now().cur_inuse_bytes == 0);
+}
+
+// A list of nodes linked by offsets from the root, so it survives the heap
+// moving
+typedef struct {
+    uint32_t next;
+    uint32_t value;
+    char fill[200];
+} pnode_t;
+
+static void test_persistent_heap(alloc_strat_e strat) {
+    char path[] = "/tmp/tdmm_heap_XXXXXX";
+    int fd = mkstemp(path);
+    EXPECT(fd >= 0);
+    close(fd);
+
+    // Too small to reserve, then a real one
+    EXPECT(t_heap_open(path, 4096, strat) == NULL);
+    t_heap_t *h = t_heap_open(path, 64u * 1024 * 1024, strat);
+    EXPECT(h != NULL);
+    EXPECT(t_heap_open(path, 0, strat) == NULL);   // already open
+    EXPECT(t_heap_root(h) == NULL);
+
+    // Enough nodes that the heap grows the file past its first chunk
+    enum { N = 20000 };
+    char *root = t_heap_malloc(h, 64);
+    EXPECT(root != NULL);
+    t_heap_set_root(h, root);
+    uint32_t *head = (uint32_t *)root;
+    *head = 0;
+    for (uint32_t i = 0; i < N; i++) {
+        pnode_t *n = t_heap_malloc(h, sizeof(pnode_t));
+        EXPECT(n != NULL);
+        n->value = i;
+        memset(n->fill, (int)(i & 0xff), sizeof(n->fill));
+        n->next = *head;
+        *head = (uint32_t)((char *)n - root);
+    }
+    EXPECT(t_heap_sync(h) == 0);
+    EXPECT(t_heap_sync(NULL) == -1);
+    t_heap_destroy(h);
+
+    // Reopen at the old base: pointers stay valid
+    h = t_heap_open(path, 0, strat);
+    EXPECT(h != NULL);
+    EXPECT(t_heap_root(h) == root);
+
+    // Reopen with the old base taken
+    t_heap_destroy(h);
+    int rfd = open(path, O_RDONLY);
+    EXPECT(rfd >= 0);
+    void *page = (void *)((uintptr_t)root & ~(uintptr_t)4095);
+    void *blocker = mmap(page, 4096, PROT_READ, MAP_PRIVATE | MAP_FIXED, rfd, 0);
+    EXPECT(blocker == page);
+    h = t_heap_open(path, 0, strat);
+    EXPECT(h != NULL);
+    char *moved = t_heap_root(h);
+    EXPECT(moved != NULL && moved != root);
+    uint32_t count = 0;
+    for (uint32_t off = *(uint32_t *)moved; off; count++) {
+        pnode_t *n = (pnode_t *)(moved + off);
+        EXPECT(n->value == N - 1 - count);
+        EXPECT(n->fill[0] == (char)(n->value & 0xff) && n->fill[sizeof(n->fill) - 1] == n->fill[0]);
+        off = n->next;
+        if (n->value % 2) t_heap_free(h, n);
+    }
+    EXPECT(count == N);
+    // The heap keeps working where it landed
+    for (int i = 0; i < 1000; i++) EXPECT(t_heap_malloc(h, 100 + (size_t)i) != NULL);
+    t_heap_reset(h);
+    EXPECT(t_heap_root(h) == NULL);
+    t_heap_destroy(h);
+    munmap(blocker, 4096);
+    close(rfd);
+
+    // A file that is not a heap is left alone
+    fd = open(path, O_WRONLY | O_TRUNC);
+    EXPECT(fd >= 0);
+    EXPECT(write(fd, "not a heap", 10) == 10);
+    close(fd);
+    EXPECT(t_heap_open(path, 0, strat) == NULL);
+    unlink(path);
+}
+
+// Runs a fixed churn on a fresh heap and records where each allocation
+// landed, relative to the first
+static void heap_placements(alloc_strat_e strat, size_t *offs, size_t n) {
+    enum { SLOTS = 64 };
+    void *ptrs[SLOTS] = {0};
+    uint32_t rng = 0x9e3779b9u;
+    t_heap_t *h = t_heap_create(strat);
+    EXPECT(h != NULL);
+    char *base = t_heap_malloc(h, 16);
+    EXPECT(base != NULL);
+
+    for (size_t op = 0; op < n; op++) {
+        rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+        size_t i = rng % SLOTS;
+        offs[op] = 0;
+        if (ptrs[i]) {
+            t_heap_free(h, ptrs[i]);
+            ptrs[i] = NULL;
+        } else {
+            ptrs[i] = t_heap_malloc(h, 1 + (rng >> 8) % 4096);
+            EXPECT(ptrs[i] != NULL);
+            offs[op] = (size_t)((char *)ptrs[i] - base);
+        }
+    }
+    t_heap_reset(h);
+    EXPECT(t_heap_malloc(h, 16) == base);
+    t_heap_destroy(h);
+}
+
+// The SoA index must pick the same blocks as the strategy's own index
+static void test_soa_index(alloc_strat_e strat) {
+    EXPECT(t_set_param(TDMM_PARAM_SOA_INDEX, 2) == -1);
+    if (strat != FIRST_FIT && strat != BEST_FIT && strat != WORST_FIT) return;
+
+    enum { OPS = 4000 };
+    static size_t plain[OPS], soa[OPS];
+    reset_and_init(strat);
+    heap_placements(strat, plain, OPS);
+
+    EXPECT(t_set_param(TDMM_PARAM_SOA_INDEX, 1) == 0);
+    reset_and_init(strat);
+    heap_placements(strat, soa, OPS);
+    for (size_t i = 0; i < OPS; i++) EXPECT(plain[i] == soa[i]);
+
+    // The default heap too, with its caches in front
+    test_random_churn_integrity(strat);
+    EXPECT(t_set_param(TDMM_PARAM_SOA_INDEX, 0) == 0);
+    reset_and_init(strat);
+}
+
+typedef struct {
+    uint32_t seed;
+    void **handoff;  // objects this thread allocates for its neighbor to free
+    size_t count;
+} churn_job_t;
+
+static void *thread_churn_worker(void *arg) {
+    churn_job_t *job = (churn_job_t *)arg;
+    enum { SLOTS = 128 };
+    void *ptrs[SLOTS] = {0};
+    uint32_t rng = job->seed;
+    unsigned char tag = (unsigned char)job->seed;
+
+    for (int op = 0; op < 20000; op++) {
+        rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+        size_t i = rng % SLOTS;
+        size_t sz = 8 + (i * 7) % 600;
+        if (ptrs[i]) {
+            unsigned char *c = (unsigned char *)ptrs[i];
+            for (size_t k = 0; k < sz; k++) EXPECT(c[k] == tag);
+            t_free(ptrs[i]);
+            ptrs[i] = NULL;
+        } else {
+            ptrs[i] = t_malloc(sz);
+            EXPECT(ptrs[i] != NULL);
+            memset(ptrs[i], tag, sz);
+        }
+    }
+    for (size_t i = 0; i < SLOTS; i++) {
+        if (ptrs[i]) t_free(ptrs[i]);
+    }
+    for (size_t i = 0; i < job->count; i++) {
+        job->handoff[i] = t_malloc(48);
+        EXPECT(job->handoff[i] != NULL);
+    }
+    return NULL;
+}
+
+static void test_threads_concurrent_churn(alloc_strat_e strat) {
+    // One arena per thread, so handoff frees cross arenas
+    EXPECT(t_set_param(TDMM_PARAM_ARENAS, 4) == 0);
+    reset_and_init(strat);
+
+    enum { THREADS = 4, HANDOFF = 256 };
+    pthread_t tids[THREADS];
+    churn_job_t jobs[THREADS];
+    void *handoff[THREADS][HANDOFF];
+
+    for (int t = 0; t < THREADS; t++) {
+        jobs[t] = (churn_job_t){ 0xA5A5u + 77u * (uint32_t)t, handoff[t], HANDOFF };
+        EXPECT(pthread_create(&tids[t], NULL, thread_churn_worker, &jobs[t]) == 0);
+    }
+    for (int t = 0; t < THREADS; t++) EXPECT(pthread_join(tids[t], NULL) == 0);
+
+    // Objects allocated by threads that have exited are freed from this one
+    for (int t = 0; t < THREADS; t++) {
+        for (int i = 0; i < HANDOFF; i++) t_free(handoff[t][i]);
+    }
+    EXPECT(stats_now().cur_inuse_bytes == 0);
+    EXPECT(t_set_param(TDMM_PARAM_ARENAS, 0) == 0);
+}
+
+typedef struct {
+    t_heap_t *heap;
+    uint32_t seed;
+    int *stop;
+} fork_job_t;
+
+// Keeps every allocator lock busy: slab objects, blocks, separate mappings,
+// heap handle blocks and, with sampling on, the profiler
+static void *fork_churn_worker(void *arg) {
+    fork_job_t *job = (fork_job_t *)arg;
+    static const size_t sizes[] = { 24, 200, 3000, 256u * 1024u };
+    uint32_t rng = job->seed;
+    while (!__atomic_load_n(job->stop, __ATOMIC_RELAXED)) {
+        rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+        void *p = t_malloc(sizes[rng % 4]);
+        void *h = t_heap_malloc(job->heap, 64);
+        EXPECT(p && h);
+        t_free(p);
+        t_heap_free(job->heap, h);
+    }
+    return NULL;
+}
+
+static void test_fork_under_contention(alloc_strat_e strat) {
+    EXPECT(t_set_param(TDMM_PARAM_ARENAS, 4) == 0);
+    EXPECT(t_set_param(TDMM_PARAM_PROF_SAMPLE_BYTES, 4096) == 0);
+    reset_and_init(strat);
+    t_heap_t *heap = t_heap_create(strat);
+    EXPECT(heap);
+
+    enum { THREADS = 4, FORKS = 50 };
+    pthread_t tids[THREADS];
+    fork_job_t jobs[THREADS];
+    int stop = 0;
+    for (int t = 0; t < THREADS; t++) {
+        jobs[t] = (fork_job_t){ heap, 0x5EEDu + 31u * (uint32_t)t, &stop };
+        EXPECT(pthread_create(&tids[t], NULL, fork_churn_worker, &jobs[t]) == 0);
+    }
+
+    // A child that inherited a held lock would hang; the alarm turns that into a kill
+    for (int i = 0; i < FORKS; i++) {
+        pid_t pid = fork();
+        EXPECT(pid >= 0);
+        if (pid == 0) {
+            alarm(10);
+            void *a = t_malloc(24);
+            void *b = t_malloc(3000);
+            void *c = t_malloc(256u * 1024u);
+            void *h = t_heap_malloc(heap, 64);
+            if (!a || !b || !c || !h) _exit(1);
+            t_free(a);
+            t_free(b);
+            t_free(c);
+            t_heap_free(heap, h);
+            tdmm_stats_t s;
+            t_stats(&s);
+            _exit(0);
+        }
+        int status;
+        EXPECT(waitpid(pid, &status, 0) == pid);
+        EXPECT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    for (int t = 0; t < THREADS; t++) EXPECT(pthread_join(tids[t], NULL) == 0);
+    t_heap_destroy(heap);
+    EXPECT(t_set_param(TDMM_PARAM_PROF_SAMPLE_BYTES, 0) == 0);
+    EXPECT(t_set_param(TDMM_PARAM_ARENAS, 0) == 0);
+}
+
+typedef struct {
+    void **slots;
+    int n;
+    pthread_barrier_t *barrier;
+} remote_job_t;
+
+// Fills the slots twice, letting the main thread free them in between
+static void *remote_producer(void *arg) {
+    remote_job_t *job = (remote_job_t *)arg;
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < job->n; i++) {
+            job->slots[i] = t_malloc(2048);
+            EXPECT(job->slots[i] != NULL);
+            memset(job->slots[i], 0x3C, 2048);
+        }
+        pthread_barrier_wait(job->barrier);
+        pthread_barrier_wait(job->barrier);
+    }
+    return NULL;
+}
+
+static void test_remote_free_across_arenas(alloc_strat_e strat) {
+    EXPECT(t_set_param(TDMM_PARAM_ARENAS, 2) == 0);
+    reset_and_init(strat);
+
+    // Pin this thread to the first arena so the producer gets the second
+    void *mine = t_malloc(2048);
+    EXPECT(mine != NULL);
+    size_t mine_bytes = stats_now().cur_inuse_bytes;
+
+    enum { N = 512 };
+    void *slots[N];
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, 2);
+    remote_job_t job = { slots, N, &barrier };
+    pthread_t tid;
+    EXPECT(pthread_create(&tid, NULL, remote_producer, &job) == 0);
+
+    size_t os_bytes = 0;
+    for (int round = 0; round < 2; round++) {
+        pthread_barrier_wait(&barrier);
+        // Too large for the thread cache, so these go onto the producer arena's remote list
+        for (int i = 0; i < N; i++) t_free(slots[i]);
+        tdmm_stats_t m = stats_now();
+        EXPECT(m.cur_inuse_bytes == mine_bytes);
+        // The drained blocks are reused rather than growing the producer's arena
+        if (round == 0) os_bytes = m.bytes_from_os;
+        else EXPECT(m.bytes_from_os == os_bytes);
+        pthread_barrier_wait(&barrier);
+    }
+    EXPECT(pthread_join(tid, NULL) == 0);
+    pthread_barrier_destroy(&barrier);
+
+    t_free(mine);
+    EXPECT(stats_now().cur_inuse_bytes == 0);
+    EXPECT(t_set_param(TDMM_PARAM_ARENAS, 0) == 0);
+}
+
 static void run_all_for_policy(alloc_strat_e strat) {
     printf("== Running unit tests for %d ==\n", (int)strat);
 
     test_alignment(strat);
     test_non_overlap_simple(strat);
     test_split_and_reuse(strat);
+    test_aligned_alloc(strat);
+    test_realloc_in_place(strat);
+    test_calloc_zeroes(strat);
+    test_fast_bins(strat);
+    test_batch_alloc_free(strat);
+    test_huge_page_backing(strat);
+    test_heap_profile(strat);
+    test_heap_handles(strat);
+    test_soa_index(strat);
+    test_persistent_heap(strat);
+    test_fit_order(strat);
     test_coalesce_all(strat);
     test_double_free_safe(strat);
+    test_slab_double_free_safe(strat);
     test_invalid_free_safe(strat);
     test_inuse_bookkeeping(strat);
+    test_stats_counters(strat);
+    test_largest_free_exact(strat);
+    test_slab_small_objects(strat);
     test_out_of_memory_returns_null(strat);
+    test_heap_grows_on_demand(strat);
+    test_large_alloc_own_mapping(strat);
+    test_random_churn_integrity(strat);
+    test_threads_concurrent_churn(strat);
+    test_remote_free_across_arenas(strat);
+    test_fork_under_contention(strat);
 
     printf("PASS: policy %d\n\n", (int)strat);
 }
 
 int main(void) {
+#ifdef TDMM_FIXED_STRATEGY
+    // t_init runs the built-in strategy whatever it is passed
+    run_all_for_policy(TDMM_FIXED_STRATEGY);
+#else
     run_all_for_policy(FIRST_FIT);
     run_all_for_policy(BEST_FIT);
     run_all_for_policy(WORST_FIT);
+    run_all_for_policy(TLSF);
+    run_all_for_policy(NEXT_FIT);
+    run_all_for_policy(ADDRESS_ORDERED_FIRST_FIT);
+#endif
 
     printf("ALL TESTS PASSED\n");
     return 0;
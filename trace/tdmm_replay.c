@@ -0,0 +1,250 @@
+#define _POSIX_C_SOURCE 200809L
+
+// Replays a trace recorded by the preload library (TDMM_TRACE=<path>)
+// against each strategy and writes the same CSVs as hw6:
+//
+//   tdmm_replay <trace> [POLICY...]
+//
+// replay_util_<POLICY>.csv has the util_trace_*.csv columns and
+// replay_runtime_<POLICY>.csv has the runtime_*.csv columns.
+#include "tdmm.h"
+#include "tdmm_trace.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static const struct {
+    const char *name;
+    alloc_strat_e strat;
+} g_policies[] = {
+    { "FIRST_FIT", FIRST_FIT },
+    { "BEST_FIT", BEST_FIT },
+    { "WORST_FIT", WORST_FIT },
+    { "TLSF", TLSF },
+    { "NEXT_FIT", NEXT_FIT },
+    { "ADDRESS_ORDERED_FIRST_FIT", ADDRESS_ORDERED_FIRST_FIT },
+};
+#define NPOLICIES (sizeof(g_policies) / sizeof(g_policies[0]))
+
+typedef struct {
+    const tdmm_trace_rec_t *recs;
+    size_t n;
+    void **objs;            // indexed by object id
+    uint32_t max_id;
+} trace_t;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static tdmm_stats_t stats_now(void) {
+    tdmm_stats_t s;
+    t_stats(&s);
+    return s;
+}
+
+static FILE *open_csv_or_die(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    setvbuf(f, NULL, _IOFBF, 1 << 20);
+    return f;
+}
+
+static const char *op_name(uint8_t op) {
+    switch (op) {
+        case TDMM_TRACE_MALLOC:  return "malloc";
+        case TDMM_TRACE_FREE:    return "free";
+        case TDMM_TRACE_REALLOC: return "realloc";
+        case TDMM_TRACE_CALLOC:  return "calloc";
+        case TDMM_TRACE_ALIGNED: return "aligned_alloc";
+        default:                 return "unknown";
+    }
+}
+
+// Maps the trace and checks it once up front, so replay loops index objs
+// without further validation
+static int trace_open(const char *path, trace_t *t) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(tdmm_trace_hdr_t)) {
+        fprintf(stderr, "%s: not a trace\n", path);
+        close(fd);
+        return 0;
+    }
+    void *mem = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        return 0;
+    }
+
+    const tdmm_trace_hdr_t *h = (const tdmm_trace_hdr_t *)mem;
+    if (h->magic != TDMM_TRACE_MAGIC || h->version != TDMM_TRACE_VERSION ||
+        h->record_size != sizeof(tdmm_trace_rec_t)) {
+        fprintf(stderr, "%s: unsupported trace format\n", path);
+        return 0;
+    }
+    t->recs = (const tdmm_trace_rec_t *)(h + 1);
+    t->n = ((size_t)st.st_size - sizeof(*h)) / sizeof(tdmm_trace_rec_t);
+    posix_madvise(mem, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+
+    // max_id is left 0 by a writer that did not exit cleanly
+    t->max_id = 0;
+    for (size_t i = 0; i < t->n; i++) {
+        if (t->recs[i].id > t->max_id) t->max_id = t->recs[i].id;
+    }
+    t->objs = (void **)calloc((size_t)t->max_id + 1, sizeof(void *));
+    if (!t->objs) {
+        fprintf(stderr, "calloc failed\n");
+        return 0;
+    }
+    return 1;
+}
+
+// The preload library asks tdmm for one byte where the program asked for
+// none, so recorded zero-sized objects exist and are freed later
+static inline size_t nonzero(size_t size) {
+    return size ? size : 1;
+}
+
+static inline void replay_one(void **objs, const tdmm_trace_rec_t *r) {
+    void **obj = &objs[r->id];
+    switch (r->op) {
+        case TDMM_TRACE_MALLOC:
+            *obj = t_malloc(nonzero(r->size));
+            break;
+        case TDMM_TRACE_CALLOC:
+            *obj = t_calloc(1, nonzero(r->size));
+            break;
+        case TDMM_TRACE_ALIGNED:
+            *obj = t_aligned_alloc((size_t)1 << r->align_log2, nonzero(r->size));
+            break;
+        case TDMM_TRACE_REALLOC: {
+            void *p = t_realloc(*obj, r->size);
+            if (p) *obj = p;
+            break;
+        }
+        case TDMM_TRACE_FREE:
+            t_free(*obj);
+            *obj = NULL;
+            break;
+    }
+}
+
+static void release_all(trace_t *t) {
+    for (size_t i = 0; i <= t->max_id; i++) {
+        if (t->objs[i]) t_free(t->objs[i]);
+        t->objs[i] = NULL;
+    }
+}
+
+static void replay_util_to_csv(trace_t *t, const char *name, alloc_strat_e strat) {
+    char path[128];
+    snprintf(path, sizeof(path), "replay_util_%s.csv", name);
+    FILE *out = open_csv_or_die(path);
+
+    fprintf(out, "policy,event,op,req_bytes,utilization,cur_inuse_bytes,overhead_bytes\n");
+
+    t_init(strat);
+    uint64_t event = 0;
+    size_t overhead_peak = 0;
+    for (size_t i = 0; i < t->n; i++) {
+        const tdmm_trace_rec_t *r = &t->recs[i];
+        replay_one(t->objs, r);
+
+        tdmm_stats_t m = stats_now();
+        double u = (m.bytes_from_os ? (double)m.cur_inuse_bytes / (double)m.bytes_from_os : 0.0);
+        size_t oh = m.overhead_bytes;
+        if (oh > overhead_peak) overhead_peak = oh;
+
+        if (i % 100 == 0) {
+            fprintf(out, "%s,%llu,%s,%llu,%.10f,%zu,%zu\n",
+                    name, (unsigned long long)event++, op_name(r->op),
+                    (unsigned long long)r->size, u, m.cur_inuse_bytes, oh);
+        }
+    }
+    release_all(t);
+
+    tdmm_stats_t m = stats_now();
+    double avg_u = (m.num_util ? (m.util_sum / (double)m.num_util) : 0.0);
+    double peak_u = (m.bytes_from_os ? (double)m.peak_inuse_bound_bytes / (double)m.bytes_from_os : 0.0);
+
+    fprintf(out, "SUMMARY,0,avg_util,0,%.10f,0,0\n", avg_u);
+    fprintf(out, "SUMMARY,0,peak_util,0,%.10f,0,0\n", peak_u);
+    fprintf(out, "SUMMARY,0,os_bytes,0,0.0,0,%zu\n", m.bytes_from_os);
+    fprintf(out, "SUMMARY,0,samples,0,0.0,%zu,0\n", m.num_util);
+    fprintf(out, "SUMMARY,0,overhead_end,0,0.0,0,%zu\n", m.overhead_bytes);
+    fprintf(out, "SUMMARY,0,overhead_peak,0,0.0,0,%zu\n", overhead_peak);
+    fclose(out);
+}
+
+static void replay_runtime_to_csv(trace_t *t, const char *name, alloc_strat_e strat) {
+    char path[128];
+    snprintf(path, sizeof(path), "replay_runtime_%s.csv", name);
+    FILE *out = open_csv_or_die(path);
+
+    fprintf(out, "policy,total_runtime_ns,avg_util,peak_util,os_bytes,samples,overhead_end,overhead_peak\n");
+
+    t_init(strat);
+    size_t overhead_peak = 0;
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < t->n; i++) {
+        replay_one(t->objs, &t->recs[i]);
+        if ((i & 255u) == 0u) {
+            size_t oh = stats_now().overhead_bytes;
+            if (oh > overhead_peak) overhead_peak = oh;
+        }
+    }
+    release_all(t);
+    uint64_t total = now_ns() - start;
+
+    tdmm_stats_t m = stats_now();
+    double avg_u = (m.num_util ? (m.util_sum / (double)m.num_util) : 0.0);
+    double peak_u = (m.bytes_from_os ? (double)m.peak_inuse_bound_bytes / (double)m.bytes_from_os : 0.0);
+    if (m.overhead_bytes > overhead_peak) overhead_peak = m.overhead_bytes;
+
+    fprintf(out, "%s,%llu,%.10f,%.10f,%zu,%zu,%zu,%zu\n",
+            name, (unsigned long long)total, avg_u, peak_u,
+            m.bytes_from_os, m.num_util, m.overhead_bytes, overhead_peak);
+    fclose(out);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <trace> [POLICY...]\n", argv[0]);
+        return 2;
+    }
+    trace_t t;
+    if (!trace_open(argv[1], &t)) return 1;
+
+    for (size_t i = 0; i < NPOLICIES; i++) {
+        int selected = argc == 2;
+        for (int a = 2; a < argc; a++) {
+            if (strcmp(argv[a], g_policies[i].name) == 0) selected = 1;
+        }
+        if (!selected) continue;
+        replay_runtime_to_csv(&t, g_policies[i].name, g_policies[i].strat);
+        replay_util_to_csv(&t, g_policies[i].name, g_policies[i].strat);
+    }
+
+    printf("Replayed %zu records (%u objects): replay_util_*.csv, replay_runtime_*.csv\n",
+           t.n, (unsigned)t.max_id);
+    free(t.objs);
+    return 0;
+}
@@ -0,0 +1,41 @@
+#ifndef TDMM_TRACE_H
+#define TDMM_TRACE_H
+
+#include <stdint.h>
+
+// Binary allocation trace: a header followed by fixed-size records, in the
+// host's byte order. Records are laid out so a replay can walk an mmap of the
+// file directly.
+#define TDMM_TRACE_MAGIC 0x314352544d4d4454ull  // "TDMMTRC1" on little-endian hosts
+#define TDMM_TRACE_VERSION 1u
+
+typedef enum {
+    TDMM_TRACE_MALLOC = 1,
+    TDMM_TRACE_FREE,
+    TDMM_TRACE_REALLOC,   // size is the new size; the object keeps its id
+    TDMM_TRACE_CALLOC,    // size is the total size
+    TDMM_TRACE_ALIGNED,   // align_log2 holds the alignment
+} tdmm_trace_op_e;
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t record_size;   // sizeof(tdmm_trace_rec_t)
+    uint32_t max_id;        // largest object id in the file; 0 if the writer did not finish
+    uint32_t reserved;
+    uint64_t start_ns;      // CLOCK_MONOTONIC when recording started
+} tdmm_trace_hdr_t;
+
+typedef struct {
+    uint64_t ts_ns;         // since start_ns
+    uint64_t size;          // requested bytes; 0 for frees
+    uint32_t id;            // object id, from 1, unique over the whole trace
+    uint8_t op;             // tdmm_trace_op_e
+    uint8_t align_log2;
+    uint16_t thread;        // recording thread, numbered from 0 in order of first use
+} tdmm_trace_rec_t;
+
+_Static_assert(sizeof(tdmm_trace_hdr_t) == 32, "trace header layout");
+_Static_assert(sizeof(tdmm_trace_rec_t) == 24, "trace record layout");
+
+#endif // TDMM_TRACE_H